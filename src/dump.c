@@ -53,6 +53,10 @@ static void clear_view(struct view *view)
 
 static void view_widget(struct widget *w, struct view *view, struct coord origin, struct rect clip)
 {
+	/* Hidden widgets may keep the windows from their last place. */
+	if (!(w->flags & FLAG_VISIBLE))
+		return;
+
 	struct coord my = {
 		.y = origin.y + w->ly,
 		.x = origin.x + w->lx,
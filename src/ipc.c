@@ -6,6 +6,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
@@ -13,28 +14,47 @@
 #include <errno.h>
 #include <err.h>
 
+#include <pthread.h>
+
 #include "macros.h"
 #include "ipc.h"
 
 /*
- * C: HELLO
- * S: TAKE <ID>
+ * C: HELLO [v2]
+ * S: TAKE <ID> [v2]
  * C: PAIR <ID> <KEY>=<VALUE>
  * C: DONE <ID>
  * S: RESPDATA <ID> <KEY>=<VALUE>
  * S: RESPONSE <ID> <STATUS> <MESSAGE>
  * C: PING
  * S: PONG
+ *
+ * After "TAKE <ID> v2" both sides switch to the binary framing described in
+ * ipc.h for the rest of the connection.
  */
 
 #define FIELD_DELIM " \t"
 
+/* Frames shorter than this are formatted on the stack. */
+#define IPC_STACK_FRAME 256
+
+/* Larger request buffers are released after use instead of kept. */
+#define IPC_REQBUF_KEEP (64 * 1024)
+
 static void sanitize_newlines(char *s) __attribute__((nonnull(1)));
 
 static ssize_t sendmsg_retry(int fd, const struct msghdr *msg, int flags) __attribute__((nonnull(2)));
 static ssize_t recvmsg_retry(int fd, struct msghdr *msg, int flags)       __attribute__((nonnull(2)));
 
 static ssize_t send_line(int fd, char *line) __attribute__((nonnull(2)));
+static bool ipc_send_reply(struct ipc_ctx *ctx, const char *fmt, ...)
+			__attribute__((nonnull(1, 2), __format__(printf, 2, 3)));
+static bool ipc_outbuf_vprintf(struct ipc_outbuf *b, const char *fmt, va_list ap)
+			__attribute__((nonnull(1, 2), __format__(printf, 2, 0)));
+static bool ipc_outbuf_vprintf_v2(struct ipc_outbuf *b, const char *fmt, va_list ap)
+			__attribute__((nonnull(1, 2), __format__(printf, 2, 0)));
+static int ipc_vformat(char *buf, size_t size, char **heap, const char *fmt, va_list ap)
+			__attribute__((nonnull(1, 3, 4), __format__(printf, 4, 0)));
 
 static bool handle_hllo(struct ipc_ctx *, struct ipc_token *) __attribute__((nonnull(1, 2)));
 static bool handle_take(struct ipc_ctx *, struct ipc_token *) __attribute__((nonnull(1, 2)));
@@ -42,10 +62,34 @@ static bool handle_pair(struct ipc_ctx *, struct ipc_token *) __attribute__((non
 static bool handle_done(struct ipc_ctx *, struct ipc_token *) __attribute__((nonnull(1, 2)));
 static bool handle_dummy(struct ipc_ctx *, struct ipc_token *) __attribute__((nonnull(1, 2)));
 static bool ipc_set_handler(struct ipc_token *tok) __attribute__((nonnull(1)));
-typedef bool (*send_pairs_fn)(struct ipc_ctx *, const char *, const void *) __attribute__((nonnull(1,2,3)));
-static bool send_pairs_raw(struct ipc_ctx *ctx, const char *id, const void *data) __attribute__((nonnull(1,2,3)));
-static bool send_pairs_kv(struct ipc_ctx *ctx, const char *id, const void *data) __attribute__((nonnull(1,2,3)));
-static bool ipc_send_message_common(struct ipc_ctx *ctx, send_pairs_fn send_pairs,
+static void ipc_request_finish(struct ipc_ctx *ctx, struct ipc_request *req, bool ok) __attribute__((nonnull(1, 2)));
+static bool ipc_outbuf_printf(struct ipc_outbuf *b, const char *fmt, ...)
+			__attribute__((nonnull(1, 2), __format__(printf, 2, 3)));
+static bool format_pairs_raw(struct ipc_outbuf *b, const char *id, const void *data) __attribute__((nonnull(1,2,3)));
+static bool format_pairs_kv(struct ipc_outbuf *b, const char *id, const void *data) __attribute__((nonnull(1,2,3)));
+static bool encode_pairs_raw(struct ipc_outbuf *b, const void *data) __attribute__((nonnull(1,2)));
+static bool encode_pairs_kv(struct ipc_outbuf *b, const void *data) __attribute__((nonnull(1,2)));
+
+/*
+ * How the pairs of a request are added to the request buffer: one PAIR frame
+ * each in the text protocol or all entries in one frame in the binary one.
+ */
+struct pairs_ops {
+	bool (*format)(struct ipc_outbuf *b, const char *id, const void *data);
+	bool (*encode)(struct ipc_outbuf *b, const void *data);
+};
+
+static const struct pairs_ops pairs_raw = {
+	.format = format_pairs_raw,
+	.encode = encode_pairs_raw,
+};
+
+static const struct pairs_ops pairs_kv = {
+	.format = format_pairs_kv,
+	.encode = encode_pairs_kv,
+};
+
+static bool ipc_send_message_common(struct ipc_ctx *ctx, const struct pairs_ops *ops,
 		const void *pairs_data, struct ipc_pair *resp) __attribute__((nonnull(1,2,3,4)));
 
 struct send_pairs_raw_args {
@@ -103,51 +147,309 @@ void sanitize_newlines(char *s)
 			*s = ' ';
 }
 
-void ipc_buffer_free(struct ipc_buffer *a)
+void ipc_ring_free(struct ipc_ring *r)
 {
-	if (a->data)
-		free(a->data);
-	a->len = 0;
+	free(r->data);
+	free(r->spill);
+	memset(r, 0, sizeof(*r));
 }
 
-void ipc_buffer_append(struct ipc_buffer *a, const char *buf, size_t n)
+static bool ipc_ring_reserve_spill(struct ipc_ring *r, size_t size)
 {
-	void *data = realloc(a->data, a->len + n);
+	if (size <= r->spill_cap)
+		return true;
+
+	size_t newcap = r->spill_cap ? r->spill_cap : IPC_RING_SIZE;
+	while (newcap < size)
+		newcap *= 2;
+
+	void *data = realloc(r->spill, newcap);
 	if (!data) {
 		warn("realloc failed");
-		return;
+		errno = ENOMEM;
+		return false;
+	}
+	r->spill = data;
+	r->spill_cap = newcap;
+
+	return true;
+}
+
+/*
+ * Copy n bytes starting at the ring head into the spill buffer at offset off
+ * and consume them from the ring. On failure the ring is left untouched and
+ * errno is set to ENOMEM.
+ */
+static bool ipc_ring_to_spill(struct ipc_ring *r, size_t off, size_t n)
+{
+	if (!ipc_ring_reserve_spill(r, off + n))
+		return false;
+
+	size_t first = MIN(n, IPC_RING_SIZE - r->head);
+
+	memcpy(r->spill + off, r->data + r->head, first);
+	memcpy(r->spill + off + first, r->data, n - first);
+
+	r->head = (r->head + n) % IPC_RING_SIZE;
+	r->len -= n;
+	r->scan = 0;
+
+	return true;
+}
+
+/*
+ * Find the NUL terminator among the buffered bytes starting at offset from
+ * the head. Returns the offset of the terminator relative to the head or -1.
+ */
+static ssize_t ipc_ring_find_nul(struct ipc_ring *r, size_t from)
+{
+	while (from < r->len) {
+		size_t pos = (r->head + from) % IPC_RING_SIZE;
+		size_t n = MIN(r->len - from, IPC_RING_SIZE - pos);
+
+		char *p = memchr(r->data + pos, '\0', n);
+		if (p)
+			return (ssize_t) (from + (size_t) (p - (r->data + pos)));
+
+		from += n;
+	}
+	return -1;
+}
+
+ssize_t ipc_ring_recv(struct ipc_ring *r, int fd, int flags)
+{
+	if (!r->data) {
+		r->data = malloc(IPC_RING_SIZE);
+		if (!r->data) {
+			warn("malloc failed");
+			return -1;
+		}
+		r->head = r->len = r->scan = 0;
+	}
+
+	size_t tail = (r->head + r->len) % IPC_RING_SIZE;
+	size_t space = IPC_RING_SIZE - r->len;
+
+	struct iovec iov[2] = {
+		{
+			.iov_base = r->data + tail,
+			.iov_len = MIN(space, IPC_RING_SIZE - tail),
+		},
+		{
+			.iov_base = r->data,
+		},
+	};
+	iov[1].iov_len = space - iov[0].iov_len;
+
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = iov[1].iov_len ? 2 : 1,
+	};
+
+	if (fd < 0 || !space)
+		return -1;
+
+	ssize_t size = recvmsg_retry(fd, &msg, flags);
+	if (size > 0)
+		r->len += (size_t) size;
+
+	return size;
+}
+
+/*
+ * Copy data received by other means into the ring. Returns the number of
+ * bytes that fit.
+ */
+size_t ipc_ring_push(struct ipc_ring *r, const char *buf, size_t len)
+{
+	if (!r->data) {
+		r->data = malloc(IPC_RING_SIZE);
+		if (!r->data) {
+			warn("malloc failed");
+			return 0;
+		}
+		r->head = r->len = r->scan = 0;
+	}
+
+	size_t tail = (r->head + r->len) % IPC_RING_SIZE;
+	size_t n = MIN(len, IPC_RING_SIZE - r->len);
+	size_t first = MIN(n, IPC_RING_SIZE - tail);
+
+	memcpy(r->data + tail, buf, first);
+	memcpy(r->data, buf + first, n - first);
+
+	r->len += n;
+
+	return n;
+}
+
+/*
+ * Returns the next complete frame or NULL if more data is needed. A frame
+ * that does not fit into the ring is collected in the spill buffer; if that
+ * fails, NULL is returned with errno set to ENOMEM and the connection cannot
+ * continue.
+ */
+char *ipc_ring_next_frame(struct ipc_ring *r, size_t *frame_len)
+{
+	if (!r->data || !r->len)
+		return NULL;
+
+	ssize_t nul;
+
+	if (r->spill_len > 0) {
+		/* Continuation of the frame which did not fit into the ring. */
+		size_t off = r->spill_len;
+
+		nul = ipc_ring_find_nul(r, 0);
+		if (nul < 0) {
+			size_t n = r->len;
+
+			if (!ipc_ring_to_spill(r, off, n))
+				return NULL;
+
+			r->spill_len += n;
+			r->head = 0;
+			return NULL;
+		}
+
+		if (!ipc_ring_to_spill(r, off, (size_t) nul + 1))
+			return NULL;
+
+		r->spill_len = 0;
+
+		if (frame_len)
+			*frame_len = off + (size_t) nul;
+		return r->spill;
 	}
-	a->data = data;
-	memcpy(a->data + a->len, buf, n);
-	a->len += n;
+
+	nul = ipc_ring_find_nul(r, r->scan);
+	if (nul < 0) {
+		r->scan = r->len;
+
+		if (r->len == IPC_RING_SIZE) {
+			/* The frame is larger than the ring. Keep it aside. */
+			size_t n = r->len;
+
+			if (!ipc_ring_to_spill(r, 0, n))
+				return NULL;
+
+			r->spill_len = n;
+			r->head = 0;
+		}
+		return NULL;
+	}
+
+	char *frame;
+	size_t n = (size_t) nul + 1;
+
+	if (r->head + n <= IPC_RING_SIZE) {
+		frame = r->data + r->head;
+
+		r->head = (r->head + n) % IPC_RING_SIZE;
+		r->len -= n;
+		r->scan = 0;
+	} else {
+		if (!ipc_ring_to_spill(r, 0, n))
+			return NULL;
+		frame = r->spill;
+	}
+
+	if (!r->len)
+		r->head = 0;
+
+	if (frame_len)
+		*frame_len = n - 1;
+	return frame;
+}
+
+/*
+ * Copy n bytes at offset off from the head without consuming them.
+ */
+static void ipc_ring_peek(struct ipc_ring *r, size_t off, void *buf, size_t n)
+{
+	size_t pos = (r->head + off) % IPC_RING_SIZE;
+	size_t first = MIN(n, IPC_RING_SIZE - pos);
+
+	memcpy(buf, r->data + pos, first);
+	memcpy((char *) buf + first, r->data, n - first);
 }
 
-char *ipc_buffer_next_line(struct ipc_buffer *a)
+/*
+ * Same as ipc_ring_next_frame() for length-prefixed binary frames. The frame
+ * includes its header. Returns NULL with errno set to EMSGSIZE if the peer
+ * announced a frame larger than IPC_V2_FRAME_MAX, or to ENOMEM if the frame
+ * cannot be kept aside.
+ */
+char *ipc_ring_next_packet(struct ipc_ring *r, size_t *frame_len)
 {
-	if (!a->data || a->len == 0)
+	struct ipc_v2_header hdr;
+	size_t total;
+
+	if (r->spill_len > 0) {
+		/* Continuation of the frame which did not fit into the ring. */
+		memcpy(&hdr, r->spill, sizeof(hdr));
+		total = sizeof(hdr) + hdr.len;
+
+		size_t n = MIN(total - r->spill_len, r->len);
+
+		if (n && !ipc_ring_to_spill(r, r->spill_len, n))
+			return NULL;
+
+		r->spill_len += n;
+		if (r->spill_len < total)
+			return NULL;
+
+		r->spill_len = 0;
+		*frame_len = total;
+		return r->spill;
+	}
+
+	if (!r->data || r->len < sizeof(hdr))
 		return NULL;
 
-	char *p = memchr(a->data, '\0', a->len);
-	if (!p)
+	ipc_ring_peek(r, 0, &hdr, sizeof(hdr));
+
+	if (hdr.len > IPC_V2_FRAME_MAX) {
+		warnx("frame of %u bytes is too large", hdr.len);
+		errno = EMSGSIZE;
 		return NULL;
+	}
+
+	total = sizeof(hdr) + hdr.len;
 
-	size_t toklen = (size_t) (p - a->data);
-	char *tok = strndup(a->data, toklen);
+	if (total > r->len) {
+		if (total > IPC_RING_SIZE) {
+			/* The frame is larger than the ring. Keep it aside. */
+			size_t n = r->len;
 
-	a->len -= (toklen + 1);
+			if (!ipc_ring_to_spill(r, 0, n))
+				return NULL;
 
-	if (a->len > 0) {
-		memmove(a->data, p + 1, a->len);
+			r->spill_len = n;
+			r->head = 0;
+		}
+		return NULL;
+	}
+
+	char *frame;
 
-		void *data = realloc(a->data, a->len);
-		if (data)
-			a->data = data;
+	if (r->head + total <= IPC_RING_SIZE) {
+		frame = r->data + r->head;
+
+		r->head = (r->head + total) % IPC_RING_SIZE;
+		r->len -= total;
+		r->scan = 0;
 	} else {
-		free(a->data);
-		a->data = NULL;
+		if (!ipc_ring_to_spill(r, 0, total))
+			return NULL;
+		frame = r->spill;
 	}
 
-	return tok;
+	if (!r->len)
+		r->head = 0;
+
+	*frame_len = total;
+	return frame;
 }
 
 ssize_t sendmsg_retry(int fd, const struct msghdr *msg, int flags)
@@ -212,6 +514,7 @@ ssize_t ipc_recv_data(int fd, char *buf, size_t sz)
 
 ssize_t ipc_send_string(int fd, const char *fmt, ...)
 {
+	char stackbuf[IPC_STACK_FRAME];
 	char *text;
 	va_list ap;
 
@@ -226,11 +529,16 @@ ssize_t ipc_send_string(int fd, const char *fmt, ...)
 	ssize_t size;
 
 	va_start(ap, fmt);
-	size = vsnprintf(NULL, 0, fmt, ap);
+	size = vsnprintf(stackbuf, sizeof(stackbuf), fmt, ap);
 	va_end(ap);
 
 	if (size <= 0)
 		return 0;
+
+	/* Short frames never leave the stack. */
+	if ((size_t) size < sizeof(stackbuf))
+		return send_line(fd, stackbuf);
+
 	size += 1;
 
 	text = malloc((size_t) size);
@@ -252,462 +560,2175 @@ ssize_t ipc_send_string(int fd, const char *fmt, ...)
 	return size;
 }
 
-void ipc_pair_free(struct ipc_pair *pair)
+void ipc_outbuf_free(struct ipc_outbuf *b)
 {
-	for (size_t i = 0; i < pair->num_kv; i++) {
-		free(pair->kv[i].key);
-		free(pair->kv[i].val);
-	}
-	free(pair->kv);
+	free(b->data);
+	b->data = NULL;
+	b->len = b->cap = 0;
 }
 
-void ipc_msg_free(struct ipc_message *m)
+static bool ipc_outbuf_reserve(struct ipc_outbuf *b, size_t size)
 {
-	ipc_pair_free(&m->data);
-	ipc_pair_free(&m->resp);
-	free(m->id);
-	free(m);
-}
+	if (b->len + size <= b->cap)
+		return true;
 
-struct ipc_message *ipc_msg_find(struct ipc_ctx *ctx, const char *id)
-{
-	struct ipc_message *m;
+	size_t newcap = b->cap ? b->cap : BUFSIZ;
+	while (newcap < b->len + size)
+		newcap *= 2;
 
-	LIST_FOREACH(m, &ctx->msgs, entries) {
-		if (streq(m->id, id))
-			return m;
+	void *data = realloc(b->data, newcap);
+	if (!data) {
+		warn("realloc failed");
+		return false;
 	}
-	return NULL;
+	b->data = data;
+	b->cap = newcap;
+
+	return true;
 }
 
-struct ipc_message *ipc_msg_add(struct ipc_ctx *ctx, const char *id)
+/*
+ * Format a frame including its terminating NUL directly into the free space
+ * of the output buffer. The buffer grows only when the frame does not fit.
+ */
+static bool ipc_outbuf_vprintf(struct ipc_outbuf *b, const char *fmt, va_list ap)
 {
-	struct ipc_message *m = calloc(1, sizeof(*m));
-	if (!m)
-		return NULL;
-
-	m->id = strdup(id);
-	if (!m->id) {
-		free(m);
-		return NULL;
-	}
+	va_list aq;
+	int size;
 
-	LIST_INSERT_HEAD(&ctx->msgs, m, entries);
+	if (!ipc_outbuf_reserve(b, IPC_STACK_FRAME))
+		return false;
 
-	return m;
-}
+	va_copy(aq, ap);
+	size = vsnprintf(b->data + b->len, b->cap - b->len, fmt, aq);
+	va_end(aq);
 
-static bool inc_pair_capacity(struct ipc_pair *p)
-{
-	if (p->num_kv >= p->capacity) {
-		size_t newcap = (p->capacity > 0 ? p->capacity * 2 : 1);
+	if (size < 0)
+		return false;
 
-		void *kv = realloc(p->kv, newcap * sizeof(struct ipc_kv));
-		if (!kv) {
-			warn("realloc failed");
+	if ((size_t) size >= b->cap - b->len) {
+		if (!ipc_outbuf_reserve(b, (size_t) size + 1))
 			return false;
-		}
 
-		p->kv = kv;
-		p->capacity = newcap;
+		vsnprintf(b->data + b->len, (size_t) size + 1, fmt, ap);
 	}
-	return true;
-}
 
-bool ipc_pair_add(struct ipc_pair *pairs, const char *key, const char *val)
-{
-	if (!inc_pair_capacity(pairs))
-		return false;
+	if (IS_DEBUG())
+		warnx("pid=%-10d SEND: %s", getpid(), b->data + b->len);
 
-	pairs->kv[pairs->num_kv].key = strdup(key);
-	pairs->kv[pairs->num_kv].val = strdup(val);
-	pairs->num_kv++;
+	b->len += (size_t) size + 1;
 
 	return true;
 }
 
-bool ipc_pair_sprintf(struct ipc_pair *pairs, const char *key, const char *fmt, ...)
+static bool ipc_outbuf_printf(struct ipc_outbuf *b, const char *fmt, ...)
 {
-	if (!inc_pair_capacity(pairs))
-		return false;
-
-	ssize_t size;
 	va_list ap;
+	bool ret;
 
 	va_start(ap, fmt);
-	size = vsnprintf(NULL, 0, fmt, ap);
+	ret = ipc_outbuf_vprintf(b, fmt, ap);
 	va_end(ap);
 
-	if (size <= 0)
-		return false;
-	size += 1;
+	return ret;
+}
 
-	char *val = malloc((size_t) size);
-	if (!val)
-		return false;
+/*
+ * Format into buf if the result fits, otherwise into a new string returned
+ * through heap. Returns the length of the result or -1.
+ */
+static int ipc_vformat(char *buf, size_t size, char **heap, const char *fmt, va_list ap)
+{
+	va_list aq;
+	int len;
 
-	va_start(ap, fmt);
-	size = vsnprintf(val, (size_t) size, fmt, ap);
-	va_end(ap);
+	*heap = NULL;
 
-	if (size < 0) {
-		free(val);
-		return false;
-	}
+	va_copy(aq, ap);
+	len = vsnprintf(buf, size, fmt, aq);
+	va_end(aq);
 
-	pairs->kv[pairs->num_kv].key = strdup(key);
-	pairs->kv[pairs->num_kv].val = val;
-	pairs->num_kv++;
+	if (len < 0 || (size_t) len < size)
+		return len;
 
-	return true;
+	*heap = malloc((size_t) len + 1);
+	if (!*heap) {
+		warn("malloc failed");
+		return -1;
+	}
+	return vsnprintf(*heap, (size_t) len + 1, fmt, ap);
 }
 
-bool handle_hllo(struct ipc_ctx *ctx,
-		struct ipc_token *tok __attribute__((unused)))
-{
-	char idbuf[32];
-	snprintf(idbuf, sizeof(idbuf), "%lu", ctx->next_msgid);
+/* The most a text frame of the server grows when it is translated. */
+#define IPC_V2_OVERHEAD (sizeof(struct ipc_v2_header) + sizeof(struct ipc_v2_entry) + sizeof("message"))
 
-	if (ipc_send_string(ctx->fd, "TAKE %s", idbuf) < 0)
-		return false;
+/*
+ * The caller makes sure that key_len fits into the 16 bits of the entry.
+ */
+static size_t ipc_v2_put_entry(char *dst, const char *key, size_t key_len,
+		const char *val, size_t val_len)
+{
+	struct ipc_v2_entry e = {
+		.type = IPC_V2_STR,
+		.key_len = (uint16_t) key_len,
+		.val_len = (uint32_t) val_len,
+	};
 
-	ipc_msg_add(ctx, idbuf);
-	ctx->next_msgid++;
+	memcpy(dst, &e, sizeof(e));
+	memcpy(dst + sizeof(e), key, key_len);
+	memcpy(dst + sizeof(e) + key_len, val, val_len);
 
-	return true;
+	return sizeof(e) + key_len + val_len;
 }
 
-bool handle_take(struct ipc_ctx *ctx, struct ipc_token *tok)
+/*
+ * Translate a text frame of the server (TAKE, RESPDATA or RESPONSE) into a
+ * binary frame. The daemon and the plugins keep formatting their replies as
+ * text, so only this function knows about both encodings. dst must have room
+ * for len + IPC_V2_OVERHEAD bytes. Returns the size of the binary frame or 0
+ * if the key is too long for an entry.
+ */
+static size_t ipc_v2_from_text(char *dst, const char *text, size_t len)
 {
-	ipc_msg_add(ctx, tok->id);
-	return true;
-}
+	struct ipc_v2_header hdr = { 0 };
+	const char *end = text + len;
+	const char *key = NULL, *val = NULL;
+	size_t key_len = 0;
+	char *p;
 
-bool handle_pair(struct ipc_ctx *ctx, struct ipc_token *tok)
-{
-	char *eq = strchr(tok->arg, '=');
-	if (!eq) {
-		ipc_send_string(ctx->fd, "RESPONSE %s ERROR 'PAIR' bad format", tok->id);
-		return false;
-	}
+	size_t cmd_len = strcspn(text, " ");
 
-	*eq = '\0';
+	if (cmd_len == 4 && !memcmp(text, "TAKE", 4))
+		hdr.cmd = IPC_V2_TAKE;
+	else if (cmd_len == 8 && !memcmp(text, "RESPDATA", 8))
+		hdr.cmd = IPC_V2_RESPDATA;
+	else
+		hdr.cmd = IPC_V2_RESPONSE;
 
-	char *key = tok->arg;
-	char *val = eq + 1;
+	hdr.id = (uint32_t) strtoul(text + cmd_len, &p, 10);
 
-	sanitize_newlines(key);
-	//sanitize_newlines(val);
+	if (p < end && *p == ' ')
+		p++;
 
-	struct ipc_message *msg = ipc_msg_find(ctx, tok->id);
-	if (!msg)
-		msg = ipc_msg_add(ctx, tok->id);
+	if (hdr.cmd == IPC_V2_RESPDATA) {
+		char *eq = memchr(p, '=', (size_t) (end - p));
 
-	return ipc_pair_add(&msg->data, key, val);
-}
+		key = p;
+		key_len = eq ? (size_t) (eq - p) : (size_t) (end - p);
+		val = eq ? eq + 1 : end;
+	} else if (hdr.cmd == IPC_V2_RESPONSE) {
+		char *sp = memchr(p, ' ', (size_t) (end - p));
 
-bool handle_done(struct ipc_ctx *ctx, struct ipc_token *tok)
-{
-	struct ipc_message *msg = ipc_msg_find(ctx, tok->id);
-	if (!msg) {
-		ipc_send_string(ctx->fd, "RESPONSE 0 ERROR 'DONE' got unknown id '%s'", tok->id);
-		return false;
+		hdr.status = (strncmp(p, "OK", 2) == 0 && (p + 2 == end || p[2] == ' ')) ? 0 : 1;
+
+		if (sp) {
+			key = "message";
+			key_len = sizeof("message") - 1;
+			val = sp + 1;
+		}
 	}
 
-	int res = 0;
+	if (key_len > UINT16_MAX) {
+		warnx("ERROR: key '%.*s' is too large", (int) MIN(key_len, 64), key);
+		return 0;
+	}
 
-	if (ctx->handle_message)
-		res = ctx->handle_message(ctx, msg, ctx->data);
+	if (key)
+		hdr.len = (uint32_t) ipc_v2_put_entry(dst + sizeof(hdr), key, key_len,
+				val, (size_t) (end - val));
 
-	LIST_REMOVE(msg, entries);
-	ipc_msg_free(msg);
+	memcpy(dst, &hdr, sizeof(hdr));
 
-	return (!res)
-		? ipc_send_string(ctx->fd, "RESPONSE %s OK", tok->id) > 0
-		: ipc_send_string(ctx->fd, "RESPONSE %s ERROR", tok->id) > 0;
+	return sizeof(hdr) + hdr.len;
 }
 
-bool handle_dummy(struct ipc_ctx *ctx __attribute__((unused)),
-		 struct ipc_token *tok)
+static bool ipc_outbuf_vprintf_v2(struct ipc_outbuf *b, const char *fmt, va_list ap)
 {
-	if (IS_DEBUG())
-		warnx("Got %s id=%s", tok->cmd, tok->id);
-	return true;
-}
+	char stackbuf[IPC_STACK_FRAME];
+	char *heap;
+	int size;
 
-bool ipc_event_loop(struct ipc_ctx *ctx)
-{
-	struct pollfd pfd = {
-		.fd = ctx->fd,
-		.events = POLLIN,
-	};
+	size = ipc_vformat(stackbuf, sizeof(stackbuf), &heap, fmt, ap);
+	if (size < 0)
+		return false;
 
-	while (1) {
+	const char *text = heap ? heap : stackbuf;
+	bool ret = ipc_outbuf_reserve(b, (size_t) size + IPC_V2_OVERHEAD);
+
+	if (ret) {
+		if (IS_DEBUG())
+			warnx("pid=%-10d SEND(v2): %s", getpid(), text);
+
+		size_t n = ipc_v2_from_text(b->data + b->len, text, (size_t) size);
+
+		b->len += n;
+		ret = (n > 0);
+	}
+
+	free(heap);
+	return ret;
+}
+
+/*
+ * Check the amount of queued output against the high-water mark. A peer that
+ * does not read its responses is disconnected rather than allowed to grow the
+ * queue without bound. Must be called with out_lock held.
+ */
+static bool ipc_check_outbuf_limit(struct ipc_ctx *ctx)
+{
+	if (ctx->out_limit && ctx->outbuf.len > ctx->out_limit) {
+		if (!(ctx->out_flags & IPC_OUT_OVERFLOW))
+			warnx("output queue exceeds %zu bytes, dropping connection", ctx->out_limit);
+
+		ctx->out_flags |= IPC_OUT_OVERFLOW;
+		ipc_outbuf_free(&ctx->outbuf);
+	}
+	return !(ctx->out_flags & IPC_OUT_OVERFLOW);
+}
+
+/*
+ * Copy the message id of a queued server frame into buf.
+ */
+static void ipc_frame_id(const char *frame, bool v2, char *buf, size_t size)
+{
+	if (v2) {
+		struct ipc_v2_header hdr;
+
+		memcpy(&hdr, frame, sizeof(hdr));
+		snprintf(buf, size, "%u", hdr.id);
+		return;
+	}
+
+	const char *id = strchr(frame, ' ');
+	id = id ? id + 1 : "0";
+
+	size_t len = strcspn(id, " ");
+	if (len >= size)
+		len = size - 1;
+
+	memcpy(buf, id, len);
+	buf[len] = '\0';
+}
+
+/*
+ * A frame never spans two datagrams of a SOCK_SEQPACKET socket. A reply frame
+ * queued at off that does not fit into one is taken back, and its message is
+ * remembered so that it fails instead of the whole connection. Must be called
+ * with out_lock held.
+ */
+static bool ipc_drop_oversized(struct ipc_ctx *ctx, size_t off, char *id, size_t size)
+{
+	size_t len = ctx->outbuf.len - off;
+
+	if (!(ctx->flags & IPC_CTX_SEQPACKET) || len <= IPC_SEQPACKET_MAX)
+		return false;
+
+	ipc_frame_id(ctx->outbuf.data + off, ctx->flags & IPC_CTX_V2, id, size);
+	ctx->outbuf.len = off;
+
+	warnx("reply of %zu bytes to message %s does not fit into a datagram", len, id);
+
+	ipc_pair_add(&ctx->dropped, id, "");
+
+	return true;
+}
+
+/*
+ * Returns true if a reply of the message was dropped by ipc_drop_oversized()
+ * and forgets about the message.
+ */
+static bool ipc_take_dropped(struct ipc_ctx *ctx, const char *id)
+{
+	struct ipc_pair *p = &ctx->dropped;
+	bool ret = false;
+
+	pthread_mutex_lock(&ctx->out_lock);
+
+	for (size_t i = p->num_kv; i-- > 0;) {
+		if (!streq(p->kv[i].key, id))
+			continue;
+
+		free(p->kv[i].key);
+		free(p->kv[i].val);
+
+		p->kv[i] = p->kv[--p->num_kv];
+		ret = true;
+	}
+
+	pthread_mutex_unlock(&ctx->out_lock);
+
+	return ret;
+}
+
+bool ipc_queue_string(struct ipc_ctx *ctx, const char *fmt, ...)
+{
+	va_list ap;
+	char id[32];
+	bool dropped = false;
+	bool ret = false;
+
+	pthread_mutex_lock(&ctx->out_lock);
+
+	if (!ctx->out_flags) {
+		size_t off = ctx->outbuf.len;
+
+		va_start(ap, fmt);
+		ret = (ctx->flags & IPC_CTX_V2)
+			? ipc_outbuf_vprintf_v2(&ctx->outbuf, fmt, ap)
+			: ipc_outbuf_vprintf(&ctx->outbuf, fmt, ap);
+		va_end(ap);
+
+		dropped = ret && ipc_drop_oversized(ctx, off, id, sizeof(id));
+		ret = ret && ipc_check_outbuf_limit(ctx);
+	}
+
+	pthread_mutex_unlock(&ctx->out_lock);
+
+	if (dropped)
+		ret = ipc_queue_string(ctx, "RESPDATA %s ERR=reply does not fit into a datagram", id);
+
+	return ret;
+}
+
+/*
+ * Size of the whole frame at the start of buf including its terminator or
+ * header, 0 if buf ends before the frame does.
+ */
+static size_t ipc_frame_size(const char *buf, size_t len, bool v2)
+{
+	if (!v2) {
+		const char *nul = memchr(buf, '\0', len);
+		return nul ? (size_t) (nul - buf) + 1 : 0;
+	}
+
+	struct ipc_v2_header hdr;
+
+	if (len < sizeof(hdr))
+		return 0;
+
+	memcpy(&hdr, buf, sizeof(hdr));
+
+	return (hdr.len <= len - sizeof(hdr)) ? sizeof(hdr) + hdr.len : 0;
+}
+
+static bool ipc_is_v2_take(const char *frame)
+{
+	const char *sp = strrchr(frame, ' ');
+
+	return !strncmp(frame, "TAKE ", 5) && sp && streq(sp + 1, "v2");
+}
+
+/*
+ * Size of the next datagram: as many whole frames from buf as fit into
+ * IPC_SEQPACKET_MAX, but at least one. The output switches to binary framing
+ * after the text "TAKE <id> v2"; *v2 holds the framing at the start of buf and
+ * is advanced to the end of the datagram. Returns 0 if buf has no whole frame.
+ */
+size_t ipc_datagram_size(const char *buf, size_t len, bool *v2)
+{
+	size_t size = 0;
+
+	while (size < len) {
+		size_t n = ipc_frame_size(buf + size, len - size, *v2);
+
+		if (!n || (size && size + n > IPC_SEQPACKET_MAX))
+			break;
+
+		if (!*v2 && ipc_is_v2_take(buf + size))
+			*v2 = true;
+
+		size += n;
+	}
+	return size;
+}
+
+#define IPC_DGRAM_BATCH 16
+
+/*
+ * Send the frames from buf as datagrams with a single sendmmsg(). Returns the
+ * number of bytes sent, which always ends on a datagram boundary, or -1.
+ */
+static ssize_t ipc_send_datagrams(int fd, const char *buf, size_t len, bool *v2)
+{
+	struct mmsghdr msgs[IPC_DGRAM_BATCH];
+	struct iovec iov[IPC_DGRAM_BATCH];
+	bool v2_end[IPC_DGRAM_BATCH];
+	size_t end[IPC_DGRAM_BATCH];
+	bool cur = *v2;
+	size_t off = 0;
+	unsigned int n = 0;
+
+	while (n < IPC_DGRAM_BATCH && off < len) {
+		size_t size = ipc_datagram_size(buf + off, len - off, &cur);
+		if (!size)
+			break;
+
+		if (size > IPC_SEQPACKET_MAX) {
+			if (n)
+				break;
+			warnx("frame of %zu bytes does not fit into a datagram", size);
+			errno = EMSGSIZE;
+			return -1;
+		}
+
+		iov[n].iov_base = (void *) (buf + off);
+		iov[n].iov_len = size;
+
+		memset(&msgs[n], 0, sizeof(msgs[n]));
+		msgs[n].msg_hdr.msg_iov = &iov[n];
+		msgs[n].msg_hdr.msg_iovlen = 1;
+
+		off += size;
+		end[n] = off;
+		v2_end[n] = cur;
+		n++;
+	}
+
+	if (!n)
+		return 0;
+
+	int sent = (int) TEMP_FAILURE_RETRY(sendmmsg(fd, msgs, n, MSG_NOSIGNAL));
+	if (sent <= 0)
+		return -1;
+
+	*v2 = v2_end[sent - 1];
+
+	return (ssize_t) end[sent - 1];
+}
+
+/*
+ * The SOCK_SEQPACKET variant of ipc_send_frames(). The last frame is queued
+ * first since a frame cannot be split between datagrams.
+ */
+static bool ipc_send_frames_seqpacket(struct ipc_ctx *ctx, const char *frame, size_t frame_size)
+{
+	struct ipc_outbuf *b = &ctx->outbuf;
+	size_t sent = 0;
+
+	if (frame) {
+		if (!ipc_outbuf_reserve(b, frame_size))
+			return false;
+
+		memcpy(b->data + b->len, frame, frame_size);
+		b->len += frame_size;
+	}
+
+	while (sent < b->len) {
+		ssize_t size = (ctx->fd >= 0)
+			? ipc_send_datagrams(ctx->fd, b->data + sent, b->len - sent, &ctx->dgram_v2)
+			: -1;
+
+		if (size < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (ctx->fd >= 0)
+				warn("sendmmsg");
+			b->len = 0;
+			ctx->out_flags |= IPC_OUT_BROKEN;
+			return false;
+		}
+
+		if (!size)
+			break;
+
+		sent += (size_t) size;
+	}
+
+	memmove(b->data, b->data + sent, b->len - sent);
+	b->len -= sent;
+
+	return ipc_check_outbuf_limit(ctx);
+}
+
+/*
+ * Send all queued frames followed by an optional last frame (frame_size bytes
+ * including its terminator) with a single sendmsg(). If the socket is
+ * non-blocking and cannot take everything, the rest stays queued until the
+ * owner of the connection flushes it again. Must be called with out_lock held.
+ */
+static bool ipc_send_frames(struct ipc_ctx *ctx, const char *frame, size_t frame_size)
+{
+	struct ipc_outbuf *b = &ctx->outbuf;
+	struct iovec iov[2];
+	int iovcnt = 0;
+
+	if (ctx->out_flags)
+		return false;
+
+	if (ctx->flags & IPC_CTX_QUEUE_ONLY) {
+		if (frame) {
+			if (!ipc_outbuf_reserve(b, frame_size))
+				return false;
+
+			memcpy(b->data + b->len, frame, frame_size);
+			b->len += frame_size;
+		}
+		return ipc_check_outbuf_limit(ctx);
+	}
+
+	if (ctx->flags & IPC_CTX_SEQPACKET)
+		return ipc_send_frames_seqpacket(ctx, frame, frame_size);
+
+	if (b->len) {
+		iov[iovcnt].iov_base = b->data;
+		iov[iovcnt].iov_len = b->len;
+		iovcnt++;
+	}
+	if (frame) {
+		iov[iovcnt].iov_base = (void *) frame;
+		iov[iovcnt].iov_len = frame_size;
+		iovcnt++;
+	}
+
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = (size_t) iovcnt,
+	};
+	size_t sent = 0;
+
+	while (msg.msg_iovlen > 0) {
+		ssize_t size = (ctx->fd >= 0) ? sendmsg_retry(ctx->fd, &msg, MSG_NOSIGNAL) : -1;
+
+		if (size < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (ctx->fd >= 0)
+				warn("sendmsg");
+			b->len = 0;
+			ctx->out_flags |= IPC_OUT_BROKEN;
+			return false;
+		}
+
+		sent += (size_t) size;
+
+		while (msg.msg_iovlen > 0 && (size_t) size >= msg.msg_iov->iov_len) {
+			size -= (ssize_t) msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + size;
+			msg.msg_iov->iov_len -= (size_t) size;
+		}
+	}
+
+	/* Keep the unsent tail of the queue and of the last frame. */
+	if (sent < b->len) {
+		memmove(b->data, b->data + sent, b->len - sent);
+		b->len -= sent;
+		sent = 0;
+	} else {
+		sent -= b->len;
+		b->len = 0;
+	}
+
+	if (frame && sent < frame_size) {
+		if (!ipc_outbuf_reserve(b, frame_size - sent))
+			return false;
+
+		memcpy(b->data + b->len, frame + sent, frame_size - sent);
+		b->len += frame_size - sent;
+	}
+
+	return ipc_check_outbuf_limit(ctx);
+}
+
+bool ipc_flush(struct ipc_ctx *ctx)
+{
+	bool ret = true;
+
+	pthread_mutex_lock(&ctx->out_lock);
+
+	if (ctx->outbuf.len)
+		ret = ipc_send_frames(ctx, NULL, 0);
+	else if (ctx->out_flags)
+		ret = false;
+
+	pthread_mutex_unlock(&ctx->out_lock);
+
+	return ret;
+}
+
+bool ipc_has_output(struct ipc_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->out_lock);
+	bool ret = ctx->outbuf.len > 0;
+	pthread_mutex_unlock(&ctx->out_lock);
+
+	return ret;
+}
+
+/*
+ * The output path of another thread may mark the connection as overflowed
+ * or broken, so out_flags is read under out_lock.
+ */
+static bool ipc_output_failed(struct ipc_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->out_lock);
+	bool ret = ctx->out_flags != 0;
+	pthread_mutex_unlock(&ctx->out_lock);
+
+	return ret;
+}
+
+/*
+ * Swap the queued output with the empty buffer b so that it can be sent
+ * while new responses are queued. Returns false if nothing is queued.
+ */
+bool ipc_outbuf_take(struct ipc_ctx *ctx, struct ipc_outbuf *b)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&ctx->out_lock);
+
+	if (ctx->outbuf.len && !ctx->out_flags) {
+		struct ipc_outbuf tmp = ctx->outbuf;
+
+		ctx->outbuf = *b;
+		ctx->outbuf.len = 0;
+		*b = tmp;
+		ret = true;
+	}
+
+	pthread_mutex_unlock(&ctx->out_lock);
+
+	return ret;
+}
+
+/*
+ * Send the final frame of a reply together with everything queued for the
+ * connection so far.
+ */
+static bool ipc_send_reply(struct ipc_ctx *ctx, const char *fmt, ...)
+{
+	char stackbuf[IPC_STACK_FRAME];
+	char framebuf[IPC_STACK_FRAME + IPC_V2_OVERHEAD];
+	char *heap, *binary = NULL;
+	const char *frame;
+	size_t size;
+	va_list ap;
+	int len;
+	bool ret = false;
+
+	va_start(ap, fmt);
+	len = ipc_vformat(stackbuf, sizeof(stackbuf), &heap, fmt, ap);
+	va_end(ap);
+
+	if (len < 0)
+		return false;
+
+	const char *text = heap ? heap : stackbuf;
+
+	pthread_mutex_lock(&ctx->out_lock);
+
+	/*
+	 * These replies echo at most an id or a command of the peer, which came
+	 * in one datagram. Cut the text so that the frame fits into one, too.
+	 */
+	if ((ctx->flags & IPC_CTX_SEQPACKET) && heap &&
+	    (size_t) len + IPC_V2_OVERHEAD >= IPC_SEQPACKET_MAX) {
+		len = (int) (IPC_SEQPACKET_MAX - IPC_V2_OVERHEAD - 1);
+		heap[len] = '\0';
+	}
+
+	if (ctx->flags & IPC_CTX_V2) {
+		if (IS_DEBUG())
+			warnx("pid=%-10d SEND(v2): %s", getpid(), text);
+
+		if (heap) {
+			binary = malloc((size_t) len + IPC_V2_OVERHEAD);
+			if (!binary) {
+				warn("malloc failed");
+				goto out;
+			}
+		}
+		char *dst = binary ? binary : framebuf;
+
+		size = ipc_v2_from_text(dst, text, (size_t) len);
+		if (!size)
+			goto out;
+		frame = dst;
+	} else {
+		if (IS_DEBUG())
+			warnx("pid=%-10d SEND: %s", getpid(), text);
+
+		frame = text;
+		size = (size_t) len + 1;
+	}
+
+	ret = ipc_send_frames(ctx, frame, size);
+out:
+	pthread_mutex_unlock(&ctx->out_lock);
+
+	free(binary);
+	free(heap);
+
+	return ret;
+}
+
+/*
+ * Every message is one block of IPC_MSG_BLOCK bytes: the message followed by
+ * the first part of its arena. A typical request fits there completely, and
+ * the blocks of finished messages are kept in the context for the next ones,
+ * so a request does not touch the heap at all.
+ */
+#define IPC_MSG_BLOCK   2048
+#define IPC_MSG_CACHE   16
+#define IPC_ARENA_CHUNK 4096
+#define IPC_ARENA_ALIGN sizeof(void *)
+
+struct ipc_arena_chunk {
+	struct ipc_arena_chunk *next;
+	char data[];
+};
+
+static void *ipc_arena_alloc(struct ipc_arena *a, size_t size)
+{
+	size = (size + IPC_ARENA_ALIGN - 1) & ~(IPC_ARENA_ALIGN - 1);
+
+	if (size > (size_t) (a->end - a->pos)) {
+		size_t chunk_size = MAX(size, IPC_ARENA_CHUNK);
+
+		struct ipc_arena_chunk *c = malloc(sizeof(*c) + chunk_size);
+		if (!c) {
+			warn("malloc failed");
+			return NULL;
+		}
+
+		c->next = a->chunks;
+		a->chunks = c;
+
+		a->pos = c->data;
+		a->end = c->data + chunk_size;
+	}
+
+	void *p = a->pos;
+	a->pos += size;
+
+	return p;
+}
+
+static char *ipc_arena_strndup(struct ipc_arena *a, const char *s, size_t len)
+{
+	char *p = ipc_arena_alloc(a, len + 1);
+	if (p) {
+		memcpy(p, s, len);
+		p[len] = '\0';
+	}
+	return p;
+}
+
+static void ipc_arena_release(struct ipc_arena *a)
+{
+	while (a->chunks) {
+		struct ipc_arena_chunk *c = a->chunks;
+
+		a->chunks = c->next;
+		free(c);
+	}
+}
+
+void ipc_pair_free(struct ipc_pair *pair)
+{
+	/* The arena releases everything at once. */
+	if (pair->arena)
+		return;
+
+	for (size_t i = 0; i < pair->num_kv; i++) {
+		free(pair->kv[i].key);
+		free(pair->kv[i].val);
+	}
+	free(pair->kv);
+}
+
+/*
+ * A message taken out of its context with IPC_MSG_PENDING must be freed
+ * before the context itself.
+ */
+void ipc_msg_free(struct ipc_message *m)
+{
+	struct ipc_ctx *ctx = m->ctx;
+
+	ipc_pair_free(&m->data);
+	ipc_pair_free(&m->resp);
+	ipc_arena_release(&m->arena);
+
+	if (ctx && ctx->msg_cache_len < IPC_MSG_CACHE) {
+		m->hash_next = ctx->msg_cache;
+		ctx->msg_cache = m;
+		ctx->msg_cache_len++;
+		return;
+	}
+	free(m);
+}
+
+/*
+ * Memory that lives as long as the message, e.g. for whatever its handler
+ * derives from the pairs. It must not be freed.
+ */
+void *ipc_msg_alloc(struct ipc_message *m, size_t size)
+{
+	return ipc_arena_alloc(&m->arena, size);
+}
+
+static struct ipc_message **ipc_msg_bucket(struct ipc_ctx *ctx, const char *id)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261U;
+
+	for (const unsigned char *p = (const unsigned char *) id; *p; p++)
+		h = (h ^ *p) * 16777619U;
+
+	return &ctx->msg_hash[h & (IPC_MSG_HASH - 1)];
+}
+
+struct ipc_message *ipc_msg_find(struct ipc_ctx *ctx, const char *id)
+{
+	struct ipc_message *m;
+
+	for (m = *ipc_msg_bucket(ctx, id); m; m = m->hash_next) {
+		if (streq(m->id, id))
+			return m;
+	}
+	return NULL;
+}
+
+struct ipc_message *ipc_msg_add(struct ipc_ctx *ctx, const char *id)
+{
+	struct ipc_message *m = ctx->msg_cache;
+
+	if (m) {
+		ctx->msg_cache = m->hash_next;
+		ctx->msg_cache_len--;
+	} else {
+		m = malloc(IPC_MSG_BLOCK);
+		if (!m)
+			return NULL;
+	}
+
+	memset(m, 0, sizeof(*m));
+
+	m->ctx = ctx;
+	m->arena.pos = (char *) m + ((sizeof(*m) + IPC_ARENA_ALIGN - 1) & ~(IPC_ARENA_ALIGN - 1));
+	m->arena.end = (char *) m + IPC_MSG_BLOCK;
+	m->data.arena = &m->arena;
+	m->resp.arena = &m->arena;
+
+	m->id = ipc_arena_strndup(&m->arena, id, strlen(id));
+	if (!m->id) {
+		ipc_msg_free(m);
+		return NULL;
+	}
+
+	struct ipc_message **bucket = ipc_msg_bucket(ctx, id);
+
+	m->hash_next = *bucket;
+	*bucket = m;
+
+	LIST_INSERT_HEAD(&ctx->msgs, m, entries);
+
+	return m;
+}
+
+/*
+ * Take the message out of the lookup. It stays allocated.
+ */
+static void ipc_msg_unlink(struct ipc_ctx *ctx, struct ipc_message *msg)
+{
+	struct ipc_message **p = ipc_msg_bucket(ctx, msg->id);
+
+	while (*p != msg)
+		p = &(*p)->hash_next;
+
+	*p = msg->hash_next;
+	msg->hash_next = NULL;
+
+	LIST_REMOVE(msg, entries);
+}
+
+static bool inc_pair_capacity(struct ipc_pair *p)
+{
+	if (p->num_kv >= p->capacity) {
+		void *kv;
+		size_t newcap;
+
+		if (p->arena) {
+			/* The old array stays in the arena until the message is freed. */
+			newcap = (p->capacity > 0 ? p->capacity * 2 : 8);
+
+			kv = ipc_arena_alloc(p->arena, newcap * sizeof(struct ipc_kv));
+			if (!kv)
+				return false;
+
+			if (p->num_kv)
+				memcpy(kv, p->kv, p->num_kv * sizeof(struct ipc_kv));
+		} else {
+			newcap = (p->capacity > 0 ? p->capacity * 2 : 1);
+
+			kv = realloc(p->kv, newcap * sizeof(struct ipc_kv));
+			if (!kv) {
+				warn("realloc failed");
+				return false;
+			}
+		}
+
+		p->kv = kv;
+		p->capacity = newcap;
+	}
+	return true;
+}
+
+static char *memdup_str(const char *s, size_t len)
+{
+	char *p = malloc(len + 1);
+	if (p) {
+		memcpy(p, s, len);
+		p[len] = '\0';
+	}
+	return p;
+}
+
+static bool ipc_pair_addn(struct ipc_pair *pairs, const char *key, size_t key_len,
+		const char *val, size_t val_len)
+{
+	if (!inc_pair_capacity(pairs))
+		return false;
+
+	char *k, *v;
+
+	if (pairs->arena) {
+		k = ipc_arena_strndup(pairs->arena, key, key_len);
+		v = k ? ipc_arena_strndup(pairs->arena, val, val_len) : NULL;
+
+		if (!v)
+			return false;
+	} else {
+		k = memdup_str(key, key_len);
+		v = memdup_str(val, val_len);
+
+		if (!k || !v) {
+			warn("malloc failed");
+			free(k);
+			free(v);
+			return false;
+		}
+	}
+
+	pairs->kv[pairs->num_kv].key = k;
+	pairs->kv[pairs->num_kv].val = v;
+	pairs->num_kv++;
+
+	return true;
+}
+
+bool ipc_pair_add(struct ipc_pair *pairs, const char *key, const char *val)
+{
+	return ipc_pair_addn(pairs, key, strlen(key), val, strlen(val));
+}
+
+/*
+ * Append the entries of a binary frame body to pairs. Returns false if the
+ * body is malformed.
+ */
+static bool ipc_v2_decode_pairs(const char *body, size_t len, struct ipc_pair *pairs)
+{
+	while (len > 0) {
+		struct ipc_v2_entry e;
+
+		if (len < sizeof(e))
+			return false;
+
+		memcpy(&e, body, sizeof(e));
+		body += sizeof(e);
+		len -= sizeof(e);
+
+		if (e.type != IPC_V2_STR || (size_t) e.key_len + e.val_len > len)
+			return false;
+
+		/* Keys and values are handed on as C strings. */
+		if (memchr(body, '\0', (size_t) e.key_len + e.val_len))
+			return false;
+
+		if (!ipc_pair_addn(pairs, body, e.key_len, body + e.key_len, e.val_len))
+			return false;
+
+		body += (size_t) e.key_len + e.val_len;
+		len -= (size_t) e.key_len + e.val_len;
+	}
+	return true;
+}
+
+bool ipc_pair_sprintf(struct ipc_pair *pairs, const char *key, const char *fmt, ...)
+{
+	if (!inc_pair_capacity(pairs))
+		return false;
+
+	ssize_t size;
+	va_list ap;
+
+	va_start(ap, fmt);
+	size = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	if (size <= 0)
+		return false;
+	size += 1;
+
+	char *val = pairs->arena
+		? ipc_arena_alloc(pairs->arena, (size_t) size)
+		: malloc((size_t) size);
+	if (!val)
+		return false;
+
+	va_start(ap, fmt);
+	size = vsnprintf(val, (size_t) size, fmt, ap);
+	va_end(ap);
+
+	char *k = (size < 0) ? NULL
+		: pairs->arena ? ipc_arena_strndup(pairs->arena, key, strlen(key))
+		: strdup(key);
+
+	if (!k) {
+		if (!pairs->arena)
+			free(val);
+		return false;
+	}
+
+	pairs->kv[pairs->num_kv].key = k;
+	pairs->kv[pairs->num_kv].val = val;
+	pairs->num_kv++;
+
+	return true;
+}
+
+/*
+ * Check whether the space separated list of capabilities contains cap.
+ */
+static bool has_capability(const char *caps, const char *cap)
+{
+	size_t len = strlen(cap);
+
+	while (*caps) {
+		size_t n = strcspn(caps, FIELD_DELIM);
+
+		if (n == len && !strncmp(caps, cap, len))
+			return true;
+
+		caps += n;
+		caps += strspn(caps, FIELD_DELIM);
+	}
+	return false;
+}
+
+/*
+ * Pick the id for a new message. Ids handed out by the server stay clear of
+ * the client namespace of the binary protocol and of messages which are
+ * still being filled, e.g. by a client that chose a numeric id itself.
+ */
+static void ipc_msg_next_id(struct ipc_ctx *ctx, char *buf, size_t size)
+{
+	do {
+		snprintf(buf, size, "%lu", ctx->next_msgid);
+		ctx->next_msgid = (ctx->next_msgid + 1) % IPC_V2_CLIENT_ID;
+	} while (ipc_msg_find(ctx, buf));
+}
+
+static bool ipc_msg_take(struct ipc_ctx *ctx, bool v2)
+{
+	char idbuf[32];
+
+	ipc_msg_next_id(ctx, idbuf, sizeof(idbuf));
+
+	if (!(v2 ? ipc_send_reply(ctx, "TAKE %s v2", idbuf) : ipc_send_reply(ctx, "TAKE %s", idbuf)))
+		return false;
+
+	if (v2) {
+		/* Everything after this frame is binary in both directions. */
+		pthread_mutex_lock(&ctx->out_lock);
+		ctx->flags |= IPC_CTX_V2;
+		pthread_mutex_unlock(&ctx->out_lock);
+	}
+
+	ipc_msg_add(ctx, idbuf);
+
+	return true;
+}
+
+static bool ipc_msg_done(struct ipc_ctx *ctx, const char *id)
+{
+	struct ipc_message *msg = ipc_msg_find(ctx, id);
+	if (!msg) {
+		ipc_send_reply(ctx, "RESPONSE 0 ERROR 'DONE' got unknown id '%s'", id);
+		return false;
+	}
+
+	int res = 0;
+
+	ipc_msg_unlink(ctx, msg);
+
+	if (ctx->handle_message)
+		res = ctx->handle_message(ctx, msg, ctx->data);
+
+	/* The handler took the message and will complete it later. */
+	if (res == IPC_MSG_PENDING)
+		return true;
+
+	return ipc_msg_complete(ctx, msg, res);
+}
+
+bool handle_hllo(struct ipc_ctx *ctx, struct ipc_token *tok)
+{
+	return ipc_msg_take(ctx, tok->arg && has_capability(tok->arg, "v2"));
+}
+
+bool handle_take(struct ipc_ctx *ctx, struct ipc_token *tok)
+{
+	ipc_msg_add(ctx, tok->id);
+	return true;
+}
+
+bool handle_pair(struct ipc_ctx *ctx, struct ipc_token *tok)
+{
+	char *eq = strchr(tok->arg, '=');
+	if (!eq) {
+		ipc_send_reply(ctx, "RESPONSE %s ERROR 'PAIR' bad format", tok->id);
+		return false;
+	}
+
+	*eq = '\0';
+
+	char *key = tok->arg;
+	char *val = eq + 1;
+
+	sanitize_newlines(key);
+	//sanitize_newlines(val);
+
+	struct ipc_message *msg = ipc_msg_find(ctx, tok->id);
+	if (!msg)
+		msg = ipc_msg_add(ctx, tok->id);
+
+	return ipc_pair_add(&msg->data, key, val);
+}
+
+bool handle_done(struct ipc_ctx *ctx, struct ipc_token *tok)
+{
+	return ipc_msg_done(ctx, tok->id);
+}
+
+bool ipc_msg_complete(struct ipc_ctx *ctx, struct ipc_message *msg, int res)
+{
+	if (ipc_take_dropped(ctx, msg->id))
+		res = -1;
+
+	bool ret = (!res)
+		? ipc_send_reply(ctx, "RESPONSE %s OK", msg->id)
+		: ipc_send_reply(ctx, "RESPONSE %s ERROR", msg->id);
+
+	ipc_msg_free(msg);
+
+	return ret;
+}
+
+bool handle_dummy(struct ipc_ctx *ctx __attribute__((unused)),
+		 struct ipc_token *tok)
+{
+	if (IS_DEBUG())
+		warnx("Got %s id=%s", tok->cmd, tok->id);
+	return true;
+}
+
+static void ipc_process_frame(struct ipc_ctx *ctx, char *frame)
+{
+	struct ipc_token tok;
+	int ret;
+
+	if (IS_DEBUG())
+		warnx("pid=%-10d RECV: %s", getpid(), frame);
+
+	ret = ipc_parse_token(frame, &tok);
+
+	if (ret < 0) {
+		if (ret == -ESRCH) {
+			ipc_send_reply(ctx, "RESPONSE %s ERROR unknown command '%s'",
+					tok.cmd,
+					tok.id ? tok.id : "0");
+		} else {
+			ipc_send_reply(ctx, "RESPONSE %s ERROR bad format",
+					tok.id ? tok.id : "0");
+		}
+	} else if (!tok.handler(ctx, &tok)) {
+		warnx("command processing failed");
+	}
+}
+
+static void ipc_process_packet(struct ipc_ctx *ctx, const char *frame)
+{
+	struct ipc_v2_header hdr;
+	struct ipc_message *msg;
+	char id[16];
+
+	memcpy(&hdr, frame, sizeof(hdr));
+	snprintf(id, sizeof(id), "%u", hdr.id);
+
+	if (IS_DEBUG())
+		warnx("pid=%-10d RECV(v2): cmd=%u id=%s len=%u", getpid(), hdr.cmd, id, hdr.len);
+
+	switch (hdr.cmd) {
+	case IPC_V2_HELLO:
+		ipc_msg_take(ctx, false);
+		break;
+	case IPC_V2_PAIR:
+		msg = ipc_msg_find(ctx, id);
+		if (!msg)
+			msg = ipc_msg_add(ctx, id);
+
+		if (!msg || !ipc_v2_decode_pairs(frame + sizeof(hdr), hdr.len, &msg->data))
+			ipc_send_reply(ctx, "RESPONSE %s ERROR 'PAIR' bad format", id);
+		break;
+	case IPC_V2_DONE:
+		ipc_msg_done(ctx, id);
+		break;
+	default:
+		ipc_send_reply(ctx, "RESPONSE %s ERROR unknown command '%u'", id, hdr.cmd);
+		break;
+	}
+}
+
+/*
+ * Process all complete frames in the receive ring. The framing may change
+ * from text to binary after any frame. Returns false on a fatal protocol
+ * error.
+ */
+static bool ipc_process_frames(struct ipc_ctx *ctx)
+{
+	char *frame;
+	size_t len;
+
+	while (1) {
+		errno = 0;
+
+		if (!(ctx->flags & IPC_CTX_V2)) {
+			frame = ipc_ring_next_frame(&ctx->inbuf, NULL);
+			if (!frame)
+				return errno == 0;
+
+			ipc_process_frame(ctx, frame);
+			continue;
+		}
+
+		frame = ipc_ring_next_packet(&ctx->inbuf, &len);
+		if (!frame)
+			return errno == 0;
+
+		ipc_process_packet(ctx, frame);
+	}
+}
+
+char *ipc_datagram_buffer(struct ipc_ctx *ctx)
+{
+	if (!ctx->dgram) {
+		ctx->dgram = malloc(IPC_SEQPACKET_MAX);
+		if (!ctx->dgram)
+			warn("malloc failed");
+	}
+	return ctx->dgram;
+}
+
+/*
+ * Receive one datagram into ctx->dgram. Returns its size, 0 if the peer has
+ * closed the connection or -1.
+ */
+static ssize_t ipc_recv_datagram(struct ipc_ctx *ctx, int flags)
+{
+	struct iovec iov = {
+		.iov_base = ipc_datagram_buffer(ctx),
+		.iov_len = IPC_SEQPACKET_MAX,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	if (!iov.iov_base)
+		return -1;
+
+	ssize_t size = recvmsg_retry(ctx->fd, &msg, flags);
+
+	if (size > 0 && (msg.msg_flags & MSG_TRUNC)) {
+		warnx("datagram is larger than %d bytes", IPC_SEQPACKET_MAX);
+		errno = EMSGSIZE;
+		return -1;
+	}
+	return size;
+}
+
+/*
+ * Take the next frame off a received datagram. Returns NULL at its end or,
+ * with errno set to EMSGSIZE, if the datagram ends with a partial frame.
+ */
+static char *ipc_datagram_next(struct ipc_ctx *ctx, char **buf, size_t *len)
+{
+	errno = 0;
+
+	if (!*len)
+		return NULL;
+
+	size_t size = ipc_frame_size(*buf, *len, (ctx->flags & IPC_CTX_V2));
+	if (!size) {
+		warnx("datagram ends with a partial frame");
+		errno = EMSGSIZE;
+		return NULL;
+	}
+
+	char *frame = *buf;
+
+	*buf += size;
+	*len -= size;
+
+	return frame;
+}
+
+/*
+ * Process the frames of a datagram in place. No reassembly is needed since a
+ * datagram never ends in the middle of a frame.
+ */
+bool ipc_process_datagram(struct ipc_ctx *ctx, char *buf, size_t len)
+{
+	char *frame;
+
+	while ((frame = ipc_datagram_next(ctx, &buf, &len)) != NULL) {
+		if (ctx->flags & IPC_CTX_V2)
+			ipc_process_packet(ctx, frame);
+		else
+			ipc_process_frame(ctx, frame);
+	}
+	return errno != EMSGSIZE;
+}
+
+/*
+ * Read everything the peer has sent so far without blocking and process all
+ * complete frames in place. Returns false if the connection has been closed.
+ */
+bool ipc_process_input(struct ipc_ctx *ctx)
+{
+	bool seqpacket = (ctx->flags & IPC_CTX_SEQPACKET);
+
+	while (1) {
+		ssize_t len = seqpacket
+			? ipc_recv_datagram(ctx, MSG_DONTWAIT)
+			: ipc_ring_recv(&ctx->inbuf, ctx->fd, MSG_DONTWAIT);
+
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			if (errno != EMSGSIZE)
+				warn("recvmsg");
+			return false;
+		}
+
+		if (!len)
+			return false;
+
+		if (!(seqpacket
+		      ? ipc_process_datagram(ctx, ctx->dgram, (size_t) len)
+		      : ipc_process_frames(ctx)))
+			return false;
+	}
+}
+
+/*
+ * Same as ipc_process_input() for data that the caller has already received.
+ */
+bool ipc_process_data(struct ipc_ctx *ctx, const char *buf, size_t len)
+{
+	while (len > 0) {
+		size_t n = ipc_ring_push(&ctx->inbuf, buf, len);
+		if (!n)
+			return false;
+
+		buf += n;
+		len -= n;
+
+		if (!ipc_process_frames(ctx))
+			return false;
+	}
+	return true;
+}
+
+bool ipc_event_loop(struct ipc_ctx *ctx)
+{
+	struct pollfd pfd = {
+		.fd = ctx->fd,
+	};
+
+	while (1) {
 		int r;
 
-		if (ctx->event_loop_iter && !ctx->event_loop_iter(ctx->data))
-			break;
+		if (ctx->event_loop_iter && !ctx->event_loop_iter(ctx->data))
+			break;
+
+		if (ipc_output_failed(ctx))
+			break;
+
+		pfd.events = POLLIN;
+		if (ipc_has_output(ctx))
+			pfd.events |= POLLOUT;
+
+		errno = 0;
+		if ((r = poll(&pfd, 1, 3000)) < 0) {
+			if (errno == EINTR)
+				continue;
+			warn("poll");
+			return false;
+		}
+
+		if (!r)
+			continue;
+
+		if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			close(ctx->fd);
+			ctx->fd = -1;
+			break;
+		}
+
+		if ((pfd.revents & POLLOUT) && !ipc_flush(ctx))
+			break;
+
+		if ((pfd.revents & POLLIN) && !ipc_process_input(ctx))
+			break;
+	}
+
+	return true;
+}
+
+void ipc_init(struct ipc_ctx *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fd = -1;
+
+	pthread_mutex_init(&ctx->out_lock, NULL);
+
+	LIST_INIT(&ctx->msgs);
+	TAILQ_INIT(&ctx->reqs);
+}
+
+void ipc_free(struct ipc_ctx *ctx)
+{
+	if (ctx->fd >= 0)
+		close(ctx->fd);
+
+	struct ipc_message *m1, *m2;
+
+	m1 = LIST_FIRST(&ctx->msgs);
+	while (m1) {
+		m2 = LIST_NEXT(m1, entries);
+		ipc_msg_free(m1);
+		m1 = m2;
+	}
+
+	while ((m1 = ctx->msg_cache) != NULL) {
+		ctx->msg_cache = m1->hash_next;
+		free(m1);
+	}
+	ctx->msg_cache_len = 0;
+
+	/* The handles belong to the caller, they just never get an answer. */
+	struct ipc_request *req;
+
+	while ((req = TAILQ_FIRST(&ctx->reqs)))
+		ipc_request_finish(ctx, req, false);
+
+	ipc_ring_free(&ctx->inbuf);
+	free(ctx->dgram);
+	ipc_outbuf_free(&ctx->outbuf);
+	ipc_outbuf_free(&ctx->reqbuf);
+	ipc_pair_free(&ctx->dropped);
+
+	pthread_mutex_destroy(&ctx->out_lock);
+}
+
+void ipc_free_token(struct ipc_token *tok)
+{
+	free(tok->data);
+	memset(tok, 0, sizeof(*tok));
+}
+
+int ipc_parse_token(char *token, struct ipc_token *tok)
+{
+	char *sv = NULL;
+
+	memset(tok, 0, sizeof(*tok));
+
+	if ((tok->cmd = strtok_r(token, FIELD_DELIM, &sv)) == NULL) {
+		warnx("ERROR: missing 'command' field");
+		return -EINVAL;
+	}
+
+	if (!ipc_set_handler(tok)) {
+		warnx("ERROR unknown command '%s'", tok->cmd);
+		return -ESRCH;
+	}
+
+	tok->data = token;
+
+	if (streq(tok->cmd, "HELLO")) {
+		tok->arg = strtok_r(NULL, "", &sv);
+		return 0;
+	}
+
+	if (streq(tok->cmd, "PING") || streq(tok->cmd, "PONG"))
+		return 0;
+
+	if ((tok->id = strtok_r(NULL, FIELD_DELIM, &sv)) == NULL) {
+		warnx("ERROR: '%s' missing 'id' field", tok->cmd);
+		return -EINVAL;
+	}
+
+	if (streq(tok->cmd, "PAIR") || streq(tok->cmd, "RESPDATA")) {
+		if ((tok->arg = strtok_r(NULL, "", &sv)) == NULL) {
+			warnx("ERROR: '%s' missing 'key=value'", tok->cmd);
+			return -EINVAL;
+		}
+	} else if (streq(tok->cmd, "RESPONSE")) {
+		if ((tok->status = strtok_r(NULL, FIELD_DELIM, &sv)) == NULL) {
+			warnx("ERROR: '%s' missing 'status' field", tok->cmd);
+			return -EINVAL;
+		}
+		tok->arg = strtok_r(NULL, "", &sv);
+	} else if (streq(tok->cmd, "TAKE")) {
+		tok->arg = strtok_r(NULL, "", &sv);
+	}
+
+	return 0;
+}
+
+ssize_t ipc_recv_token(struct ipc_ctx *ctx, struct ipc_token *tok)
+{
+	while (1) {
+		size_t len;
+
+		char *frame = ipc_ring_next_frame(&ctx->inbuf, &len);
+		if (frame) {
+			if (IS_DEBUG())
+				warnx("pid=%-10d RECV: %s", getpid(), frame);
+
+			/* The token outlives the ring contents, so it owns a copy. */
+			char *line = strndup(frame, len);
+			if (!line)
+				return -1;
+
+			if (ipc_parse_token(line, tok) < 0) {
+				free(line);
+				tok->data = NULL;
+				return -1;
+			}
+			return (ssize_t) len + 1;
+		}
+
+		ssize_t n = ipc_ring_recv(&ctx->inbuf, ctx->fd, 0);
+		if (n <= 0) {
+			if (n < 0)
+				warn("recvmsg");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Append the header of a binary frame. The length is filled in by
+ * ipc_v2_end() once the entries are added.
+ */
+static bool ipc_v2_begin(struct ipc_outbuf *b, uint8_t cmd, uint32_t id)
+{
+	struct ipc_v2_header hdr = {
+		.cmd = cmd,
+		.id = id,
+	};
+
+	if (!ipc_outbuf_reserve(b, sizeof(hdr)))
+		return false;
+
+	memcpy(b->data + b->len, &hdr, sizeof(hdr));
+	b->len += sizeof(hdr);
+
+	return true;
+}
+
+static void ipc_v2_end(struct ipc_outbuf *b, size_t off)
+{
+	uint32_t len = (uint32_t) (b->len - off - sizeof(struct ipc_v2_header));
+
+	memcpy(b->data + off + offsetof(struct ipc_v2_header, len), &len, sizeof(len));
+}
+
+static bool ipc_v2_add_pair(struct ipc_outbuf *b, const char *key, size_t key_len,
+		const char *val, size_t val_len)
+{
+	if (key_len > UINT16_MAX || val_len > IPC_V2_FRAME_MAX) {
+		warnx("ERROR: pair '%.*s' is too large", (int) MIN(key_len, 64), key);
+		return false;
+	}
+
+	if (!ipc_outbuf_reserve(b, sizeof(struct ipc_v2_entry) + key_len + val_len))
+		return false;
+
+	b->len += ipc_v2_put_entry(b->data + b->len, key, key_len, val, val_len);
+
+	return true;
+}
+
+/*
+ * Split the finished frame at off into frames of at most limit bytes with the
+ * same command and id, so that each of them fits into a datagram. An entry
+ * is never split; a larger one gets a frame of its own.
+ */
+static bool ipc_v2_split_frame(struct ipc_outbuf *b, size_t off, size_t limit)
+{
+	struct ipc_outbuf out = { 0 };
+	struct ipc_v2_header hdr;
+	struct ipc_v2_entry e;
+
+	memcpy(&hdr, b->data + off, sizeof(hdr));
+
+	const char *pos = b->data + off + sizeof(hdr);
+	const char *end = pos + hdr.len;
+	size_t frame = 0;
+
+	if (!ipc_v2_begin(&out, hdr.cmd, hdr.id))
+		return false;
+
+	while (pos < end) {
+		memcpy(&e, pos, sizeof(e));
+
+		size_t size = sizeof(e) + e.key_len + e.val_len;
+
+		if (out.len - frame > sizeof(hdr) && out.len - frame + size > limit) {
+			ipc_v2_end(&out, frame);
+			frame = out.len;
+
+			if (!ipc_v2_begin(&out, hdr.cmd, hdr.id))
+				goto fail;
+		}
+
+		if (!ipc_outbuf_reserve(&out, size))
+			goto fail;
+
+		memcpy(out.data + out.len, pos, size);
+		out.len += size;
+		pos += size;
+	}
+	ipc_v2_end(&out, frame);
+
+	b->len = off;
+
+	if (!ipc_outbuf_reserve(b, out.len))
+		goto fail;
+
+	memcpy(b->data + b->len, out.data, out.len);
+	b->len += out.len;
+
+	ipc_outbuf_free(&out);
+	return true;
+fail:
+	ipc_outbuf_free(&out);
+	return false;
+}
+
+static bool ipc_send_all(struct ipc_ctx *ctx, const char *buf, size_t len)
+{
+	bool v2 = (ctx->flags & IPC_CTX_V2);
+
+	while (len > 0) {
+		ssize_t size = (ctx->flags & IPC_CTX_SEQPACKET)
+			? ipc_send_datagrams(ctx->fd, buf, len, &v2)
+			: TEMP_FAILURE_RETRY(send(ctx->fd, buf, len, 0));
+		if (size <= 0) {
+			if (size < 0 && errno != EMSGSIZE)
+				warn("send");
+			return false;
+		}
+		buf += size;
+		len -= (size_t) size;
+	}
+	return true;
+}
+
+bool ipc_send_message(struct ipc_ctx *ctx, char **pairs, int num_pairs,
+		struct ipc_pair *result)
+{
+	struct send_pairs_raw_args args = {
+		.pairs = pairs,
+		.num_pairs = num_pairs,
+	};
+	struct ipc_pair resp = { 0 };
+	bool ret;
+
+	ret = ipc_send_message_common(ctx, &pairs_raw, &args, &resp);
+	if (result) {
+		result->kv = resp.kv;
+		result->num_kv = resp.num_kv;
+		result->capacity = resp.capacity;
+	} else {
+		ipc_pair_free(&resp);
+	}
 
-		errno = 0;
-		if ((r = poll(&pfd, 1, 3000)) < 0) {
-			if (errno == EINTR)
-				continue;
-			warn("poll");
+	return ret;
+}
+
+static bool format_pairs_raw(struct ipc_outbuf *b, const char *id, const void *data)
+{
+	const struct send_pairs_raw_args *args = data;
+	char **pairs = args->pairs;
+	int num_pairs = args->num_pairs;
+
+	for (int i = 0; i < num_pairs; i++) {
+		if (pairs[i] && pairs[i][0] != '\0' &&
+		    !ipc_outbuf_printf(b, "PAIR %s %s", id, pairs[i]))
 			return false;
-		}
+	}
 
-		if (!r)
-			continue;
+	return true;
+}
 
-		if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
-			close(ctx->fd);
-			ctx->fd = -1;
-			break;
-		}
+static bool format_pairs_kv(struct ipc_outbuf *b, const char *id, const void *data)
+{
+	const struct ipc_pair *pairs = data;
 
-		if (pfd.revents & POLLIN) {
-			char buf[BUFSIZ];
+	for (size_t i = 0; i < pairs->num_kv; i++) {
+		if (!ipc_outbuf_printf(b, "PAIR %s %s=%s", id,
+				pairs->kv[i].key, pairs->kv[i].val))
+			return false;
+	}
 
-			ssize_t len = ipc_recv_data(ctx->fd, buf, sizeof(buf));
-			if (len <= 0)
-				break;
+	return true;
+}
 
-			ipc_buffer_append(&ctx->inbuf, buf, (size_t) len);
-
-			char *s;
-			while ((s = ipc_buffer_next_line(&ctx->inbuf)) != NULL) {
-				struct ipc_token tok;
-				int ret = ipc_parse_token(s, &tok);
-
-				if (ret < 0) {
-					if (ret == -ESRCH) {
-						ipc_send_string(ctx->fd, "RESPONSE %s ERROR unknown command '%s'",
-								tok.cmd,
-								tok.id ? tok.id : "0");
-					} else {
-						ipc_send_string(ctx->fd, "RESPONSE %s ERROR bad format",
-								tok.id ? tok.id : "0");
-					}
-				} else if (!tok.handler(ctx, &tok)) {
-					warnx("command processing failed");
-				}
-				free(s);
-			}
+static bool encode_pairs_raw(struct ipc_outbuf *b, const void *data)
+{
+	const struct send_pairs_raw_args *args = data;
+
+	for (int i = 0; i < args->num_pairs; i++) {
+		const char *pair = args->pairs[i];
+
+		if (!pair || pair[0] == '\0')
+			continue;
+
+		const char *eq = strchr(pair, '=');
+		if (!eq) {
+			warnx("ERROR: bad format of pair '%s'", pair);
+			return false;
 		}
+
+		if (!ipc_v2_add_pair(b, pair, (size_t) (eq - pair), eq + 1, strlen(eq + 1)))
+			return false;
 	}
 
 	return true;
 }
 
-void ipc_init(struct ipc_ctx *ctx)
+static bool encode_pairs_kv(struct ipc_outbuf *b, const void *data)
 {
-	memset(ctx, 0, sizeof(*ctx));
-	ctx->fd = -1;
+	const struct ipc_pair *pairs = data;
 
-	LIST_INIT(&ctx->msgs);
+	for (size_t i = 0; i < pairs->num_kv; i++) {
+		const struct ipc_kv *kv = &pairs->kv[i];
+
+		if (!ipc_v2_add_pair(b, kv->key, strlen(kv->key), kv->val, strlen(kv->val)))
+			return false;
+	}
+
+	return true;
 }
 
-void ipc_free(struct ipc_ctx *ctx)
+/*
+ * Client side. Every request is tracked by a handle in ctx->reqs until its
+ * RESPONSE arrives, so several requests can be in flight on one connection.
+ * Frames of the server are routed to them by id in the order they complete.
+ */
+static struct ipc_request *ipc_request_find(struct ipc_ctx *ctx, const char *id, uint32_t wire_id)
 {
-	if (ctx->fd >= 0)
-		close(ctx->fd);
-
-	struct ipc_message *m1, *m2;
+	struct ipc_request *req;
 
-	m1 = LIST_FIRST(&ctx->msgs);
-	while (m1) {
-		m2 = LIST_NEXT(m1, entries);
-		ipc_msg_free(m1);
-		m1 = m2;
+	TAILQ_FOREACH(req, &ctx->reqs, entries) {
+		if (req->state == IPC_REQ_HELLO)
+			continue;
+		if (id ? streq(req->id, id) : req->wire_id == wire_id)
+			return req;
 	}
 
-	ipc_buffer_free(&ctx->inbuf);
+	/* Errors the server cannot attribute go to the oldest request. */
+	if ((id && streq(id, "0")) || (!id && !wire_id))
+		return TAILQ_FIRST(&ctx->reqs);
+
+	return NULL;
 }
 
-void ipc_free_token(struct ipc_token *tok)
+static void ipc_request_set_id(struct ipc_request *req, const char *id)
 {
-	free(tok->data);
-	memset(tok, 0, sizeof(*tok));
+	strlcpy(req->id, id, sizeof(req->id));
+	req->wire_id = (uint32_t) strtoul(id, NULL, 10);
+	req->state = IPC_REQ_SENT;
 }
 
-int ipc_parse_token(char *token, struct ipc_token *tok)
+static void ipc_request_finish(struct ipc_ctx *ctx, struct ipc_request *req, bool ok)
 {
-	char *sv = NULL;
+	TAILQ_REMOVE(&ctx->reqs, req, entries);
 
-	memset(tok, 0, sizeof(*tok));
+	req->state = IPC_REQ_DONE;
+	req->ok = ok;
+}
 
-	if ((tok->cmd = strtok_r(token, FIELD_DELIM, &sv)) == NULL) {
-		warnx("ERROR: missing 'command' field");
-		return -EINVAL;
+static void ipc_client_take(struct ipc_ctx *ctx, const char *id, const char *caps)
+{
+	struct ipc_request *req;
+
+	TAILQ_FOREACH(req, &ctx->reqs, entries) {
+		if (req->state == IPC_REQ_HELLO)
+			break;
 	}
 
-	if (!ipc_set_handler(tok)) {
-		warnx("ERROR unknown command '%s'", tok->cmd);
-		return -ESRCH;
+	if (!req) {
+		warnx("ERROR: unexpected 'TAKE %s'", id);
+		return;
 	}
 
-	tok->data = token;
+	ipc_request_set_id(req, id);
 
-	if (streq(tok->cmd, "HELLO") || streq(tok->cmd, "PING") || streq(tok->cmd, "PONG"))
-		return 0;
+	if (ctx->flags & IPC_CTX_WANT_V2) {
+		/* A server that does not know v2 just ignores the offer. */
+		ctx->flags &= ~IPC_CTX_WANT_V2;
 
-	if ((tok->id = strtok_r(NULL, FIELD_DELIM, &sv)) == NULL) {
-		warnx("ERROR: '%s' missing 'id' field", tok->cmd);
-		return -EINVAL;
+		if (caps && has_capability(caps, "v2"))
+			ctx->flags |= IPC_CTX_V2;
 	}
+}
 
-	if (streq(tok->cmd, "PAIR") || streq(tok->cmd, "RESPDATA")) {
-		if ((tok->arg = strtok_r(NULL, "", &sv)) == NULL) {
-			warnx("ERROR: '%s' missing 'key=value'", tok->cmd);
-			return -EINVAL;
+static bool ipc_client_frame(struct ipc_ctx *ctx, char *frame)
+{
+	struct ipc_request *req;
+	struct ipc_token tok;
+
+	if (IS_DEBUG())
+		warnx("pid=%-10d RECV: %s", getpid(), frame);
+
+	if (ipc_parse_token(frame, &tok) < 0)
+		return false;
+
+	if (streq(tok.cmd, "TAKE")) {
+		ipc_client_take(ctx, tok.id, tok.arg);
+		return true;
+	}
+
+	req = tok.id ? ipc_request_find(ctx, tok.id, 0) : NULL;
+	if (!req) {
+		if (IS_DEBUG())
+			warnx("%s for unknown id '%s'", tok.cmd, tok.id);
+		return true;
+	}
+
+	if (streq(tok.cmd, "RESPDATA")) {
+		char *eq = strchr(tok.arg, '=');
+		if (!eq) {
+			warnx("ERROR: bad format of 'RESPDATA'");
+			ipc_request_finish(ctx, req, false);
+			return true;
 		}
-	} else if (streq(tok->cmd, "RESPONSE")) {
-		if ((tok->status = strtok_r(NULL, FIELD_DELIM, &sv)) == NULL) {
-			warnx("ERROR: '%s' missing 'status' field", tok->cmd);
-			return -EINVAL;
+
+		*eq = '\0';
+
+		if (!ipc_pair_add(&req->resp, tok.arg, eq + 1))
+			return false;
+
+	} else if (streq(tok.cmd, "RESPONSE")) {
+		bool ok = streq(tok.status, "OK");
+
+		if (!ok && tok.arg)
+			warnx("ERROR: %s", tok.arg);
+
+		ipc_request_finish(ctx, req, ok);
+	}
+
+	return true;
+}
+
+static bool ipc_client_packet(struct ipc_ctx *ctx, const char *frame)
+{
+	struct ipc_v2_header hdr;
+	struct ipc_request *req;
+
+	memcpy(&hdr, frame, sizeof(hdr));
+
+	const char *body = frame + sizeof(hdr);
+
+	if (IS_DEBUG())
+		warnx("pid=%-10d RECV(v2): cmd=%u id=%u len=%u", getpid(), hdr.cmd, hdr.id, hdr.len);
+
+	if (hdr.cmd == IPC_V2_TAKE) {
+		char id[16];
+
+		snprintf(id, sizeof(id), "%u", hdr.id);
+		ipc_client_take(ctx, id, NULL);
+		return true;
+	}
+
+	req = ipc_request_find(ctx, NULL, hdr.id);
+	if (!req) {
+		if (IS_DEBUG())
+			warnx("command %u for unknown id '%u'", hdr.cmd, hdr.id);
+		return true;
+	}
+
+	if (hdr.cmd == IPC_V2_RESPDATA) {
+		if (!ipc_v2_decode_pairs(body, hdr.len, &req->resp)) {
+			warnx("ERROR: bad format of 'RESPDATA'");
+			ipc_request_finish(ctx, req, false);
 		}
-		tok->arg = strtok_r(NULL, "", &sv);
+
+	} else if (hdr.cmd == IPC_V2_RESPONSE) {
+		if (hdr.status && hdr.len) {
+			struct ipc_pair msg = { 0 };
+
+			if (ipc_v2_decode_pairs(body, hdr.len, &msg) && msg.num_kv)
+				warnx("ERROR: %s", msg.kv[0].val);
+			ipc_pair_free(&msg);
+		}
+
+		ipc_request_finish(ctx, req, hdr.status == 0);
 	}
 
-	return 0;
+	return true;
 }
 
-ssize_t ipc_recv_token(struct ipc_ctx *ctx, struct ipc_token *tok)
+static int ipc_client_frames(struct ipc_ctx *ctx)
 {
 	while (1) {
-		char tmp[BUFSIZ] = { 0 };
+		char *frame;
+		size_t len;
+
+		errno = 0;
+
+		/* TAKE may switch the connection to binary framing midway. */
+		if (!(ctx->flags & IPC_CTX_V2)) {
+			frame = ipc_ring_next_frame(&ctx->inbuf, NULL);
+			if (!frame)
+				return errno ? -1 : 1;
 
-		char *line = ipc_buffer_next_line(&ctx->inbuf);
-		if (line) {
-			ssize_t size = (ssize_t) strlen(line) + 1;
-			return !ipc_parse_token(line, tok) ? size : -1;
+			if (!ipc_client_frame(ctx, frame))
+				return -1;
+			continue;
 		}
 
-		ssize_t n = ipc_recv_data(ctx->fd, tmp, sizeof(tmp));
-		if (n <= 0)
+		frame = ipc_ring_next_packet(&ctx->inbuf, &len);
+		if (!frame)
+			return errno ? -1 : 1;
+
+		if (!ipc_client_packet(ctx, frame))
 			return -1;
+	}
+}
+
+static int ipc_client_datagram(struct ipc_ctx *ctx, char *buf, size_t len)
+{
+	char *frame;
 
-		ipc_buffer_append(&ctx->inbuf, tmp, (size_t) n);
+	while ((frame = ipc_datagram_next(ctx, &buf, &len)) != NULL) {
+		bool ok = (ctx->flags & IPC_CTX_V2)
+			? ipc_client_packet(ctx, frame)
+			: ipc_client_frame(ctx, frame);
+		if (!ok)
+			return -1;
 	}
-	return 0;
+	return (errno == EMSGSIZE) ? -1 : 1;
 }
 
-bool ipc_send_message(struct ipc_ctx *ctx, char **pairs, int num_pairs,
-		struct ipc_pair *result)
+/*
+ * Receive what the server has sent and route all complete frames. Without
+ * block only the data that is already there is read. Returns 1 if something
+ * was received, 0 if nothing was there and -1 if the connection is broken.
+ */
+static int ipc_client_read(struct ipc_ctx *ctx, bool block)
 {
-	struct send_pairs_raw_args args = {
-		.pairs = pairs,
-		.num_pairs = num_pairs,
-	};
-	struct ipc_pair resp = { 0 };
-	bool ret;
+	bool seqpacket = (ctx->flags & IPC_CTX_SEQPACKET);
+	int flags = block ? 0 : MSG_DONTWAIT;
 
-	ret = ipc_send_message_common(ctx, send_pairs_raw, &args, &resp);
-	if (result) {
-		result->kv = resp.kv;
-		result->num_kv = resp.num_kv;
-		result->capacity = resp.capacity;
-	} else {
-		ipc_pair_free(&resp);
+	ssize_t n = seqpacket
+		? ipc_recv_datagram(ctx, flags)
+		: ipc_ring_recv(&ctx->inbuf, ctx->fd, flags);
+
+	if (n < 0) {
+		if (!block && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (errno != EMSGSIZE)
+			warn("recvmsg");
+		return -1;
 	}
 
-	return ret;
+	if (!n)
+		return -1;
+
+	return seqpacket
+		? ipc_client_datagram(ctx, ctx->dgram, (size_t) n)
+		: ipc_client_frames(ctx);
 }
 
-static bool send_pairs_raw(struct ipc_ctx *ctx, const char *id, const void *data)
+static bool ipc_request_hello(struct ipc_ctx *ctx, struct ipc_request *req)
 {
-	const struct send_pairs_raw_args *args = data;
-	char **pairs = args->pairs;
-	int num_pairs = args->num_pairs;
+	req->state = IPC_REQ_HELLO;
 
-	for (int i = 0; i < num_pairs; i++) {
-		if (pairs[i] && pairs[i][0] != '\0' &&
-		    ipc_send_string(ctx->fd, "PAIR %s %s", id, pairs[i]) < 0)
+	if (ctx->flags & IPC_CTX_V2) {
+		struct ipc_v2_header hdr = {
+			.cmd = IPC_V2_HELLO,
+		};
+
+		if (IS_DEBUG())
+			warnx("pid=%-10d SEND(v2): HELLO", getpid());
+
+		if (!ipc_send_all(ctx, (const char *) &hdr, sizeof(hdr)))
+			return false;
+
+	} else if (ipc_send_string(ctx->fd, "%s",
+			(ctx->flags & IPC_CTX_WANT_V2) ? "HELLO v2" : "HELLO") < 0) {
+		return false;
+	}
+
+	/* Responses to other requests may arrive before TAKE. */
+	while (req->state == IPC_REQ_HELLO) {
+		if (ipc_client_read(ctx, true) < 0)
 			return false;
 	}
 
 	return true;
 }
 
-static bool send_pairs_kv(struct ipc_ctx *ctx, const char *id, const void *data)
+/*
+ * All pairs and DONE are built in ctx->reqbuf and go out in one write. The
+ * buffer is kept for the next request unless it grew unusually large.
+ */
+static bool ipc_request_send_pairs(struct ipc_ctx *ctx, struct ipc_request *req,
+		const struct pairs_ops *ops, const void *pairs_data)
 {
-	const struct ipc_pair *pairs = data;
+	struct ipc_outbuf *b = &ctx->reqbuf;
+	bool ret = false;
 
-	for (size_t i = 0; i < pairs->num_kv; i++) {
-		ssize_t size = ipc_send_string(ctx->fd, "PAIR %s %s=%s", id,
-				pairs->kv[i].key, pairs->kv[i].val);
-		if (size < 0)
-			return false;
+	b->len = 0;
+
+	if (!(ctx->flags & IPC_CTX_V2)) {
+		ret = ops->format(b, req->id, pairs_data) &&
+			ipc_outbuf_printf(b, "DONE %s", req->id);
+
+	} else if (ipc_v2_begin(b, IPC_V2_PAIR, req->wire_id) &&
+		   ops->encode(b, pairs_data)) {
+		ipc_v2_end(b, 0);
+
+		ret = (!(ctx->flags & IPC_CTX_SEQPACKET) || b->len <= IPC_SEQPACKET_MAX ||
+		       ipc_v2_split_frame(b, 0, IPC_SEQPACKET_MAX)) &&
+			ipc_v2_begin(b, IPC_V2_DONE, req->wire_id);
 	}
 
-	return true;
+	if (ret)
+		ret = ipc_send_all(ctx, b->data, b->len);
+
+	if (b->cap > IPC_REQBUF_KEEP)
+		ipc_outbuf_free(b);
+
+	return ret;
 }
 
-static bool ipc_send_message_common(struct ipc_ctx *ctx, send_pairs_fn send_pairs,
-		const void *pairs_data, struct ipc_pair *resp)
+static struct ipc_request *ipc_request_submit_common(struct ipc_ctx *ctx,
+		const struct pairs_ops *ops, const void *pairs_data)
 {
-	struct ipc_token response1 = { 0 };
-	struct ipc_token response2 = { 0 };
-	ssize_t size = 0;
-	bool ret = false;
+	struct ipc_request *req = calloc(1, sizeof(*req));
+	if (!req) {
+		warn("calloc");
+		return NULL;
+	}
 
-	if (ipc_send_string(ctx->fd, "%s", "HELLO") < 0)
-		goto finish;
+	TAILQ_INSERT_TAIL(&ctx->reqs, req, entries);
 
-	if ((size = ipc_recv_token(ctx, &response1)) <= 0)
-		goto finish;
+	/* Binary framing can only be negotiated with HELLO. */
+	if ((ctx->flags & IPC_CTX_CLIENT_IDS) &&
+	    (ctx->flags & (IPC_CTX_V2 | IPC_CTX_WANT_V2)) != IPC_CTX_WANT_V2) {
+		unsigned long n = ctx->next_msgid++;
 
-	if (!streq(response1.cmd, "TAKE")) {
-		warnx("ERROR: unexpected answer: %s", response1.cmd);
-		goto finish;
+		snprintf(req->id, sizeof(req->id), "%c%lu", IPC_CLIENT_ID_PREFIX, n);
+		req->wire_id = IPC_V2_CLIENT_ID | (uint32_t) (n & ~IPC_V2_CLIENT_ID);
+		req->state = IPC_REQ_SENT;
+
+	} else if (!ipc_request_hello(ctx, req)) {
+		goto fail;
 	}
 
-	if (!send_pairs(ctx, response1.id, pairs_data))
-		goto finish;
+	if (req->state != IPC_REQ_SENT || !ipc_request_send_pairs(ctx, req, ops, pairs_data))
+		goto fail;
 
-	if (ipc_send_string(ctx->fd, "DONE %s", response1.id) < 0)
-		goto finish;
+	return req;
+fail:
+	ipc_request_free(ctx, req);
+	return NULL;
+}
 
-	while (1) {
-		ipc_free_token(&response2);
+struct ipc_request *ipc_request_submit(struct ipc_ctx *ctx, struct ipc_pair *data)
+{
+	return ipc_request_submit_common(ctx, &pairs_kv, data);
+}
 
-		if ((size = ipc_recv_token(ctx, &response2)) <= 0)
-			goto finish;
+/*
+ * Wait until the response to req is complete. Responses to other requests
+ * received meanwhile are stored in their handles.
+ */
+bool ipc_request_wait(struct ipc_ctx *ctx, struct ipc_request *req)
+{
+	while (req->state != IPC_REQ_DONE) {
+		if (ipc_client_read(ctx, true) < 0)
+			return false;
+	}
+	return req->ok;
+}
 
-		if (streq(response2.cmd, "RESPDATA")) {
-			char *eq = strchr(response2.arg, '=');
-			if (!eq) {
-				warnx("ERROR: bad format of 'RESPDATA'");
-				break;
-			}
+/*
+ * Route everything the server has sent so far without blocking. Returns
+ * false if the connection is broken.
+ */
+bool ipc_request_poll(struct ipc_ctx *ctx)
+{
+	int ret;
 
-			*eq = '\0';
+	while ((ret = ipc_client_read(ctx, false)) > 0)
+		;
 
-			char *key = response2.arg;
-			char *val = eq + 1;
+	return ret == 0;
+}
 
-			if (!ipc_pair_add(resp, key, val))
-				goto finish;
-			continue;
-		}
+void ipc_request_free(struct ipc_ctx *ctx, struct ipc_request *req)
+{
+	if (req->state != IPC_REQ_DONE)
+		TAILQ_REMOVE(&ctx->reqs, req, entries);
 
-		if (streq(response2.cmd, "RESPONSE")) {
-			if (!streq(response2.id, response1.id) &&
-			    !streq(response2.id, "0")) {
-				warnx("ERROR: command id '%s'. expected '%s'",
-						response2.id, response1.id);
-				goto finish;
-			}
+	ipc_pair_free(&req->resp);
+	free(req);
+}
+
+static bool ipc_send_message_common(struct ipc_ctx *ctx, const struct pairs_ops *ops,
+		const void *pairs_data, struct ipc_pair *resp)
+{
+	struct ipc_request *req = ipc_request_submit_common(ctx, ops, pairs_data);
+	if (!req)
+		return false;
+
+	bool ret = ipc_request_wait(ctx, req);
 
-			ret = streq(response2.status, "OK");
-			if (!ret && response2.arg)
-				warnx("ERROR: %s", response2.arg);
+	/* Hand the response pairs over to the caller. */
+	for (size_t i = 0; i < req->resp.num_kv; i++) {
+		if (!inc_pair_capacity(resp)) {
+			ret = false;
 			break;
 		}
+		resp->kv[resp->num_kv++] = req->resp.kv[i];
+		req->resp.kv[i].key = req->resp.kv[i].val = NULL;
 	}
-finish:
-	ipc_free_token(&response1);
-	ipc_free_token(&response2);
+
+	ipc_request_free(ctx, req);
 
 	return ret;
 }
@@ -715,7 +2736,7 @@ finish:
 bool ipc_send_message2(struct ipc_ctx *ctx, struct ipc_pair *data, struct ipc_pair *resp)
 {
 	struct ipc_pair sink = { 0 };
-	bool ret = ipc_send_message_common(ctx, send_pairs_kv, data, resp ? resp : &sink);
+	bool ret = ipc_send_message_common(ctx, &pairs_kv, data, resp ? resp : &sink);
 
 	if (!resp)
 		ipc_pair_free(&sink);
@@ -736,6 +2757,11 @@ bool ipc_recv_timeout(struct ipc_ctx *ctx, int secs)
 	return true;
 }
 
+static int ipc_sock_type(struct ipc_ctx *ctx)
+{
+	return (ctx->flags & IPC_CTX_SEQPACKET) ? SOCK_SEQPACKET : SOCK_STREAM;
+}
+
 bool ipc_listen(
 	struct ipc_ctx *ctx, const char *file_name, int backlog, int sock_flags)
 {
@@ -753,7 +2779,7 @@ bool ipc_listen(
 		goto failure;
 	}
 
-	fd = socket(AF_UNIX, SOCK_STREAM | sock_flags, 0);
+	fd = socket(AF_UNIX, ipc_sock_type(ctx) | sock_flags, 0);
 	if (fd < 0) {
 		saved_errno = errno;
 		warn("socket: %s", addr.sun_path);
@@ -788,20 +2814,39 @@ struct ipc_ctx *ipc_accept(struct ipc_ctx *ctx)
 	struct sockaddr_un sun;
 	socklen_t len = sizeof(sun);
 
-	int fd = accept(ctx->fd, (struct sockaddr *) &sun, &len);
+	/*
+	 * The connection is non-blocking: responses that the peer does not
+	 * read stay in the output queue instead of blocking the sender.
+	 */
+	int fd = accept4(ctx->fd, (struct sockaddr *) &sun, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
 	if (fd < 0) {
-		warn("accept");
+		/* A non-blocking listener has no more pending connections. */
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			warn("accept");
 		return NULL;
 	}
 
-	struct ipc_ctx *new = calloc(1, sizeof(*new));
+	return ipc_accept_fd(ctx, fd);
+}
+
+/*
+ * Create the context of a client connection accepted by other means. The
+ * descriptor is closed on failure.
+ */
+struct ipc_ctx *ipc_accept_fd(struct ipc_ctx *ctx, int fd)
+{
+	struct ipc_ctx *new = malloc(sizeof(*new));
 	if (!new) {
-		warn("calloc ipc_ctx");
+		warn("malloc ipc_ctx");
 		close(fd);
 		return NULL;
 	}
 
+	ipc_init(new);
+
 	new->fd = fd;
+	new->flags = ctx->flags & IPC_CTX_SEQPACKET;
+	new->out_limit = ctx->out_limit;
 	new->data = ctx->data;
 	new->handle_message = ctx->handle_message;
 	new->event_loop_iter = ctx->event_loop_iter;
@@ -811,7 +2856,7 @@ struct ipc_ctx *ipc_accept(struct ipc_ctx *ctx)
 
 bool ipc_connect(struct ipc_ctx *ctx, const char *file_name, int sock_flags)
 {
-	int fd = socket(AF_UNIX, SOCK_STREAM | sock_flags, 0);
+	int fd = socket(AF_UNIX, ipc_sock_type(ctx) | sock_flags, 0);
 	if (fd < 0) {
 		warn("socket");
 		return false;
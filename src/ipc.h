@@ -8,52 +8,221 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 
-struct ipc_buffer {
+/*
+ * Fixed-capacity receive ring. Frames are parsed in place; only a frame that
+ * wraps around the end of the ring or is larger than the whole ring is copied
+ * into the spill buffer.
+ */
+#define IPC_RING_SIZE 16384
+
+struct ipc_ring {
+	char *data;       /* IPC_RING_SIZE bytes, allocated on first receive */
+	size_t head;      /* offset of the first unconsumed byte */
+	size_t len;       /* number of unconsumed bytes */
+	size_t scan;      /* bytes after head already known to have no NUL */
+
+	char *spill;      /* linearized or oversized frame */
+	size_t spill_len; /* bytes of an incomplete oversized frame */
+	size_t spill_cap;
+};
+
+void ipc_ring_free(struct ipc_ring *r)                           __attribute__((nonnull(1)));
+ssize_t ipc_ring_recv(struct ipc_ring *r, int fd, int flags)     __attribute__((nonnull(1)));
+size_t ipc_ring_push(struct ipc_ring *r, const char *buf, size_t len) __attribute__((nonnull(1, 2)));
+char *ipc_ring_next_frame(struct ipc_ring *r, size_t *frame_len) __attribute__((nonnull(1)));
+char *ipc_ring_next_packet(struct ipc_ring *r, size_t *frame_len) __attribute__((nonnull(1, 2)));
+
+/*
+ * Binary framing (protocol v2), negotiated per connection by "HELLO v2" and
+ * "TAKE <id> v2". Every frame is a header followed by len bytes of entries.
+ * Integers are in host byte order since both peers are on the same host.
+ */
+enum ipc_v2_cmd {
+	IPC_V2_HELLO = 1,
+	IPC_V2_TAKE,
+	IPC_V2_PAIR,
+	IPC_V2_DONE,
+	IPC_V2_RESPDATA,
+	IPC_V2_RESPONSE,
+};
+
+enum ipc_v2_type {
+	IPC_V2_STR = 1,
+};
+
+struct ipc_v2_header {
+	uint32_t len;      /* size of the entries after the header */
+	uint8_t  cmd;      /* enum ipc_v2_cmd */
+	uint8_t  status;   /* RESPONSE: 0 is OK, anything else is ERROR */
+	uint16_t reserved;
+	uint32_t id;
+};
+
+/* Followed by key_len bytes of the key and val_len bytes of the value. */
+struct ipc_v2_entry {
+	uint8_t  type;     /* enum ipc_v2_type */
+	uint8_t  reserved;
+	uint16_t key_len;
+	uint32_t val_len;
+};
+
+/*
+ * Message ids with this bit set belong to the client, the server never hands
+ * them out. In the text protocol client ids start with IPC_CLIENT_ID_PREFIX.
+ */
+#define IPC_V2_CLIENT_ID     0x80000000U
+#define IPC_CLIENT_ID_PREFIX 'c'
+
+/* Frames larger than this are a protocol error. */
+#define IPC_V2_FRAME_MAX (16 * 1024 * 1024)
+
+/*
+ * Outbound frames queued for a connection. They are sent with a single
+ * sendmsg() together with the final frame of the response.
+ */
+struct ipc_outbuf {
 	char *data;
 	size_t len;
+	size_t cap;
 };
 
-void ipc_buffer_free(struct ipc_buffer *a)                              __attribute__((nonnull(1)));
-void ipc_buffer_append(struct ipc_buffer *a, const char *buf, size_t n) __attribute__((nonnull(1, 2)));
-char *ipc_buffer_next_line(struct ipc_buffer *a)                        __attribute__((nonnull(1)));
+void ipc_outbuf_free(struct ipc_outbuf *b) __attribute__((nonnull(1)));
 
 struct ipc_kv {
 	char *key;
 	char *val;
 };
 
+struct ipc_arena_chunk;
+
+/*
+ * Bump allocator that owns the id and the pairs of a message. It starts in
+ * the memory of the message itself; what does not fit goes to chunks which
+ * are all released together with the message.
+ */
+struct ipc_arena {
+	char *pos;
+	char *end;
+	struct ipc_arena_chunk *chunks;
+};
+
 struct ipc_pair {
 	struct ipc_kv *kv;
 	size_t num_kv;
 	size_t capacity;
+	struct ipc_arena *arena; /* owner of kv and the strings, NULL for the heap */
 };
 
+struct ipc_ctx;
+
 struct ipc_message {
 	LIST_ENTRY(ipc_message) entries;
+	struct ipc_message *hash_next;
+	struct ipc_ctx *ctx; /* gets the memory back for reuse */
 
 	char *id;
 	struct ipc_pair data;
 	struct ipc_pair resp;
+	struct ipc_arena arena;
 };
 
 LIST_HEAD(ipc_msg_list, ipc_message);
 
+enum ipc_request_state {
+	IPC_REQ_HELLO, /* Waiting for TAKE */
+	IPC_REQ_SENT,  /* Pairs and DONE are sent, waiting for RESPONSE */
+	IPC_REQ_DONE,  /* RESPONSE received, the handle left ctx->reqs */
+};
+
+/*
+ * Client side of one in-flight request. Several of them can share a
+ * connection; the server answers them in the order they complete.
+ */
+struct ipc_request {
+	TAILQ_ENTRY(ipc_request) entries;
+
+	enum ipc_request_state state;
+	bool ok;
+
+	char id[24];
+	uint32_t wire_id;
+	struct ipc_pair resp;
+};
+
+TAILQ_HEAD(ipc_request_list, ipc_request);
+
+/* Buckets of the in-flight message lookup, a power of two. */
+#define IPC_MSG_HASH 64
+
+enum ipc_ctx_flags {
+	IPC_CTX_QUEUE_ONLY = (1 << 1), /* Replies are queued, the owner sends them */
+	IPC_CTX_V2         = (1 << 2), /* Binary framing is in use */
+	IPC_CTX_WANT_V2    = (1 << 3), /* Client offers binary framing in the next HELLO */
+	IPC_CTX_CLIENT_IDS = (1 << 4), /* Client picks message ids itself and skips HELLO */
+	IPC_CTX_SEQPACKET  = (1 << 5), /* SOCK_SEQPACKET socket, whole frames per datagram */
+};
+
+/*
+ * State of the output path. It is kept apart from the flags because any
+ * thread that queues a reply may set it, while the owner of the connection
+ * reads the flags without out_lock.
+ */
+enum ipc_out_flags {
+	IPC_OUT_OVERFLOW = (1 << 0), /* Output queue went over out_limit */
+	IPC_OUT_BROKEN   = (1 << 1), /* Sending failed, nothing more can be sent */
+};
+
+/*
+ * On a SOCK_SEQPACKET socket every datagram carries one or more whole frames,
+ * so the receiver parses it in place without reassembly. Frames are packed
+ * into datagrams of at most this size; a larger frame goes alone.
+ */
+#define IPC_SEQPACKET_MAX (64 * 1024)
+
 struct ipc_ctx {
 	int fd;
-	struct ipc_buffer inbuf;
+	int flags;       /* enum ipc_ctx_flags, changed only by the owner of the connection */
+	struct ipc_ring inbuf;
+	char *dgram;     /* IPC_SEQPACKET_MAX bytes, receive buffer of IPC_CTX_SEQPACKET */
+	bool dgram_v2;   /* next datagram to send is past the switch to binary framing */
 
-	unsigned long next_msgid;
+	/*
+	 * The output queue may be filled from another thread (the UI thread)
+	 * while the owner of the connection drains it.
+	 */
+	pthread_mutex_t out_lock;
+	struct ipc_outbuf outbuf;
+	size_t out_limit; /* High-water mark of outbuf, 0 means unlimited */
+	int out_flags;    /* enum ipc_out_flags, written by any thread under out_lock */
+	struct ipc_pair dropped; /* ids of messages that lost a reply too large for a datagram */
+
+	unsigned long next_msgid; /* next id to hand out, on either side */
 	struct ipc_msg_list msgs;
+	struct ipc_message *msg_hash[IPC_MSG_HASH]; /* msgs by id */
+	struct ipc_message *msg_cache;              /* freed messages kept for reuse */
+	unsigned int msg_cache_len;
+	struct ipc_request_list reqs; /* client requests waiting for RESPONSE */
+	struct ipc_outbuf reqbuf;     /* client request being sent, reused */
 
 	void *data;
 	int (*handle_message)(struct ipc_ctx *ctx, struct ipc_message *msg, void *ctx_data);
 	int (*event_loop_iter)(void *ctx_data);
 };
 
+/*
+ * A handle_message() callback returns this value when it keeps the message
+ * to finish it later with ipc_msg_complete(). Until then the message does not
+ * belong to the context.
+ */
+#define IPC_MSG_PENDING 1
+
 struct ipc_message *ipc_msg_find(struct ipc_ctx *ctx, const char *id) __attribute__((nonnull(1, 2)));
 struct ipc_message *ipc_msg_add(struct ipc_ctx *ctx, const char *id)  __attribute__((nonnull(1, 2)));
 void ipc_msg_free(struct ipc_message *m)                              __attribute__((nonnull(1)));
+void *ipc_msg_alloc(struct ipc_message *m, size_t size)               __attribute__((malloc, nonnull(1)));
+bool ipc_msg_complete(struct ipc_ctx *ctx, struct ipc_message *msg, int res) __attribute__((nonnull(1, 2)));
 
 bool ipc_pair_add(struct ipc_pair *pair, const char *key, const char *val) __attribute__((nonnull(1, 2, 3)));
 bool ipc_pair_sprintf(struct ipc_pair *pairs, const char *key, const char *fmt, ...)
@@ -68,15 +237,31 @@ void ipc_close(struct ipc_ctx *ctx) __attribute__((nonnull(1)));
 bool ipc_connect(struct ipc_ctx *ctx, const char *file_name, int sock_flags)             __attribute__((nonnull(1, 2)));
 bool ipc_listen(struct ipc_ctx *ctx, const char *file_name, int backlog, int sock_flags) __attribute__((nonnull(1, 2)));
 struct ipc_ctx *ipc_accept(struct ipc_ctx *ctx)                                          __attribute__((nonnull(1)));
+struct ipc_ctx *ipc_accept_fd(struct ipc_ctx *ctx, int fd)                               __attribute__((nonnull(1)));
 
 bool ipc_recv_timeout(struct ipc_ctx *ctx, int secs) __attribute__((nonnull(1)));
 
+bool ipc_process_input(struct ipc_ctx *ctx)           __attribute__((nonnull(1)));
+bool ipc_process_data(struct ipc_ctx *ctx, const char *buf, size_t len) __attribute__((nonnull(1, 2)));
+bool ipc_process_datagram(struct ipc_ctx *ctx, char *buf, size_t len)   __attribute__((nonnull(1, 2)));
+size_t ipc_datagram_size(const char *buf, size_t len, bool *v2)        __attribute__((nonnull(1, 3)));
+char *ipc_datagram_buffer(struct ipc_ctx *ctx)                         __attribute__((nonnull(1)));
 bool ipc_event_loop(struct ipc_ctx *ctx)              __attribute__((nonnull(1)));
 ssize_t ipc_send_string(int fd, const char *fmt, ...) __attribute__((__format__(printf, 2, 3)));
 
+bool ipc_queue_string(struct ipc_ctx *ctx, const char *fmt, ...) __attribute__((nonnull(1, 2), __format__(printf, 2, 3)));
+bool ipc_flush(struct ipc_ctx *ctx)                              __attribute__((nonnull(1)));
+bool ipc_has_output(struct ipc_ctx *ctx)                         __attribute__((nonnull(1)));
+bool ipc_outbuf_take(struct ipc_ctx *ctx, struct ipc_outbuf *b)  __attribute__((nonnull(1, 2)));
+
 bool ipc_send_message(struct ipc_ctx *ctx, char **pairs, int num_pairs, struct ipc_pair *result) __attribute__((nonnull(1, 2)));
 bool ipc_send_message2(struct ipc_ctx *ctx, struct ipc_pair *data, struct ipc_pair *resp);
 
+struct ipc_request *ipc_request_submit(struct ipc_ctx *ctx, struct ipc_pair *data)  __attribute__((nonnull(1, 2)));
+bool ipc_request_wait(struct ipc_ctx *ctx, struct ipc_request *req)                 __attribute__((nonnull(1, 2)));
+bool ipc_request_poll(struct ipc_ctx *ctx)                                          __attribute__((nonnull(1)));
+void ipc_request_free(struct ipc_ctx *ctx, struct ipc_request *req)                 __attribute__((nonnull(1, 2)));
+
 struct ipc_token {
 	char *cmd, *id, *status, *arg;
 	char *data;
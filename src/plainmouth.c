@@ -286,6 +286,13 @@ int main(int argc, char **argv)
 	if (!ipc_connect(&ctx, socket_file, 0))
 		err(EXIT_FAILURE, "unable to connect to socket: %s", socket_file);
 
+	/*
+	 * Every invocation sends a single request. It goes out without the
+	 * HELLO round trip, which is also why binary framing is not offered:
+	 * negotiating it would cost that round trip again.
+	 */
+	ctx.flags |= IPC_CTX_CLIENT_IDS;
+
 	switch (action) {
 		case SRV_QUIT:
 			ret = command_quit(&ctx);
@@ -1,9 +1,12 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 #include "config.h"
 
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/queue.h>
+#include <sys/socket.h>
 
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -11,11 +14,13 @@
 #include <locale.h>
 #include <getopt.h>
 #include <poll.h>
+#include <time.h>
 #include <wchar.h>
 #include <errno.h>
 #include <error.h>
 #include <err.h>
 
+#include <stdatomic.h>
 #include <pthread.h>
 #include <curses.h>
 
@@ -25,6 +30,10 @@
 #include "request.h"
 #include "widget.h"
 
+#ifdef HAVE_LINUX_IO_URING_H
+#include "uring.h"
+#endif
+
 /*
  * UI task types — what operations need to be performed in the main thread
  */
@@ -43,50 +52,192 @@ enum ui_task_type {
 	UI_TASK_LIST_PLUGINS,
 };
 
+/*
+ * Tasks are processed by priority: what the user waits for right now goes
+ * first, creating dialogs and other heavy work goes last.
+ */
+enum ui_lane_type {
+	UI_LANE_INTERACTIVE = 0,
+	UI_LANE_PROGRESS,
+	UI_LANE_BULK,
+	UI_LANES,
+};
+
 struct ui_task {
-	TAILQ_ENTRY(ui_task) entries;
+	struct ui_task *next;
 
 	enum ui_task_type type;
-	uint64_t id;
+	enum ui_lane_type lane;
 	struct request req;
 	int rc;
 };
-TAILQ_HEAD(uitasks, ui_task);
 
-struct worker {
-	LIST_ENTRY(worker) entries;
-	pthread_t thread_id;
+/*
+ * Intrusive lock-free queue of tasks with any number of producers and one
+ * consumer. Producers push onto a stack, the consumer takes the whole stack
+ * at once and restores the submission order.
+ */
+struct task_queue {
+	_Atomic(struct ui_task *) head;
+};
+
+/*
+ * The UI thread processes the tasks of a lane until its time budget runs
+ * out, then goes on to the next lane and back to the input. The tasks taken
+ * from the queue but not processed yet wait in the backlog.
+ */
+struct ui_lane {
+	struct task_queue queue;
+	struct ui_task *backlog;
+	struct ui_task **backlog_tail;
+	long budget_ns;
+};
+
+/*
+ * Client connection served by the IO thread. A connection that is closed while
+ * some of its messages are still in the UI queue or waiting for a result is
+ * kept until all of them are completed.
+ */
+struct connection {
+	LIST_ENTRY(connection) entries;
+	struct ipc_ctx *ctx;
+	unsigned int pending;
+	bool closed;
+
+	/*
+	 * Tasks of one connection are processed in order, so while some of
+	 * them are queued the next ones go to the same lane.
+	 */
+	unsigned int queued;
+	enum ui_lane_type lane;
+
+	/* epoll backend */
+	uint32_t events;
+
+	/* io_uring backend */
+	unsigned int ops;          /* requests in flight */
+	bool sending;
+	size_t sent;
+	struct ipc_outbuf sendbuf; /* output handed over to the kernel */
+};
+LIST_HEAD(connections, connection);
+
+/*
+ * The way the IO thread waits for and performs socket IO.
+ */
+struct io_backend {
+	const char *name;
+	bool (*init)(void);
+	void (*finish)(void);
+	bool (*run)(void);
+	void (*update)(struct connection *conn);
+	void (*close)(struct connection *conn);
+};
+
+/*
+ * The wait-result request parked until its instance is finished or deleted.
+ */
+struct waiter {
+	LIST_ENTRY(waiter) entries;
+	struct request req;
+};
+LIST_HEAD(waiters, waiter);
+
+#define WAITERS_HASH 64
+
+/*
+ * The id of an instance that finished or was deleted. The UI thread pushes
+ * it onto a lock-free stack, the IO thread wakes only the waiters of that id.
+ */
+struct instance_event {
+	struct instance_event *next;
+	char id[];
+};
+
+/*
+ * An object the IO thread may still look at. It is freed once the IO thread
+ * has left the read section it could have found the object in.
+ */
+struct retired {
+	struct retired *next;
+	unsigned long epoch;
+	void (*free)(struct retired *); /* NULL if free() is enough */
+};
+
+/*
+ * The output of p_result taken when the instance finished: what follows
+ * "RESPDATA <id> " in each line, separated by NULs. wait-result is answered
+ * from it in the IO thread without a task for the UI thread.
+ */
+struct result_snapshot {
+	size_t len;
+	char data[];
 };
-LIST_HEAD(workers, worker);
 
 struct instance {
+	struct retired retired; /* must be first, freed with the instance */
 	TAILQ_ENTRY(instance) entries;
-	const char *id;
 	struct plugin *plugin;
 	struct widget *root;
+	struct widget_arena arena; /* owns the widgets of the root */
+	struct widgethead focusable; /* focus ring in Tab order */
 	PANEL *panel;
-	bool finished;
+	struct result_snapshot *result; /* set before finished, read-only then */
+	_Atomic bool finished;
+	bool dirty; /* to be rendered in the next frame */
+	uint32_t hash;
+	char id[];
 };
 TAILQ_HEAD(instances, instance);
 
-static struct workers workers;
+/*
+ * Instances by id, open addressing with linear probing. Only the UI thread
+ * adds and removes instances. The IO thread looks them up without a lock
+ * between registry_read_lock() and registry_read_unlock().
+ */
+struct instance_table {
+	struct retired retired; /* must be first */
+	size_t mask;
+	size_t used;  /* slots that are not empty, deleted ones included */
+	size_t count; /* instances */
+	_Atomic(struct instance *) slots[];
+};
+
+#define REGISTRY_MIN_SLOTS 16
+
 static struct instances instances;
-static struct uitasks uitasks;
-static struct widgethead focusable;
+static struct ui_lane ui_lanes[UI_LANES] = {
+	[UI_LANE_INTERACTIVE] = { .budget_ns = 10000000 },
+	[UI_LANE_PROGRESS]    = { .budget_ns =  5000000 },
+	[UI_LANE_BULK]        = { .budget_ns =  5000000 },
+};
+static struct task_queue donetasks; /* UI thread -> IO thread */
 
 static struct widget *focused = NULL;
 
-static pthread_mutex_t ui_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  ui_cond  = PTHREAD_COND_INITIALIZER;
+/* Only the IO thread works with these lists. */
+static struct connections connections;
+static struct connections closed_connections;
+static struct waiters waiters[WAITERS_HASH]; /* by instance id */
+
+static _Atomic(struct instance_table *) registry = NULL;
+static _Atomic unsigned long registry_epoch = 1;
+static _Atomic unsigned long registry_reader = 0; /* epoch the IO thread reads in, 0 if it does not */
+static struct retired *registry_garbage = NULL;   /* only the UI thread */
+static struct instance registry_deleted;          /* marks a deleted slot */
 
-static pthread_mutex_t instances_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t  instance_cond   = PTHREAD_COND_INITIALIZER;
+/* Collects the output of p_result for a snapshot, only the UI thread. */
+static struct ipc_ctx result_ctx;
 
-static _Atomic uint64_t done_task_id = 0;
-static _Atomic uint64_t next_task_id = 1;
+#define RESULT_SNAPSHOT_ID "snapshot"
+
+static _Atomic(struct instance_event *) instance_events = NULL;
+static _Atomic int instances_changed = 0; /* recheck all waiters */
 
 static SCREEN *scr = NULL;
 static int ui_eventfd = -1;
+static int io_eventfd = -1;
+static int io_epollfd = -1;
 
 static _Atomic int do_quit = 0;
 
@@ -94,15 +245,38 @@ static bool use_terminal = true;
 static char *debug_file = NULL;
 
 static pthread_t ui_thread;
+static pthread_t io_thread;
+
+static size_t output_limit = 1024 * 1024;
+
+/*
+ * Tasks and input only mark what has changed; the screen is redrawn at most
+ * max_fps times per second (0 is unlimited).
+ */
+static unsigned int max_fps = 60;
+static bool frame_pending = false;
+static long last_frame_ns = 0;
+
+/* The stream socket and, unless disabled, the SOCK_SEQPACKET one. */
+static struct ipc_ctx listeners[2];
+static size_t num_listeners = 0;
+
+static const char *io_backend_name = "epoll";
+static const struct io_backend io_epoll;
+static const struct io_backend *io = &io_epoll;
 
 static const char cmdopts_s[] = "S:Vh";
 static const struct option cmdopts[] = {
-	{ "debug-file",  required_argument, NULL, 1   },
-	{ "tty",         required_argument, NULL, 2   },
-	{ "socket-file", required_argument, NULL, 'S' },
-	{ "version",     no_argument,       NULL, 'V' },
-	{ "help",        no_argument,       NULL, 'h' },
-	{ NULL,          no_argument,       NULL, 0   },
+	{ "debug-file",      required_argument, NULL, 1   },
+	{ "tty",             required_argument, NULL, 2   },
+	{ "output-limit",    required_argument, NULL, 3   },
+	{ "io-backend",      required_argument, NULL, 4   },
+	{ "seqpacket-file",  required_argument, NULL, 5   },
+	{ "max-fps",         required_argument, NULL, 6   },
+	{ "socket-file",     required_argument, NULL, 'S' },
+	{ "version",         no_argument,       NULL, 'V' },
+	{ "help",            no_argument,       NULL, 'h' },
+	{ NULL,              no_argument,       NULL, 0   },
 };
 
 static void __attribute__((noreturn))
@@ -116,7 +290,15 @@ print_help(const char *progname, int retcode)
 	       "Options:\n"
 	       "   --tty=DEVICE         TTY to use instead of default.\n"
 	       "   --debug-file=FILE    File to write debugging information to.\n"
+	       "   --output-limit=BYTES Disconnect a client that leaves more than\n"
+	       "                        BYTES of responses unread (0 is unlimited).\n"
+	       "   --io-backend=NAME    Serve clients with epoll (default) or io_uring.\n"
 	       "   --socket-file=FILE   Server socket file.\n"
+	       "   --seqpacket-file=FILE\n"
+	       "                        SOCK_SEQPACKET socket file, FILE.seq next to\n"
+	       "                        the server socket by default, empty to disable.\n"
+	       "   --max-fps=NUM        Redraw the screen at most NUM times per second\n"
+	       "                        (default 60, 0 is unlimited).\n"
 	       "   -V, --version        Show version of program and exit.\n"
 	       "   -h, --help           Show this text and exit.\n"
 	       "\n",
@@ -138,17 +320,162 @@ print_version(const char *progname)
 	exit(EXIT_SUCCESS);
 }
 
+static uint32_t instance_hash(const char *id)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261U;
+
+	for (const unsigned char *p = (const unsigned char *) id; *p; p++)
+		h = (h ^ *p) * 16777619U;
+
+	return h;
+}
+
+/*
+ * The IO thread must hold the read lock while it looks up an instance and
+ * uses the result. The UI thread changes the registry itself and needs none.
+ */
+static inline void registry_read_lock(void)
+{
+	atomic_store(&registry_reader, atomic_load(&registry_epoch));
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+static inline void registry_read_unlock(void)
+{
+	atomic_store_explicit(&registry_reader, 0, memory_order_release);
+}
+
+static void registry_retire(struct retired *r)
+{
+	r->epoch = atomic_fetch_add(&registry_epoch, 1);
+	r->next = registry_garbage;
+	registry_garbage = r;
+}
+
+/*
+ * Free the retired objects the IO thread can no longer see: it is outside of
+ * a read section or entered it after they were removed.
+ */
+static void registry_reclaim(void)
+{
+	if (!registry_garbage)
+		return;
+
+	atomic_thread_fence(memory_order_seq_cst);
+
+	unsigned long reader = atomic_load(&registry_reader);
+	struct retired **p = &registry_garbage;
+
+	while (*p) {
+		struct retired *r = *p;
+
+		if (!reader || reader > r->epoch) {
+			*p = r->next;
+			if (r->free)
+				r->free(r);
+			else
+				free(r);
+		} else {
+			p = &r->next;
+		}
+	}
+}
+
 static struct instance *find_instance(const char *id)
 {
 	if (!id)
 		return NULL;
 
-	struct instance *instance;
-	TAILQ_FOREACH(instance, &instances, entries) {
-		if (streq(instance->id, id))
-			return instance;
+	struct instance_table *t = atomic_load_explicit(&registry, memory_order_acquire);
+	if (!t)
+		return NULL;
+
+	uint32_t hash = instance_hash(id);
+
+	for (size_t i = hash & t->mask;; i = (i + 1) & t->mask) {
+		struct instance *ins = atomic_load_explicit(&t->slots[i], memory_order_acquire);
+
+		if (!ins)
+			return NULL;
+		if (ins != &registry_deleted && ins->hash == hash && streq(ins->id, id))
+			return ins;
 	}
-	return NULL;
+}
+
+static void registry_put(struct instance_table *t, struct instance *ins)
+{
+	size_t i;
+
+	for (i = ins->hash & t->mask;; i = (i + 1) & t->mask) {
+		struct instance *cur = atomic_load_explicit(&t->slots[i], memory_order_relaxed);
+
+		if (!cur) {
+			t->used++;
+			break;
+		}
+		if (cur == &registry_deleted)
+			break;
+	}
+
+	t->count++;
+	atomic_store_explicit(&t->slots[i], ins, memory_order_release);
+}
+
+/*
+ * Make room for one more instance, so that registry_add() cannot fail. A full
+ * table is copied into a bigger one and retired.
+ */
+static bool registry_reserve(void)
+{
+	struct instance_table *t = atomic_load_explicit(&registry, memory_order_relaxed);
+
+	if (t && (t->used + 1) * 4 <= (t->mask + 1) * 3)
+		return true;
+
+	size_t nslots = REGISTRY_MIN_SLOTS;
+
+	while (nslots < ((t ? t->count : 0) + 1) * 2)
+		nslots *= 2;
+
+	struct instance_table *nt = calloc(1, sizeof(*nt) + nslots * sizeof(nt->slots[0]));
+	if (!nt)
+		return false;
+
+	nt->mask = nslots - 1;
+
+	if (t) {
+		for (size_t i = 0; i <= t->mask; i++) {
+			struct instance *ins = atomic_load_explicit(&t->slots[i], memory_order_relaxed);
+
+			if (ins && ins != &registry_deleted)
+				registry_put(nt, ins);
+		}
+	}
+
+	atomic_store_explicit(&registry, nt, memory_order_release);
+
+	if (t)
+		registry_retire(&t->retired);
+
+	return true;
+}
+
+static void registry_add(struct instance *ins)
+{
+	registry_put(atomic_load_explicit(&registry, memory_order_relaxed), ins);
+}
+
+static void registry_remove(struct instance *ins)
+{
+	struct instance_table *t = atomic_load_explicit(&registry, memory_order_relaxed);
+	size_t i = ins->hash & t->mask;
+
+	while (atomic_load_explicit(&t->slots[i], memory_order_relaxed) != ins)
+		i = (i + 1) & t->mask;
+
+	atomic_store_explicit(&t->slots[i], &registry_deleted, memory_order_release);
+	t->count--;
 }
 
 static void use_instance_widgets(struct instance *ins, struct widget *w)
@@ -162,27 +489,28 @@ static void use_instance_widgets(struct instance *ins, struct widget *w)
 	w->instance_id = ins->id;
 
 	if (w->attrs & ATTR_CAN_FOCUS) {
-		TAILQ_INSERT_HEAD(&focusable, w, focuses);
+		TAILQ_INSERT_HEAD(&ins->focusable, w, focuses);
 	}
 }
 
+static void instance_free(struct retired *r)
+{
+	struct instance *instance = (struct instance *) r;
+
+	free(instance->result);
+	free(instance);
+}
+
 static void release_instance(struct instance *instance)
 {
 	if (IS_DEBUG())
 		warnx("release instance '%s'", instance->id);
 
 	TAILQ_REMOVE(&instances, instance, entries);
+	registry_remove(instance);
 
-	struct widget *w1 = TAILQ_FIRST(&focusable);
-	while (w1) {
-		struct widget *w2 = TAILQ_NEXT(w1, focuses);
-		if (streq(w1->instance_id, instance->id)) {
-			if (w1 == focused)
-				focused = NULL;
-			TAILQ_REMOVE(&focusable, w1, focuses);
-		}
-		w1 = w2;
-	}
+	if (focused && focused->instance_id == instance->id)
+		focused = NULL;
 
 	if (instance->panel) {
 		if (IS_DEBUG())
@@ -202,14 +530,19 @@ static void release_instance(struct instance *instance)
 		instance->root = NULL;
 	}
 
-	free((char *) instance->id);
-	free(instance);
+	widget_arena_release(&instance->arena);
+
+	instance->retired.free = instance_free;
+	registry_retire(&instance->retired);
 }
 
 static void free_instances(void)
 {
 	while (!TAILQ_EMPTY(&instances))
 		release_instance(TAILQ_FIRST(&instances));
+
+	free(atomic_exchange(&registry, NULL));
+	registry_reclaim();
 }
 
 static void widget_ensure_visible(struct widget *w)
@@ -233,6 +566,49 @@ static inline void ui_wakeup(void)
 		warn("write(eventfd)");
 }
 
+static inline void io_wakeup(void)
+{
+	uint64_t one = 1;
+	if (write(io_eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		warn("write(eventfd)");
+}
+
+/*
+ * Returns true if the queue was empty, only then the consumer needs a wakeup:
+ * it always takes everything that is queued.
+ */
+static bool task_queue_push(struct task_queue *q, struct ui_task *t)
+{
+	struct ui_task *head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+	do {
+		t->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&q->head, &head, t,
+				memory_order_release, memory_order_relaxed));
+
+	return head == NULL;
+}
+
+static struct ui_task *task_queue_take(struct task_queue *q)
+{
+	struct ui_task *t = atomic_exchange_explicit(&q->head, NULL, memory_order_acquire);
+	struct ui_task *list = NULL;
+
+	while (t) {
+		struct ui_task *next = t->next;
+
+		t->next = list;
+		list = t;
+		t = next;
+	}
+	return list;
+}
+
+static inline struct connection *req_conn(struct request *req)
+{
+	return req_ctx(req)->data;
+}
+
 static struct ui_task *ui_task_create(enum ui_task_type type, struct request *req)
 {
 	if (pthread_equal(pthread_self(), ui_thread))
@@ -247,48 +623,137 @@ static struct ui_task *ui_task_create(enum ui_task_type type, struct request *re
 	t->type = type;
 	t->req = *req;
 	t->rc = 0;
-	t->id = next_task_id++;
 
 	return t;
 }
 
+static enum ui_lane_type ui_task_lane(enum ui_task_type type)
+{
+	switch (type) {
+		case UI_TASK_UPDATE:
+			return UI_LANE_PROGRESS;
+		case UI_TASK_CREATE:
+		case UI_TASK_DUMP:
+		case UI_TASK_LIST_PLUGINS:
+			return UI_LANE_BULK;
+		default:
+			break;
+	}
+	return UI_LANE_INTERACTIVE;
+}
+
 /*
- * Queue the task and wait for it to be completed.
- * Returns the field t->rc (0 = ok, < 0 = error).
+ * Queue the task for the UI thread. The message is completed by the IO thread
+ * once the task is done.
  */
-static int ui_enqueue_and_wait(struct ui_task *t)
+static int ui_enqueue(struct ui_task *t)
 {
 	if (pthread_equal(pthread_self(), ui_thread))
-		errx(EXIT_FAILURE, "ui_enqueue_and_wait called from UI thread");
+		errx(EXIT_FAILURE, "ui_enqueue called from UI thread");
+
+	struct connection *conn = req_conn(&t->req);
+
+	if (!conn->queued)
+		conn->lane = ui_task_lane(t->type);
+
+	t->lane = conn->lane;
+
+	conn->pending++;
+	conn->queued++;
+
+	if (task_queue_push(&ui_lanes[t->lane].queue, t))
+		ui_wakeup();
+
+	return IPC_MSG_PENDING;
+}
 
-	pthread_mutex_lock(&ui_mutex);
-	TAILQ_INSERT_TAIL(&uitasks, t, entries);
-	ui_wakeup();
-	pthread_mutex_unlock(&ui_mutex);
+/*
+ * Let the IO thread recheck the wait-result requests parked for the instance.
+ * Without memory for the event all of them are rechecked.
+ */
+static void ui_instance_changed(const char *id)
+{
+	size_t len = strlen(id);
+	struct instance_event *ev = malloc(sizeof(*ev) + len + 1);
 
-	pthread_mutex_lock(&ui_mutex);
-	while (done_task_id < t->id) {
-		pthread_cond_wait(&ui_cond, &ui_mutex);
+	if (!ev) {
+		instances_changed = 1;
+		io_wakeup();
+		return;
 	}
-	pthread_mutex_unlock(&ui_mutex);
 
-	int rc = t->rc;
-	free(t);
+	memcpy(ev->id, id, len + 1);
+
+	struct instance_event *head = atomic_load_explicit(&instance_events, memory_order_relaxed);
 
-	return rc;
+	do {
+		ev->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&instance_events, &head, ev,
+				memory_order_release, memory_order_relaxed));
+
+	if (!head)
+		io_wakeup();
 }
 
-static inline void ui_check_instance_finished(struct instance *w)
+/*
+ * Let the plugin print its result into result_ctx and keep the lines. Returns
+ * NULL if the output does not look like RESPDATA lines, then wait-result
+ * asks the UI thread as usual.
+ */
+static struct result_snapshot *ui_take_result(struct instance *ins)
 {
-	if (w && !w->finished && w->plugin->p_finished) {
-		w->finished = w->plugin->p_finished(w->root);
+	static const char prefix[] = "RESPDATA " RESULT_SNAPSHOT_ID " ";
+	const size_t prefix_len = sizeof(prefix) - 1;
+
+	struct ipc_message msg = { .id = (char *) RESULT_SNAPSHOT_ID };
+	struct request req = { .r_ctx = &result_ctx, .r_msg = &msg };
+	struct ipc_outbuf out = { 0 };
+
+	if (ins->plugin->p_result)
+		ins->plugin->p_result(&req, ins->root);
+
+	ipc_outbuf_take(&result_ctx, &out);
+
+	struct result_snapshot *snap = malloc(sizeof(*snap) + out.len);
 
-		if (w->finished) {
-			pthread_mutex_lock(&instances_mutex);
-			pthread_cond_broadcast(&instance_cond);
-			pthread_mutex_unlock(&instances_mutex);
+	if (snap) {
+		snap->len = 0;
+
+		for (char *p = out.data; p && p < out.data + out.len; p += strlen(p) + 1) {
+			if (strncmp(p, prefix, prefix_len) != 0) {
+				free(snap);
+				snap = NULL;
+				break;
+			}
+
+			size_t n = strlen(p + prefix_len) + 1;
+
+			memcpy(snap->data + snap->len, p + prefix_len, n);
+			snap->len += n;
 		}
 	}
+
+	ipc_outbuf_free(&out);
+
+	return snap;
+}
+
+/*
+ * Ask the plugin only if a widget of the instance reported a change of its
+ * result state since the last check.
+ */
+static inline void ui_check_instance_finished(struct instance *w)
+{
+	if (!w || !w->root || !(w->root->flags & FLAG_STATE_CHANGED))
+		return;
+
+	w->root->flags &= ~FLAG_STATE_CHANGED;
+
+	if (!w->finished && w->plugin->p_finished && w->plugin->p_finished(w->root)) {
+		w->result = ui_take_result(w);
+		w->finished = true;
+		ui_instance_changed(w->id);
+	}
 }
 
 static void ui_update_cursor(void)
@@ -318,14 +783,82 @@ static void ui_update_cursor(void)
 	widget_noutrefresh(focused_ins->root);
 }
 
-static void ui_update(void)
+static inline long ui_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static inline void ui_schedule_frame(void)
+{
+	frame_pending = true;
+}
+
+static inline void ui_instance_dirty(struct instance *ins)
+{
+	if (ins) {
+		ins->dirty = true;
+		frame_pending = true;
+	}
+}
+
+/*
+ * Mark the widget to be drawn again in the next frame.
+ */
+static void ui_widget_dirty(struct widget *w)
+{
+	widget_mark_dirty(w);
+	ui_instance_dirty(find_instance(w->instance_id));
+}
+
+static void ui_render_instance(struct instance *ins)
+{
+	if (ins->dirty) {
+		widget_relayout_tree(ins->root);
+		widget_render_dirty(ins->root);
+		ins->dirty = false;
+	}
+}
+
+/*
+ * The poll() timeout until the next frame may be drawn, -1 if there is
+ * nothing to draw.
+ */
+static int ui_frame_timeout(void)
+{
+	if (!frame_pending)
+		return -1;
+
+	if (!max_fps)
+		return 0;
+
+	long next = last_frame_ns + 1000000000L / max_fps;
+	long now = ui_clock_ns();
+
+	if (now >= next)
+		return 0;
+
+	return (int) ((next - now + 999999) / 1000000);
+}
+
+/*
+ * Draw everything that changed since the previous frame with one doupdate().
+ */
+static void ui_render_frame(void)
 {
+	struct instance *ins;
+
+	frame_pending = false;
+	last_frame_ns = ui_clock_ns();
+
+	TAILQ_FOREACH(ins, &instances, entries)
+		ui_render_instance(ins);
+
 	if (!use_terminal)
 		return;
 
-	if (focused)
-		widget_render_tree(focused);
-
 	update_panels();
 	ui_update_cursor();
 	doupdate();
@@ -343,35 +876,79 @@ static void ui_focused(bool state)
 		focused->flags |= FLAG_INFOCUS;
 
 		widget_ensure_visible(focused);
+		ui_widget_dirty(focused);
 
 		/*
 		 * This is necessary to ensure that the panel with the widget
 		 * in focus is on top of everything else.
 		 */
 		struct instance *ins = find_instance(focused->instance_id);
-		widget_render_tree(ins->root);
 		top_panel(ins->panel);
 	} else {
 		if (IS_DEBUG())
 			warnx("%s (%p) lost focus", widget_type(focused), focused->win);
 
 		focused->flags &= ~FLAG_INFOCUS;
-		widget_render_tree(focused);
+		ui_widget_dirty(focused);
 	}
 }
 
+/*
+ * The first widget in the focus ring of the next instance after @ins, from
+ * the newest to the oldest one. Without @ins the newest instance is the next.
+ */
+static struct widget *ui_first_focusable(struct instance *ins)
+{
+	if (!ins)
+		ins = TAILQ_FIRST(&instances);
+
+	struct instance *cur = ins;
+
+	while (cur) {
+		cur = TAILQ_PREV(cur, instances, entries);
+		if (!cur)
+			cur = TAILQ_LAST(&instances, instances);
+
+		if (!TAILQ_EMPTY(&cur->focusable))
+			return TAILQ_FIRST(&cur->focusable);
+		if (cur == ins)
+			break;
+	}
+	return NULL;
+}
+
 static void ui_next_focused(void)
 {
+	struct instance *ins = NULL;
+
 	if (focused) {
+		ins = find_instance(focused->instance_id);
 		ui_focused(false);
 		focused = TAILQ_NEXT(focused, focuses);
 	}
 	if (!focused)
-		focused = TAILQ_FIRST(&focusable);
-	if (focused) {
+		focused = ui_first_focusable(ins);
+	if (focused)
 		ui_focused(true);
-		ui_update();
-	}
+}
+
+/*
+ * Decode the request by the plugin schema. The IO thread does it before the
+ * task is queued, so the UI thread only repeats it if the instance turned out
+ * to belong to another plugin by then.
+ */
+static bool decode_request(struct request *req, const struct req_schema *schema)
+{
+	char err[128];
+
+	if (!schema || req->r_schema == schema)
+		return true;
+
+	if (!req_decode(req, schema, err, sizeof(err))) {
+		ipc_queue_string(req_ctx(req), "RESPDATA %s ERR=%s", req_id(req), err);
+		return false;
+	}
+	return true;
 }
 
 static struct instance *ui_get_instance_by_id(struct ui_task *t)
@@ -380,7 +957,7 @@ static struct instance *ui_get_instance_by_id(struct ui_task *t)
 	struct instance *instance = find_instance(instance_id);
 
 	if (!instance) {
-		ipc_send_string(req_fd(&t->req), "RESPDATA %s ERR=no instance found by id: %s",
+		ipc_queue_string(req_ctx(&t->req), "RESPDATA %s ERR=no instance found by id: %s",
 				req_id(&t->req), instance_id);
 		return NULL;
 	}
@@ -397,48 +974,63 @@ static int ui_process_task_create(struct ui_task *t)
 	struct instance *instance = find_instance(instance_id);
 
 	if (instance) {
-		ipc_send_string(req_fd(&t->req), "RESPDATA %s ERR=instance with '%s' already exists",
+		ipc_queue_string(req_ctx(&t->req), "RESPDATA %s ERR=instance with '%s' already exists",
 				req_id(&t->req), instance_id);
 		return -1;
 	}
 
 	const char *plugin_name = req_get_val(&t->req, "plugin");
 	if (!plugin_name) {
-		ipc_send_string(req_fd(&t->req), "RESPDATA %s ERR=field is missing: plugin",
+		ipc_queue_string(req_ctx(&t->req), "RESPDATA %s ERR=field is missing: plugin",
 				req_id(&t->req));
 		return -1;
 	}
 
 	struct plugin *plugin = find_plugin(plugin_name);
 	if (!plugin) {
-		ipc_send_string(req_fd(&t->req), "RESPDATA %s ERR=plugin not found",
+		ipc_queue_string(req_ctx(&t->req), "RESPDATA %s ERR=plugin not found",
 				req_id(&t->req));
 		return -1;
 	}
 
-	struct instance *wnew = calloc(1, sizeof(*wnew));
+	if (!decode_request(&t->req, plugin->p_create_schema))
+		return -1;
+
+	size_t id_len = strlen(instance_id);
+	struct instance *wnew = NULL;
+
+	if (registry_reserve())
+		wnew = calloc(1, sizeof(*wnew) + id_len + 1);
 	if (!wnew) {
-		ipc_send_string(req_fd(&t->req), "RESPDATA %s ERR=no memory",
+		ipc_queue_string(req_ctx(&t->req), "RESPDATA %s ERR=no memory",
 				req_id(&t->req));
 		return -1;
 	}
 
-	wnew->id = strdup(instance_id);
+	memcpy(wnew->id, instance_id, id_len + 1);
+	wnew->hash = instance_hash(wnew->id);
 	wnew->plugin = plugin;
+	TAILQ_INIT(&wnew->focusable);
 
 	if (plugin->p_create_instance) {
+		widget_arena_use(&wnew->arena);
 		wnew->root = plugin->p_create_instance(&t->req);
+		widget_arena_use(NULL);
+
 		if (!wnew->root) {
-			ipc_send_string(req_fd(&t->req),
+			ipc_queue_string(req_ctx(&t->req),
 					"RESPDATA %s ERR=unable to create instance",
 					req_id(&t->req));
+			widget_arena_release(&wnew->arena);
 			free(wnew);
 			return -1;
 		}
 
-		wnew->panel = new_panel(wnew->root->win);
+		/* The windows are drawn in the next frame, the panel needs one now. */
+		if (widget_realize(wnew->root))
+			wnew->panel = new_panel(wnew->root->win);
 		if (!wnew->panel) {
-			ipc_send_string(req_fd(&t->req),
+			ipc_queue_string(req_ctx(&t->req),
 					"RESPDATA %s ERR=unable to create panel",
 					req_id(&t->req));
 			if (wnew->plugin && wnew->plugin->p_delete_instance &&
@@ -446,6 +1038,7 @@ static int ui_process_task_create(struct ui_task *t)
 				warnx("plugin delete callback failed for instance '%s'", wnew->id);
 			}
 			widget_free(wnew->root);
+			widget_arena_release(&wnew->arena);
 			free(wnew);
 			return -1;
 		}
@@ -454,18 +1047,15 @@ static int ui_process_task_create(struct ui_task *t)
 	// A plugin without a callback is always finished.
 	wnew->finished = (plugin->p_finished == NULL);
 
-	pthread_mutex_lock(&instances_mutex);
-
 	use_instance_widgets(wnew, wnew->root);
 	TAILQ_INSERT_TAIL(&instances, wnew, entries);
-
-	pthread_mutex_unlock(&instances_mutex);
+	registry_add(wnew);
 
 	if (!focused)
-		focused = TAILQ_FIRST(&focusable);
+		focused = ui_first_focusable(NULL);
 
+	ui_instance_dirty(wnew);
 	ui_focused(true);
-	ui_update();
 
 	return 0;
 }
@@ -479,14 +1069,15 @@ static int ui_process_task_update(struct ui_task *t)
 	if (!instance)
 		return -1;
 
+	if (!decode_request(&t->req, instance->plugin->p_update_schema))
+		return -1;
+
 	if (instance->plugin->p_update_instance &&
 			instance->plugin->p_update_instance(&t->req, instance->root) != P_RET_OK) {
 		return -1;
 	}
-	widget_render_tree(instance->root);
-
+	ui_instance_dirty(instance);
 	ui_check_instance_finished(instance);
-	ui_update();
 
 	return 0;
 }
@@ -500,11 +1091,14 @@ static int ui_process_task_delete(struct ui_task *t)
 	if (!instance)
 		return -1;
 
-	pthread_mutex_lock(&instances_mutex);
 	release_instance(instance);
-	pthread_mutex_unlock(&instances_mutex);
 
-	ui_update();
+	/*
+	 * Only now the IO thread no longer finds the instance. It is retired, the
+	 * memory stays until the next registry_reclaim().
+	 */
+	ui_instance_changed(instance->id);
+	ui_schedule_frame();
 
 	return 0;
 }
@@ -518,15 +1112,12 @@ static int ui_process_task_focus(struct ui_task *t)
 	if (!instance)
 		return -1;
 
-	struct widget *w;
+	struct widget *w = TAILQ_FIRST(&instance->focusable);
 
-	TAILQ_FOREACH(w, &focusable, focuses) {
-		if (streq(w->instance_id, instance->id)) {
-			focused = w;
-			top_panel(instance->panel);
-			ui_update();
-			break;
-		}
+	if (w) {
+		ui_focused(false);
+		focused = w;
+		ui_focused(true);
 	}
 
 	return 0;
@@ -568,13 +1159,14 @@ static int ui_process_task_hide_splash(struct ui_task *t _UNUSED)
 
 static int ui_process_task_set_title(struct ui_task *t)
 {
-	wchar_t *message __free(ptr) = req_get_wchars(&t->req, "message");
+	const wchar_t *message = req_get_wchars(&t->req, "message");
 
 	if (message) {
 		wmove(stdscr, 0, 0);
 		werase(stdscr);
 		w_mvprintw(stdscr, 0, 0, L"%ls", message);
 		mvwhline(stdscr, getcury(stdscr) + 1, 0, ACS_HLINE, COLS);
+		ui_schedule_frame();
 	}
 
 	return 0;
@@ -595,7 +1187,7 @@ static bool convert_color(struct request *req, const char *color, int *cnum)
 	int num;
 
 	if (!color) {
-		ipc_send_string(req_fd(req), "RESPDATA %s ERR=missing color name",
+		ipc_queue_string(req_ctx(req), "RESPDATA %s ERR=missing color name",
 				req_id(req));
 		return false;
 	}
@@ -614,13 +1206,13 @@ static bool convert_color(struct request *req, const char *color, int *cnum)
 		goto has_number;
 	}
 
-	ipc_send_string(req_fd(req), "RESPDATA %s ERR=unknown color name: %s",
+	ipc_queue_string(req_ctx(req), "RESPDATA %s ERR=unknown color name: %s",
 			req_id(req), color);
 	return false;
 
 has_number:
 	if (num >= COLORS) {
-		ipc_send_string(req_fd(req), "RESPDATA %s ERR=color out of range: %s",
+		ipc_queue_string(req_ctx(req), "RESPDATA %s ERR=color out of range: %s",
 				req_id(req), color);
 		return false;
 	}
@@ -643,7 +1235,7 @@ static int ui_process_task_set_style(struct ui_task *t)
 	else if (streq(name, "button")) pair = COLOR_PAIR_BUTTON;
 	else if (streq(name, "focus"))  pair = COLOR_PAIR_FOCUS;
 	else {
-		ipc_send_string(req_fd(&t->req), "RESPDATA %s ERR=unknown style: %s",
+		ipc_queue_string(req_ctx(&t->req), "RESPDATA %s ERR=unknown style: %s",
 				req_id(&t->req), name);
 		return -1;
 	}
@@ -653,7 +1245,7 @@ static int ui_process_task_set_style(struct ui_task *t)
 		return -1;
 
 	if (init_extended_pair(pair, fg, bg) == ERR) {
-		ipc_send_string(req_fd(&t->req), "RESPDATA %s ERR=unable to update color pair",
+		ipc_queue_string(req_ctx(&t->req), "RESPDATA %s ERR=unable to update color pair",
 				req_id(&t->req));
 		return -1;
 	}
@@ -674,6 +1266,9 @@ static int ui_process_task_dump(struct ui_task *t)
 	if (!outfile)
 		outfile = "/tmp/plainmouthd.dump";
 
+	/* The dump is read from the windows, they must be up to date. */
+	ui_render_instance(instance);
+
 	FILE *fd = fopen(outfile, "a");
 	widget_dump(fd, instance->root);
 	fclose(fd);
@@ -686,9 +1281,9 @@ static int ui_process_task_list_plugins(struct ui_task *t)
 	int i = 1;
 
 	for (struct plugin *p = list_plugin(NULL); p; p = list_plugin(p)) {
-		ipc_send_string(req_fd(&t->req), "RESPDATA %s PLUGIN_NAME_%d=%s",
+		ipc_queue_string(req_ctx(&t->req), "RESPDATA %s PLUGIN_NAME_%d=%s",
 				req_id(&t->req), i, p->name);
-		ipc_send_string(req_fd(&t->req), "RESPDATA %s PLUGIN_DESC_%d=%s",
+		ipc_queue_string(req_ctx(&t->req), "RESPDATA %s PLUGIN_DESC_%d=%s",
 				req_id(&t->req), i, p->desc);
 		i++;
 	}
@@ -698,59 +1293,188 @@ static int ui_process_task_list_plugins(struct ui_task *t)
 
 static int ui_process_task_unknown(struct ui_task *t)
 {
-	ipc_send_string(req_fd(&t->req), "RESPDATA %s ERR=unknown action",
+	ipc_queue_string(req_ctx(&t->req), "RESPDATA %s ERR=unknown action",
 			req_id(&t->req));
 	return -1;
 }
 
 
+static void ui_process_task(struct ui_task *t)
+{
+	int rc = -1;
+
+	switch (t->type) {
+		case UI_TASK_DUMP:		rc = ui_process_task_dump(t);		break;
+		case UI_TASK_CREATE:		rc = ui_process_task_create(t);		break;
+		case UI_TASK_UPDATE:		rc = ui_process_task_update(t);		break;
+		case UI_TASK_DELETE:		rc = ui_process_task_delete(t);		break;
+		case UI_TASK_FOCUS:		rc = ui_process_task_focus(t);		break;
+		case UI_TASK_RESULT:		rc = ui_process_task_result(t);		break;
+		case UI_TASK_SHOW_SPLASH:	rc = ui_process_task_show_splash(t);	break;
+		case UI_TASK_HIDE_SPLASH:	rc = ui_process_task_hide_splash(t);	break;
+		case UI_TASK_SET_TITLE:		rc = ui_process_task_set_title(t);	break;
+		case UI_TASK_SET_STYLE:		rc = ui_process_task_set_style(t);	break;
+		case UI_TASK_LIST_PLUGINS:	rc = ui_process_task_list_plugins(t);	break;
+		case UI_TASK_NONE:		rc = ui_process_task_unknown(t);	break;
+	}
+
+	t->rc = rc;
+
+	/* The IO thread is woken once for all tasks it has not taken yet. */
+	if (task_queue_push(&donetasks, t))
+		io_wakeup();
+}
+
+/*
+ * Returns true if some tasks are left for the next pass.
+ */
+static bool ui_process_lane(struct ui_lane *lane)
+{
+	struct ui_task *t = task_queue_take(&lane->queue);
+
+	if (t) {
+		if (!lane->backlog)
+			lane->backlog_tail = &lane->backlog;
+
+		*lane->backlog_tail = t;
+		while (t->next)
+			t = t->next;
+		lane->backlog_tail = &t->next;
+	}
+
+	if (!lane->backlog)
+		return false;
+
+	long deadline = ui_clock_ns() + lane->budget_ns;
+
+	while ((t = lane->backlog) != NULL) {
+		lane->backlog = t->next;
+
+		ui_process_task(t);
+
+		if (ui_clock_ns() >= deadline)
+			break;
+	}
+
+	return lane->backlog != NULL;
+}
+
 static void ui_process_tasks(void)
 {
-	struct ui_task *t;
+	bool more = false;
 
 	if (!pthread_equal(pthread_self(), ui_thread))
 		errx(EXIT_FAILURE, "ui_process_tasks called not from UI thread");
 
-	pthread_mutex_lock(&ui_mutex);
-	t = TAILQ_FIRST(&uitasks);
-	TAILQ_INIT(&uitasks);
-	pthread_mutex_unlock(&ui_mutex);
+	for (int i = 0; i < UI_LANES; i++) {
+		if (ui_process_lane(&ui_lanes[i]))
+			more = true;
+	}
+
+	/*
+	 * The producers do not wake us for tasks that are already queued, so
+	 * come back for the rest after the input is handled.
+	 */
+	if (more)
+		ui_wakeup();
 
-	while (t) {
-		int rc;
-		struct ui_task *next = TAILQ_NEXT(t, entries);
-
-		switch (t->type) {
-			case UI_TASK_DUMP:		rc = ui_process_task_dump(t);		break;
-			case UI_TASK_CREATE:		rc = ui_process_task_create(t);		break;
-			case UI_TASK_UPDATE:		rc = ui_process_task_update(t);		break;
-			case UI_TASK_DELETE:		rc = ui_process_task_delete(t);		break;
-			case UI_TASK_FOCUS:		rc = ui_process_task_focus(t);		break;
-			case UI_TASK_RESULT:		rc = ui_process_task_result(t);		break;
-			case UI_TASK_SHOW_SPLASH:	rc = ui_process_task_show_splash(t);	break;
-			case UI_TASK_HIDE_SPLASH:	rc = ui_process_task_hide_splash(t);	break;
-			case UI_TASK_SET_TITLE:		rc = ui_process_task_set_title(t);	break;
-			case UI_TASK_SET_STYLE:		rc = ui_process_task_set_style(t);	break;
-			case UI_TASK_LIST_PLUGINS:	rc = ui_process_task_list_plugins(t);	break;
-			case UI_TASK_NONE:		rc = ui_process_task_unknown(t);	break;
+	if (debug_file)
+		fflush(stderr);
+}
+
+static inline struct waiters *waiters_bucket(const char *id)
+{
+	return &waiters[instance_hash(id) & (WAITERS_HASH - 1)];
+}
+
+/*
+ * Answer wait-result if the instance is already finished or gone, otherwise
+ * park the request until the UI thread reports a change of instances.
+ */
+static int wait_result(struct request *req)
+{
+	const char *instance_id = req_get_val(req, "id");
+	bool found, finished, answered = false;
+
+	registry_read_lock();
+	struct instance *instance = find_instance(instance_id);
+	found = (instance != NULL);
+	finished = found && instance->finished;
+
+	if (finished && instance->result) {
+		const struct result_snapshot *snap = instance->result;
+
+		for (size_t i = 0; i < snap->len; i += strlen(snap->data + i) + 1)
+			ipc_queue_string(req_ctx(req), "RESPDATA %s %s", req_id(req), snap->data + i);
+		answered = true;
+	}
+	registry_read_unlock();
+
+	if (answered)
+		return 0;
+
+	if (!found) {
+		ipc_queue_string(req_ctx(req), "RESPDATA %s ERR=no instance", req_id(req));
+		return -1;
+	}
+
+	if (!finished) {
+		struct waiter *w = calloc(1, sizeof(*w));
+		if (!w) {
+			ipc_queue_string(req_ctx(req), "RESPDATA %s ERR=no memory", req_id(req));
+			return -1;
 		}
 
-		pthread_mutex_lock(&ui_mutex);
-		t->rc = rc;
-		done_task_id = t->id;
-		pthread_cond_broadcast(&ui_cond);
-		pthread_mutex_unlock(&ui_mutex);
+		w->req = *req;
+		req_conn(req)->pending++;
 
-		t = next;
+		LIST_INSERT_HEAD(waiters_bucket(instance_id), w, entries);
+		return IPC_MSG_PENDING;
 	}
 
-	if (debug_file)
-		fflush(stderr);
+	struct ui_task *t = ui_task_create(UI_TASK_RESULT, req);
+	if (!t) {
+		ipc_queue_string(req_ctx(req), "RESPDATA %s ERR=no memory", req_id(req));
+		return -1;
+	}
+
+	return ui_enqueue(t);
 }
 
-static int event_loop_iter(void *data __attribute__((unused)))
+/*
+ * Parse the parameters of create and update here, in the IO thread, so that
+ * bad requests are rejected before they get into the UI queue.
+ */
+static bool decode_plugin_args(struct request *req, enum ui_task_type ttype)
 {
-	return do_quit == 0;
+	const struct req_schema *schema = NULL;
+
+	if (ttype == UI_TASK_CREATE) {
+		const char *plugin_name = req_get_val(req, "plugin");
+		if (!plugin_name) {
+			ipc_queue_string(req_ctx(req), "RESPDATA %s ERR=field is missing: plugin",
+					req_id(req));
+			return false;
+		}
+
+		struct plugin *plugin = find_plugin(plugin_name);
+		if (!plugin) {
+			ipc_queue_string(req_ctx(req), "RESPDATA %s ERR=plugin not found",
+					req_id(req));
+			return false;
+		}
+
+		schema = plugin->p_create_schema;
+
+	} else if (ttype == UI_TASK_UPDATE) {
+		registry_read_lock();
+		struct instance *instance = find_instance(req_get_val(req, "id"));
+		if (instance)
+			schema = instance->plugin->p_update_schema;
+		registry_read_unlock();
+	}
+
+	return decode_request(req, schema);
 }
 
 static int handle_message(struct ipc_ctx *ctx, struct ipc_message *m, void *data __attribute__((unused)))
@@ -760,19 +1484,25 @@ static int handle_message(struct ipc_ctx *ctx, struct ipc_message *m, void *data
 		.r_msg = m,
 	};
 
+	if (!req_index_build(&req)) {
+		ipc_queue_string(req_ctx(&req), "RESPDATA %s ERR=no memory", req_id(&req));
+		return -1;
+	}
+
 	const char *action = req_get_val(&req, "action");
 	if (!action) {
-		ipc_send_string(req_fd(&req), "RESPDATA %s ERR=field is missing: action", req_id(&req));
+		ipc_queue_string(req_ctx(&req), "RESPDATA %s ERR=field is missing: action", req_id(&req));
 		return -1;
 	}
 
 	if (streq(action, "quit")) {
 		do_quit = 1;
 		ui_wakeup();
+		io_wakeup();
 		return 0;
 
 	} else if (streq(action, "ping")) {
-		ipc_send_string(req_fd(&req), "RESPDATA %s PONG=1", req_id(&req));
+		ipc_queue_string(req_ctx(&req), "RESPDATA %s PONG=1", req_id(&req));
 		return 0;
 
 	} else if (streq(action, "has-active-vt")) {
@@ -780,39 +1510,16 @@ static int handle_message(struct ipc_ctx *ctx, struct ipc_message *m, void *data
 		if (stdin)
 			res = isatty(fileno(stdin));
 
-		ipc_send_string(req_fd(&req), "RESPDATA %s ISTTY=%d", req_id(&req), res);
+		ipc_queue_string(req_ctx(&req), "RESPDATA %s ISTTY=%d", req_id(&req), res);
 		return 0;
 	}
 	else if (streq(action, "wait-result")) {
-		const char *instance_id = req_get_val(&req, "id");
-		if (!instance_id) {
-			ipc_send_string(req_fd(&req), "RESPDATA %s ERR=field is missing: id", req_id(&req));
+		if (!req_get_val(&req, "id")) {
+			ipc_queue_string(req_ctx(&req), "RESPDATA %s ERR=field is missing: id", req_id(&req));
 			return -1;
 		}
 
-		struct instance *instance;
-
-		pthread_mutex_lock(&instances_mutex);
-		while (1) {
-			instance = find_instance(instance_id);
-			if (!instance) {
-				pthread_mutex_unlock(&instances_mutex);
-				ipc_send_string(req_fd(&req), "RESPDATA %s ERR=no instance", req_id(&req));
-				return -1;
-			}
-			if (instance->finished)
-				break;
-
-			pthread_cond_wait(&instance_cond, &instances_mutex);
-		}
-		pthread_mutex_unlock(&instances_mutex);
-
-		struct ui_task *t = ui_task_create(UI_TASK_RESULT, &req);
-		if (!t) {
-			ipc_send_string(req_fd(&req), "RESPDATA %s ERR=no memory", req_id(&req));
-			return -1;
-		}
-		return ui_enqueue_and_wait(t);
+		return wait_result(&req);
 	}
 
 	enum ui_task_type ttype = UI_TASK_NONE;
@@ -829,7 +1536,7 @@ static int handle_message(struct ipc_ctx *ctx, struct ipc_message *m, void *data
 	else if (streq(action, "list-plugins"))	ttype = UI_TASK_LIST_PLUGINS;
 	else if (streq(action, "dump"))		ttype = UI_TASK_DUMP;
 	else {
-		ipc_send_string(req_fd(&req), "RESPDATA %s ERR=unknown action", req_id(&req));
+		ipc_queue_string(req_ctx(&req), "RESPDATA %s ERR=unknown action", req_id(&req));
 		return -1;
 	}
 
@@ -842,19 +1549,22 @@ static int handle_message(struct ipc_ctx *ctx, struct ipc_message *m, void *data
 			break;
 		default:
 			if (!req_get_val(&req, "id")) {
-				ipc_send_string(req_fd(&req), "RESPDATA %s ERR=field is missing: id", req_id(&req));
+				ipc_queue_string(req_ctx(&req), "RESPDATA %s ERR=field is missing: id", req_id(&req));
 				return -1;
 			}
 			break;
 	}
 
+	if (!decode_plugin_args(&req, ttype))
+		return -1;
+
 	struct ui_task *t = ui_task_create(ttype, &req);
 	if (!t) {
-		ipc_send_string(req_fd(&req), "RESPDATA %s ERR=no memory", req_id(&req));
+		ipc_queue_string(req_ctx(&req), "RESPDATA %s ERR=no memory", req_id(&req));
 		return -1;
 	}
 
-	return ui_enqueue_and_wait(t);
+	return ui_enqueue(t);
 }
 
 static void handle_input(void)
@@ -873,7 +1583,7 @@ static void handle_input(void)
 			getmaxyx(stdscr, rows, cols);
 			resize_term(rows, cols);
 
-			ui_update();
+			ui_schedule_frame();
 			return;
 		}
 	}
@@ -885,11 +1595,14 @@ static void handle_input(void)
 
 	if (focused && focused->ops && focused->ops->input) {
 		struct instance *instance = find_instance(focused->instance_id);
+		int res = focused->ops->input(focused, (wchar_t) code);
 
-		focused->ops->input(focused, (wchar_t) code);
+		if (res)
+			ui_widget_dirty(focused);
+		if (res & INPUT_STATE)
+			widget_state_changed(focused);
 
 		ui_check_instance_finished(instance);
-		ui_update();
 	}
 }
 
@@ -934,22 +1647,828 @@ static void curses_finish(void)
 	delscreen(scr);
 }
 
-static void *thread_connection(void *arg)
+static void io_close(struct connection *conn)
 {
-	struct ipc_ctx *ctx = arg;
+	struct waiter *w1, *w2;
+
+	io->close(conn);
+	conn->closed = true;
+
+	for (size_t i = 0; i < WAITERS_HASH; i++) {
+		w1 = LIST_FIRST(&waiters[i]);
+		while (w1) {
+			w2 = LIST_NEXT(w1, entries);
+
+			if (req_conn(&w1->req) == conn) {
+				LIST_REMOVE(w1, entries);
+				ipc_msg_free(w1->req.r_msg);
+				free(w1);
+				conn->pending--;
+			}
+			w1 = w2;
+		}
+	}
+
+	LIST_REMOVE(conn, entries);
+	LIST_INSERT_HEAD(&closed_connections, conn, entries);
+}
+
+static void io_free(struct connection *conn)
+{
+	LIST_REMOVE(conn, entries);
+	ipc_outbuf_free(&conn->sendbuf);
+	ipc_free(conn->ctx);
+	free(conn->ctx);
+	free(conn);
+}
+
+/*
+ * Free the closed connections that nothing refers to anymore.
+ */
+static void io_reap(void)
+{
+	struct connection *c1, *c2;
+
+	c1 = LIST_FIRST(&closed_connections);
+	while (c1) {
+		c2 = LIST_NEXT(c1, entries);
+		if (!c1->pending && !c1->ops)
+			io_free(c1);
+		c1 = c2;
+	}
+}
+
+static struct connection *io_connection_new(struct ipc_ctx *client)
+{
+	struct connection *conn = calloc(1, sizeof(*conn));
+	if (!conn) {
+		warn("calloc(connection)");
+		ipc_free(client);
+		free(client);
+		return NULL;
+	}
+
+	conn->ctx = client;
+	client->data = conn;
+
+	LIST_INSERT_HEAD(&connections, conn, entries);
+
+	return conn;
+}
+
+/*
+ * Send what has been queued for the connection.
+ */
+static void io_update(struct connection *conn)
+{
+	if (conn->closed)
+		return;
+
+	if (!ipc_flush(conn->ctx)) {
+		io_close(conn);
+		return;
+	}
+
+	io->update(conn);
+}
+
+static void io_complete(struct request *req, int rc)
+{
+	struct connection *conn = req_conn(req);
+
+	if (rc == IPC_MSG_PENDING)
+		return;
+
+	if (conn->closed) {
+		ipc_msg_free(req->r_msg);
+		return;
+	}
+
+	ipc_msg_complete(req_ctx(req), req->r_msg, rc);
+	io_update(conn);
+}
+
+/*
+ * Answer the parked wait-result requests of the instance, or of any instance
+ * if @id is NULL, that are finished or gone by now.
+ *
+ * The ready requests are moved to a local list first: answering one may fail
+ * to flush and close its connection, and io_close() frees the waiters of that
+ * connection that are still parked.
+ */
+static void io_wake_waiters(struct waiters *head, const char *id)
+{
+	struct waiters ready = LIST_HEAD_INITIALIZER(ready);
+	struct waiter *w1, *w2;
+
+	w1 = LIST_FIRST(head);
+	while (w1) {
+		w2 = LIST_NEXT(w1, entries);
+
+		const char *wid = req_get_val(&w1->req, "id");
+
+		if (!id || streq(wid, id)) {
+			registry_read_lock();
+			struct instance *instance = find_instance(wid);
+			bool done = (!instance || instance->finished);
+			registry_read_unlock();
+
+			if (done) {
+				LIST_REMOVE(w1, entries);
+				LIST_INSERT_HEAD(&ready, w1, entries);
+			}
+		}
+		w1 = w2;
+	}
+
+	while ((w1 = LIST_FIRST(&ready)) != NULL) {
+		struct request req = w1->req;
+
+		LIST_REMOVE(w1, entries);
+		free(w1);
+
+		req_conn(&req)->pending--;
+		io_complete(&req, wait_result(&req));
+	}
+}
+
+/*
+ * Answer the messages finished by the UI thread and recheck the parked
+ * wait-result requests.
+ */
+static void io_process_events(void)
+{
+	struct ui_task *t = task_queue_take(&donetasks);
+
+	while (t) {
+		struct ui_task *next = t->next;
+
+		req_conn(&t->req)->pending--;
+		req_conn(&t->req)->queued--;
+		io_complete(&t->req, t->rc);
+		free(t);
+
+		t = next;
+	}
+
+	struct instance_event *ev = atomic_exchange_explicit(&instance_events, NULL,
+			memory_order_acquire);
+	bool all = atomic_exchange(&instances_changed, 0);
+
+	while (ev) {
+		struct instance_event *next = ev->next;
+
+		if (!all)
+			io_wake_waiters(waiters_bucket(ev->id), ev->id);
+		free(ev);
+
+		ev = next;
+	}
+
+	if (all) {
+		for (size_t i = 0; i < WAITERS_HASH; i++)
+			io_wake_waiters(&waiters[i], NULL);
+	}
+}
+
+/*
+ * The epoll backend.
+ */
+static bool io_epoll_init(void)
+{
+	io_epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (io_epollfd == -1) {
+		warn("epoll_create1");
+		return false;
+	}
+
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+	};
+
+	for (size_t i = 0; i < num_listeners; i++) {
+		ev.data.ptr = &listeners[i];
+		if (epoll_ctl(io_epollfd, EPOLL_CTL_ADD, listeners[i].fd, &ev) < 0) {
+			warn("epoll_ctl(add)");
+			return false;
+		}
+	}
+
+	ev.data.ptr = &io_eventfd;
+	if (epoll_ctl(io_epollfd, EPOLL_CTL_ADD, io_eventfd, &ev) < 0) {
+		warn("epoll_ctl(add)");
+		return false;
+	}
+
+	return true;
+}
+
+static void io_epoll_finish(void)
+{
+	close(io_epollfd);
+}
+
+static void io_epoll_close(struct connection *conn)
+{
+	if (epoll_ctl(io_epollfd, EPOLL_CTL_DEL, conn->ctx->fd, NULL) < 0)
+		warn("epoll_ctl(del)");
+
+	ipc_close(conn->ctx);
+}
+
+/*
+ * Watch for the socket to become writable if not everything fit.
+ */
+static void io_epoll_update(struct connection *conn)
+{
+	uint32_t events = EPOLLIN;
+
+	if (ipc_has_output(conn->ctx))
+		events |= EPOLLOUT;
+
+	if (events == conn->events)
+		return;
+
+	struct epoll_event ev = {
+		.events = events,
+		.data.ptr = conn,
+	};
+
+	if (epoll_ctl(io_epollfd, EPOLL_CTL_MOD, conn->ctx->fd, &ev) < 0) {
+		warn("epoll_ctl(mod)");
+		io_close(conn);
+		return;
+	}
+
+	conn->events = events;
+}
+
+static void io_epoll_accept(struct ipc_ctx *srv)
+{
+	struct ipc_ctx *client;
+
+	while ((client = ipc_accept(srv)) != NULL) {
+		struct connection *conn = io_connection_new(client);
+		if (!conn)
+			continue;
+
+		conn->events = EPOLLIN;
+
+		struct epoll_event ev = {
+			.events = conn->events,
+			.data.ptr = conn,
+		};
+
+		if (epoll_ctl(io_epollfd, EPOLL_CTL_ADD, client->fd, &ev) < 0) {
+			warn("epoll_ctl(add)");
+			io_free(conn);
+		}
+	}
+}
+
+static void io_epoll_handle(struct connection *conn, uint32_t events)
+{
+	if (conn->closed)
+		return;
+
+	if ((events & EPOLLOUT) && !ipc_flush(conn->ctx)) {
+		io_close(conn);
+		return;
+	}
+
+	if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !ipc_process_input(conn->ctx)) {
+		io_close(conn);
+		return;
+	}
+
+	io_update(conn);
+}
+
+static bool io_epoll_run(void)
+{
+	struct epoll_event evs[64];
+	uint64_t val;
+
+	while (!do_quit) {
+		int n = epoll_wait(io_epollfd, evs, ARRAY_SIZE(evs), -1);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			warn("epoll_wait");
+			return false;
+		}
 
-	ipc_event_loop(ctx);
-	ipc_close(ctx);
-	free(ctx);
+		for (int i = 0; i < n; i++) {
+			void *ptr = evs[i].data.ptr;
 
+			if (ptr >= (void *) listeners && ptr < (void *) (listeners + num_listeners)) {
+				io_epoll_accept(ptr);
+
+			} else if (ptr == &io_eventfd) {
+				if (read(io_eventfd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+					warn("read(eventfd)");
+
+				io_process_events();
+			} else {
+				io_epoll_handle(ptr, evs[i].events);
+			}
+		}
+
+		io_reap();
+	}
+
+	return true;
+}
+
+static const struct io_backend io_epoll = {
+	.name   = "epoll",
+	.init   = io_epoll_init,
+	.finish = io_epoll_finish,
+	.run    = io_epoll_run,
+	.update = io_epoll_update,
+	.close  = io_epoll_close,
+};
+
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ * The io_uring backend. The listening socket has a multishot accept, every
+ * connection has a multishot receive into the provided buffers, and queued
+ * output is sent with one send request at a time. A batch of completions is
+ * handled and the next requests are submitted with a single io_uring_enter().
+ */
+#define IO_RING_ENTRIES		256
+#define IO_RING_BGID		0
+#define IO_RING_BUFS		64
+#define IO_RING_BUF_SIZE	4096
+
+/*
+ * The user_data of the connection requests is the pointer tagged with the
+ * type. Small values stand for the eventfd read and the accept on a listener.
+ */
+enum {
+	IO_RING_EVENT  = 1,
+	IO_RING_ACCEPT = 2, /* + index of the listener */
+};
+
+enum {
+	IO_RING_RECV = 0,
+	IO_RING_SEND = 1,
+	IO_RING_MASK = 3,
+};
+
+static struct uring io_ring;
+static uint64_t io_ring_event;
+
+static struct io_uring_sqe *io_ring_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	while ((sqe = uring_get_sqe(&io_ring)) == NULL) {
+		int r = uring_submit(&io_ring, 0);
+
+		if (r < 0 && r != -EINTR) {
+			errno = -r;
+			warn("io_uring_enter");
+			return NULL;
+		}
+	}
+	return sqe;
+}
+
+static bool io_ring_arm_accept(size_t idx)
+{
+	struct io_uring_sqe *sqe = io_ring_sqe();
+	if (!sqe)
+		return false;
+
+	/*
+	 * Accepted sockets stay blocking: io_uring waits for them to become
+	 * ready instead of completing requests with EAGAIN.
+	 */
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listeners[idx].fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = IO_RING_ACCEPT + idx;
+
+	return true;
+}
+
+static bool io_ring_arm_event(void)
+{
+	struct io_uring_sqe *sqe = io_ring_sqe();
+	if (!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = io_eventfd;
+	sqe->addr = (uint64_t) (uintptr_t) &io_ring_event;
+	sqe->len = sizeof(io_ring_event);
+	sqe->user_data = IO_RING_EVENT;
+
+	return true;
+}
+
+static bool io_ring_arm_recv(struct connection *conn)
+{
+	struct io_uring_sqe *sqe = io_ring_sqe();
+	if (!sqe)
+		return false;
+
+	if (conn->ctx->flags & IPC_CTX_SEQPACKET) {
+		char *buf = ipc_datagram_buffer(conn->ctx);
+		if (!buf)
+			return false;
+
+		/*
+		 * One datagram at a time straight into the buffer it is parsed
+		 * in. With MSG_TRUNC the result is the real size of the datagram.
+		 */
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = conn->ctx->fd;
+		sqe->addr = (uint64_t) (uintptr_t) buf;
+		sqe->len = IPC_SEQPACKET_MAX;
+		sqe->msg_flags = MSG_TRUNC;
+		sqe->user_data = (uint64_t) (uintptr_t) conn | IO_RING_RECV;
+
+		conn->ops++;
+
+		return true;
+	}
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->ctx->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = IO_RING_BGID;
+	sqe->user_data = (uint64_t) (uintptr_t) conn | IO_RING_RECV;
+
+	conn->ops++;
+
+	return true;
+}
+
+static bool io_ring_send(struct connection *conn)
+{
+	struct io_uring_sqe *sqe = io_ring_sqe();
+	if (!sqe)
+		return false;
+
+	const char *buf = conn->sendbuf.data + conn->sent;
+	size_t len = conn->sendbuf.len - conn->sent;
+
+	/* A send is one datagram, so it must end on a frame boundary. */
+	if (conn->ctx->flags & IPC_CTX_SEQPACKET) {
+		bool v2 = conn->ctx->dgram_v2;
+		len = ipc_datagram_size(buf, len, &v2);
+	}
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = conn->ctx->fd;
+	sqe->addr = (uint64_t) (uintptr_t) buf;
+	sqe->len = (uint32_t) len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uint64_t) (uintptr_t) conn | IO_RING_SEND;
+
+	conn->ops++;
+	conn->sending = true;
+
+	return true;
+}
+
+static bool io_ring_init(void)
+{
+	if (!uring_init(&io_ring, IO_RING_ENTRIES))
+		return false;
+
+	if (!uring_setup_buffers(&io_ring, IO_RING_BGID, IO_RING_BUFS, IO_RING_BUF_SIZE)) {
+		uring_free(&io_ring);
+		return false;
+	}
+
+	for (size_t i = 0; i < num_listeners; i++) {
+		int flags = fcntl(listeners[i].fd, F_GETFL);
+
+		if (flags < 0 || fcntl(listeners[i].fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+			warn("fcntl");
+			uring_free(&io_ring);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void io_ring_finish(void)
+{
+	uring_free(&io_ring);
+}
+
+static void io_ring_close(struct connection *conn)
+{
+	/*
+	 * The requests in flight still refer to the connection. Shutting the
+	 * socket down completes them; the descriptor is closed when the
+	 * connection is freed.
+	 */
+	if (shutdown(conn->ctx->fd, SHUT_RDWR) < 0 && errno != ENOTCONN)
+		warn("shutdown");
+}
+
+/*
+ * Hand the queued output over to the kernel unless a send is in flight.
+ */
+static void io_ring_update(struct connection *conn)
+{
+	if (conn->sending || !ipc_outbuf_take(conn->ctx, &conn->sendbuf))
+		return;
+
+	conn->sent = 0;
+
+	if (!io_ring_send(conn))
+		io_close(conn);
+}
+
+static void io_ring_accept(struct ipc_ctx *srv, int fd)
+{
+	struct ipc_ctx *client = ipc_accept_fd(srv, fd);
+	if (!client)
+		return;
+
+	client->flags |= IPC_CTX_QUEUE_ONLY;
+
+	struct connection *conn = io_connection_new(client);
+	if (conn && !io_ring_arm_recv(conn))
+		io_free(conn);
+}
+
+static void io_ring_datagram_done(struct connection *conn, struct io_uring_cqe *cqe)
+{
+	conn->ops--;
+
+	if (conn->closed)
+		return;
+
+	if (cqe->res > IPC_SEQPACKET_MAX)
+		warnx("datagram is larger than %d bytes", IPC_SEQPACKET_MAX);
+
+	if (cqe->res <= 0 || cqe->res > IPC_SEQPACKET_MAX ||
+	    !ipc_process_datagram(conn->ctx, conn->ctx->dgram, (size_t) cqe->res) ||
+	    !io_ring_arm_recv(conn)) {
+		io_close(conn);
+		return;
+	}
+
+	io_update(conn);
+}
+
+static void io_ring_recv_done(struct connection *conn, struct io_uring_cqe *cqe)
+{
+	bool more = (cqe->flags & IORING_CQE_F_MORE);
+
+	if (!more)
+		conn->ops--;
+
+	if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+		unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		bool ok = conn->closed ||
+			ipc_process_data(conn->ctx, uring_buffer(&io_ring, bid), (size_t) cqe->res);
+
+		uring_recycle_buffer(&io_ring, bid);
+
+		if (conn->closed)
+			return;
+
+		if (!ok || (!more && !io_ring_arm_recv(conn))) {
+			io_close(conn);
+			return;
+		}
+
+		io_update(conn);
+		return;
+	}
+
+	if (conn->closed)
+		return;
+
+	/* All buffers were busy for a moment. */
+	if (cqe->res == -ENOBUFS && !more && io_ring_arm_recv(conn))
+		return;
+
+	io_close(conn);
+}
+
+static void io_ring_send_done(struct connection *conn, struct io_uring_cqe *cqe)
+{
+	conn->ops--;
+	conn->sending = false;
+
+	if (conn->closed)
+		return;
+
+	if (cqe->res < 0) {
+		io_close(conn);
+		return;
+	}
+
+	if (conn->ctx->flags & IPC_CTX_SEQPACKET)
+		ipc_datagram_size(conn->sendbuf.data + conn->sent,
+				(size_t) cqe->res, &conn->ctx->dgram_v2);
+
+	conn->sent += (size_t) cqe->res;
+
+	if (conn->sent < conn->sendbuf.len) {
+		if (!io_ring_send(conn))
+			io_close(conn);
+		return;
+	}
+
+	conn->sendbuf.len = 0;
+	io_update(conn);
+}
+
+static bool io_ring_complete(struct io_uring_cqe *cqe)
+{
+	if (cqe->user_data == IO_RING_EVENT) {
+		io_process_events();
+		return io_ring_arm_event();
+	}
+
+	if (cqe->user_data < IO_RING_ACCEPT + num_listeners) {
+		size_t idx = (size_t) (cqe->user_data - IO_RING_ACCEPT);
+
+		if (cqe->res >= 0)
+			io_ring_accept(&listeners[idx], cqe->res);
+		else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED)
+			warnx("accept: %s", strerror(-cqe->res));
+
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			return io_ring_arm_accept(idx);
+		return true;
+	}
+
+	struct connection *conn = (struct connection *) (uintptr_t) (cqe->user_data & ~(uint64_t) IO_RING_MASK);
+
+	if ((cqe->user_data & IO_RING_MASK) == IO_RING_SEND)
+		io_ring_send_done(conn, cqe);
+	else if (conn->ctx->flags & IPC_CTX_SEQPACKET)
+		io_ring_datagram_done(conn, cqe);
+	else
+		io_ring_recv_done(conn, cqe);
+
+	return true;
+}
+
+static bool io_ring_run(void)
+{
+	bool ret = io_ring_arm_event();
+
+	for (size_t i = 0; ret && i < num_listeners; i++)
+		ret = io_ring_arm_accept(i);
+
+	while (ret && !do_quit) {
+		int r = uring_submit(&io_ring, 1);
+
+		if (r < 0 && r != -EINTR) {
+			errno = -r;
+			warn("io_uring_enter");
+			ret = false;
+			break;
+		}
+
+		struct io_uring_cqe *cqe;
+
+		while (ret && (cqe = uring_peek_cqe(&io_ring)) != NULL) {
+			struct io_uring_cqe copy = *cqe;
+
+			uring_cqe_seen(&io_ring);
+			ret = io_ring_complete(&copy);
+		}
+
+		io_reap();
+	}
+
+	/* Push out what is already queued, including the answer to quit. */
+	uring_submit(&io_ring, 0);
+
+	return ret;
+}
+
+static const struct io_backend io_uring_backend = {
+	.name   = "io_uring",
+	.init   = io_ring_init,
+	.finish = io_ring_finish,
+	.run    = io_ring_run,
+	.update = io_ring_update,
+	.close  = io_ring_close,
+};
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/*
+ * All client connections are served by this thread. Messages that need the UI
+ * are passed to the UI thread and answered when it reports them done, so slow
+ * UI work or a pending wait-result never holds up other clients.
+ */
+static void *thread_io(void *arg _UNUSED)
+{
+	if (!io->run()) {
+		do_quit = 1;
+		ui_wakeup();
+	}
 	return NULL;
 }
 
+static void io_init(void)
+{
+	io_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (io_eventfd == -1)
+		err(EXIT_FAILURE, "eventfd");
+
+	if (streq(io_backend_name, "io_uring")) {
+#ifdef HAVE_LINUX_IO_URING_H
+		if (io_uring_backend.init())
+			io = &io_uring_backend;
+		else
+			warnx("io_uring is not available, using epoll");
+#else
+		warnx("built without io_uring support, using epoll");
+#endif
+	}
+
+	if (io == &io_epoll && !io_epoll.init())
+		exit(EXIT_FAILURE);
+
+	int r = pthread_create(&io_thread, NULL, &thread_io, NULL);
+	if (r != 0)
+		error(EXIT_FAILURE, r, "pthread_create");
+}
+
+/*
+ * Called after both threads are stopped. Messages still in flight are dropped
+ * along with their connections.
+ */
+static void ui_free_tasks(struct ui_task *t)
+{
+	while (t) {
+		struct ui_task *next = t->next;
+
+		ipc_msg_free(t->req.r_msg);
+		free(t);
+
+		t = next;
+	}
+}
+
+static void io_finish(void)
+{
+	io->finish();
+
+	for (int i = 0; i < UI_LANES; i++) {
+		ui_free_tasks(ui_lanes[i].backlog);
+		ui_free_tasks(task_queue_take(&ui_lanes[i].queue));
+	}
+	ui_free_tasks(task_queue_take(&donetasks));
+
+	for (size_t i = 0; i < WAITERS_HASH; i++) {
+		struct waiter *w;
+
+		while ((w = LIST_FIRST(&waiters[i])) != NULL) {
+			LIST_REMOVE(w, entries);
+			ipc_msg_free(w->req.r_msg);
+			free(w);
+		}
+	}
+
+	struct instance_event *ev = atomic_exchange(&instance_events, NULL);
+
+	while (ev) {
+		struct instance_event *next = ev->next;
+
+		free(ev);
+		ev = next;
+	}
+
+	struct connection *conn;
+
+	while ((conn = LIST_FIRST(&connections)) != NULL)
+		io_free(conn);
+
+	while ((conn = LIST_FIRST(&closed_connections)) != NULL)
+		io_free(conn);
+
+	close(io_eventfd);
+}
+
 int main(int argc, char **argv)
 {
 	int c, r, retcode;
+	char *endptr = NULL;
 	const char *tty_file = NULL;
 	const char *socket_file = NULL;
+	const char *seqpacket_file = NULL;
+	char *seqpacket_path = NULL;
 	const char *pluginsdir = NULL;
 
 	while ((c = getopt_long(argc, argv, cmdopts_s, cmdopts, NULL)) != -1) {
@@ -960,6 +2479,26 @@ int main(int argc, char **argv)
 			case 2:		// --tty=TTYDevice
 				tty_file = optarg;
 				break;
+			case 3:		// --output-limit=Bytes
+				errno = 0;
+				output_limit = strtoul(optarg, &endptr, 10);
+				if (errno || endptr == optarg || *endptr != '\0')
+					errx(EXIT_FAILURE, "invalid output limit: %s", optarg);
+				break;
+			case 4:		// --io-backend=Name
+				if (!streq(optarg, "epoll") && !streq(optarg, "io_uring"))
+					errx(EXIT_FAILURE, "unknown IO backend: %s", optarg);
+				io_backend_name = optarg;
+				break;
+			case 5:		// --seqpacket-file=Filename
+				seqpacket_file = optarg;
+				break;
+			case 6:		// --max-fps=Number
+				errno = 0;
+				max_fps = (unsigned int) strtoul(optarg, &endptr, 10);
+				if (errno || endptr == optarg || *endptr != '\0' || max_fps > 1000)
+					errx(EXIT_FAILURE, "invalid frame rate: %s", optarg);
+				break;
 			case 'S':	// --socket-file=Filename
 				socket_file = optarg;
 				break;
@@ -979,6 +2518,12 @@ int main(int argc, char **argv)
 			errx(EXIT_FAILURE, "socket file required");
 	}
 
+	if (!seqpacket_file) {
+		if (asprintf(&seqpacket_path, "%s.seq", socket_file) < 0)
+			err(EXIT_FAILURE, "asprintf");
+		seqpacket_file = seqpacket_path;
+	}
+
 	if (debug_file)
 		stderr = freopen(debug_file, "w", stderr);
 
@@ -995,9 +2540,11 @@ int main(int argc, char **argv)
 	setlocale(LC_ALL, "");
 	setlocale(LC_CTYPE, "");
 
-	LIST_INIT(&workers);
 	TAILQ_INIT(&instances);
-	TAILQ_INIT(&uitasks);
+	LIST_INIT(&connections);
+	LIST_INIT(&closed_connections);
+	for (size_t i = 0; i < WAITERS_HASH; i++)
+		LIST_INIT(&waiters[i]);
 
 	retcode = EXIT_SUCCESS;
 
@@ -1008,41 +2555,45 @@ int main(int argc, char **argv)
 
 	load_plugins(pluginsdir);
 
-	pthread_attr_t attr;
-
-	r = pthread_attr_init(&attr);
-	if (r != 0)
-		error(EXIT_FAILURE, r, "pthread_attr_init");
-
 	ui_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
 	if (ui_eventfd == -1)
 		err(EXIT_FAILURE, "eventfd");
 
 	ui_thread = pthread_self();
 
-	struct ipc_ctx ctx;
-	ipc_init(&ctx);
+	for (size_t i = 0; i < ARRAY_SIZE(listeners); i++) {
+		ipc_init(&listeners[i]);
+
+		listeners[i].handle_message = handle_message;
+		listeners[i].out_limit = output_limit;
+	}
 
-	ctx.event_loop_iter = event_loop_iter;
-	ctx.handle_message = handle_message;
+	ipc_init(&result_ctx);
 
 	curses_init(inf, outf);
 	//atexit(curses_finish);
 
-	ipc_listen(&ctx, socket_file, 42, 0);
+	if (!ipc_listen(&listeners[0], socket_file, SOMAXCONN, SOCK_NONBLOCK))
+		errx(EXIT_FAILURE, "unable to listen on socket: %s", socket_file);
+	num_listeners++;
+
+	if (*seqpacket_file) {
+		listeners[1].flags |= IPC_CTX_SEQPACKET;
+
+		if (!ipc_listen(&listeners[1], seqpacket_file, SOMAXCONN, SOCK_NONBLOCK))
+			errx(EXIT_FAILURE, "unable to listen on socket: %s", seqpacket_file);
+		num_listeners++;
+	}
+
+	io_init();
 
 	enum {
-		POLL_SRVFD   = 0,
-		POLL_STDIN   = 1,
-		POLL_EVENTFD = 2,
-		POLL_N_FDS   = 3,
+		POLL_STDIN   = 0,
+		POLL_EVENTFD = 1,
+		POLL_N_FDS   = 2,
 	};
 
 	struct pollfd pfd[] = {
-		[POLL_SRVFD] = {
-			.fd = ctx.fd,
-			.events = POLLIN,
-		},
 		[POLL_STDIN] = {
 			.fd = fileno(inf),
 			.events = POLLIN,
@@ -1055,7 +2606,7 @@ int main(int argc, char **argv)
 
 	while (!do_quit) {
 		errno = 0;
-		r = poll(pfd, POLL_N_FDS, -1);
+		r = poll(pfd, POLL_N_FDS, ui_frame_timeout());
 
 		if (r < 0) {
 			if (errno == EINTR)
@@ -1064,60 +2615,51 @@ int main(int argc, char **argv)
 			warn("poll");
 
 			retcode = EXIT_FAILURE;
+			do_quit = 1;
+			io_wakeup();
 			break;
 		}
 
-		if (r == 0)
-			continue;
-
-		if (pfd[POLL_SRVFD].revents & POLLIN) {
-			struct ipc_ctx *client = ipc_accept(&ctx);
-
-			if (client) {
-				struct worker *worker = calloc(1, sizeof(*worker));
-
-				r = pthread_create(&worker->thread_id, &attr, &thread_connection, client);
-				if (r != 0)
-					error(EXIT_FAILURE, r, "pthread_create");
-
-				LIST_INSERT_HEAD(&workers, worker, entries);
+		if (r > 0) {
+			if (pfd[POLL_STDIN].revents & POLLIN) {
+				handle_input();
+			}
+			if (pfd[POLL_EVENTFD].revents & POLLIN) {
+				handle_tasks();
 			}
 		}
-		if (pfd[POLL_STDIN].revents & POLLIN) {
-			handle_input();
-		}
-		if (pfd[POLL_EVENTFD].revents & POLLIN) {
-			handle_tasks();
-		}
 
+		if (ui_frame_timeout() == 0)
+			ui_render_frame();
+
+		registry_reclaim();
 		fflush(stderr);
 	}
 
-	r = pthread_attr_destroy(&attr);
+	r = pthread_join(io_thread, NULL);
 	if (r != 0)
-		error(0, r, "pthread_attr_destroy");
-
-	struct worker *w1 = LIST_FIRST(&workers);
-	while (w1 != NULL) {
-		struct worker *w2 = LIST_NEXT(w1, entries);
-
-		r = pthread_join(w1->thread_id, NULL);
-		if (r != 0)
-			error(0, r, "pthread_join");
-
-		free(w1);
-		w1 = w2;
-	}
+		error(0, r, "pthread_join");
 
+	io_finish();
 	free_instances();
 	unload_plugins();
+	widget_window_pool_free();
 
-	ipc_close(&ctx);
-	ipc_free(&ctx);
+	if (IS_DEBUG()) {
+		const struct widget_stats *ws = widget_get_stats();
+		warnx("windows: %lu created, %lu reused, %lu destroyed, %lu moved",
+			ws->windows_created, ws->windows_reused,
+			ws->windows_destroyed, ws->windows_moved);
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(listeners); i++) {
+		ipc_close(&listeners[i]);
+		ipc_free(&listeners[i]);
+	}
+	ipc_free(&result_ctx);
+	free(seqpacket_path);
 
 	close(ui_eventfd);
-	pthread_mutex_destroy(&ui_mutex);
-	pthread_cond_destroy(&ui_cond);
 
 	curses_finish();
 
@@ -4,6 +4,7 @@
 
 #include <sys/queue.h>
 #include <stdbool.h>
+#include <limits.h>
 
 #include "request.h"
 
@@ -14,6 +15,26 @@ enum p_retcode {
 	P_RET_ERR = 1,
 };
 
+/*
+ * Placement of the instance window, the parameters every plugin takes on
+ * create. Put it into the plugin arguments and P_GEOMETRY_PARAMS() into the
+ * create schema.
+ */
+struct p_geometry {
+	int x;
+	int y;
+	int width;
+	int height;
+	bool border;
+};
+
+#define P_GEOMETRY_PARAMS(_type, _field) \
+	REQ_INT(_type, _field.x, "x", -1, 0), \
+	REQ_INT(_type, _field.y, "y", -1, 0), \
+	REQ_INT_RANGE(_type, _field.width,  "width",  0, 0, INT_MAX, REQ_PARAM_REQUIRED), \
+	REQ_INT_RANGE(_type, _field.height, "height", 0, 0, INT_MAX, REQ_PARAM_REQUIRED), \
+	REQ_BOOL(_type, _field.border, "border", false)
+
 struct plugin {
 	LIST_ENTRY(plugin) entries;
 
@@ -21,6 +42,14 @@ struct plugin {
 	const char *desc;
 	void *dl_handle;
 
+	/*
+	 * Parameters of create and update. With a schema the daemon checks the
+	 * request before it reaches the UI thread, and the callback finds the
+	 * decoded values in req_args().
+	 */
+	const struct req_schema *p_create_schema;
+	const struct req_schema *p_update_schema;
+
 	enum p_retcode (*p_plugin_init)(void);
 	struct widget *(*p_create_instance)(struct request *req);
 	enum p_retcode (*p_delete_instance)(struct widget *root);
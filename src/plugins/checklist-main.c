@@ -17,20 +17,32 @@
 
 #define SELECT_ID 1
 
+struct checklist_args {
+	struct p_geometry geom;
+	const wchar_t *text;
+	int select;
+	int visible;
+	struct req_strings options;
+	struct req_strings buttons;
+};
+
+static const struct req_param checklist_create_params[] = {
+	P_GEOMETRY_PARAMS(struct checklist_args, geom),
+	REQ_STRING(struct checklist_args, text, "text", 0),
+	REQ_INT_RANGE(struct checklist_args, select, "select", 1, 1, INT_MAX, 0),
+	REQ_INT_RANGE(struct checklist_args, visible, "visible", 1, 1, INT_MAX, 0),
+	REQ_STRINGS(struct checklist_args, options, "option"),
+	REQ_STRINGS(struct checklist_args, buttons, "button"),
+};
+
+static const struct req_schema checklist_create_schema = REQ_SCHEMA(struct checklist_args, checklist_create_params);
+
 static struct widget *p_checklist_create(struct request *req)
 {
-	struct ipc_pair *p = req_data(req);
-
-	int begin_x = req_get_int(req, "x", -1);
-	int begin_y = req_get_int(req, "y", -1);
-	int height  = req_get_int(req, "height", -1);
-	int width   = req_get_int(req, "width",  -1);
+	const struct checklist_args *args = req_args(req);
 
-	if (height < 0 || width < 0) {
-		ipc_send_string(req_fd(req), "RESPDATA %s ERR='width' and 'height' parameters must be specified",
-				req_id(req));
-		return NULL;
-	}
+	int begin_x = args->geom.x;
+	int begin_y = args->geom.y;
 
 	struct widget *root = make_window();
 	if (!root)
@@ -38,12 +50,12 @@ static struct widget *p_checklist_create(struct request *req)
 
 	struct widget *parent = root;
 
-	if (req_get_bool(req, "border", false)) {
+	if (args->geom.border) {
 		struct widget *border = make_border_vbox(parent);
 		parent = border;
 	}
 
-	wchar_t *text __free(ptr) = req_get_wchars(req, "text");
+	const wchar_t *text = args->text;
 	if (text) {
 		struct widget *txt = make_textview(text);
 		if (!txt) {
@@ -54,8 +66,8 @@ static struct widget *p_checklist_create(struct request *req)
 		txt->flex_h = 1;
 	}
 
-	int maxsel = req_get_int(req, "select", 1);
-	int maxvis = req_get_int(req, "visible", 1);
+	int maxsel = args->select;
+	int maxvis = args->visible;
 
 	struct widget *select = make_select(maxsel, maxvis);
 	if (!select) {
@@ -63,15 +75,11 @@ static struct widget *p_checklist_create(struct request *req)
 		goto fail;
 	}
 	widget_add(parent, select);
-	select->w_id = SELECT_ID;
-
-	for (size_t i = 0; i < p->num_kv; i++) {
-		if (streq(p->kv[i].key, "option")) {
-			wchar_t *txt = req_get_kv_wchars(p->kv + i);
-			struct widget *option = make_select_option(txt, false, (maxsel > 1));
-			free(txt);
-			widget_add(select, option);
-		}
+	widget_set_id(select, SELECT_ID);
+
+	for (size_t i = 0; i < args->options.num; i++) {
+		struct widget *option = make_select_option(args->options.items[i], false, (maxsel > 1));
+		widget_add(select, option);
 	}
 
 	struct widget *hbox = make_hbox();
@@ -82,28 +90,22 @@ static struct widget *p_checklist_create(struct request *req)
 	widget_add(parent, hbox);
 
 	int button_id = 1;
-	for (size_t i = 0; i < p->num_kv; i++) {
-		if (streq(p->kv[i].key, "button")) {
-			wchar_t *label = req_get_kv_wchars(p->kv + i);
-
-			struct widget *btn = make_button(label);
-			free(label);
-
-			if (!btn) {
-				warnx("unable to create button");
-				goto fail;
-			}
-			widget_add(hbox, btn);
-			btn->w_id = button_id++;
+	for (size_t i = 0; i < args->buttons.num; i++) {
+		struct widget *btn = make_button(args->buttons.items[i]);
+
+		if (!btn) {
+			warnx("unable to create button");
+			goto fail;
 		}
+		widget_add(hbox, btn);
+		widget_set_id(btn, button_id++);
 	}
 
 	widget_measure_tree(root);
 
-	position_center(width, height, &begin_y, &begin_x);
+	position_center(args->geom.width, args->geom.height, &begin_y, &begin_x);
 
-	widget_layout_tree(root, begin_x, begin_y, width, height);
-	widget_render_tree(root);
+	widget_layout_tree(root, begin_x, begin_y, args->geom.width, args->geom.height);
 
 	return root;
 fail:
@@ -126,7 +128,7 @@ static bool collect_results(struct widget *w, void *data)
 			bool selected = false;
 			widget_get_index(w, PROP_SELECT_OPTION_VALUE, i, &selected);
 
-			ipc_send_string(req_fd(req), "RESPDATA %s SELECT_%d_OPTION_%d=%d",
+			ipc_queue_string(req_ctx(req), "RESPDATA %s SELECT_%d_OPTION_%d=%d",
 					req_id(req), w->w_id, (i + 1), selected);
 		}
 	}
@@ -135,7 +137,7 @@ static bool collect_results(struct widget *w, void *data)
 		bool clicked = false;
 		widget_get(w, PROP_BUTTON_STATE, &clicked);
 
-		ipc_send_string(req_fd(req), "RESPDATA %s BUTTON_%d=%d",
+		ipc_queue_string(req_ctx(req), "RESPDATA %s BUTTON_%d=%d",
 				req_id(req), w->w_id, clicked);
 	}
 
@@ -173,6 +175,7 @@ PLUGIN_EXPORT
 struct plugin plugin = {
 	.name              = "checklist",
 	.desc              = "A checklist box. There are multiple entries presented in the form of a menu.",
+	.p_create_schema   = &checklist_create_schema,
 	.p_plugin_init     = NULL,
 	.p_plugin_free     = NULL,
 	.p_create_instance = p_checklist_create,
@@ -16,20 +16,28 @@
 #include "plugin.h"
 
 
+struct form_args {
+	struct p_geometry geom;
+	const wchar_t *text;
+	struct req_strings buttons;
+};
+
+static const struct req_param form_create_params[] = {
+	P_GEOMETRY_PARAMS(struct form_args, geom),
+	REQ_STRING(struct form_args, text, "text", 0),
+	REQ_STRINGS(struct form_args, buttons, "button"),
+};
+
+static const struct req_schema form_create_schema = REQ_SCHEMA(struct form_args, form_create_params);
+
 static struct widget *p_form_create(struct request *req)
 {
 	struct ipc_pair *p = req_data(req);
 
-	int begin_x = req_get_int(req, "x", -1);
-	int begin_y = req_get_int(req, "y", -1);
-	int height  = req_get_int(req, "height", -1);
-	int width   = req_get_int(req, "width",  -1);
+	const struct form_args *args = req_args(req);
 
-	if (height < 0 || width < 0) {
-		ipc_send_string(req_fd(req), "RESPDATA %s ERR='width' and 'height' parameters must be specified",
-				req_id(req));
-		return NULL;
-	}
+	int begin_x = args->geom.x;
+	int begin_y = args->geom.y;
 
 	struct widget *root = make_window();
 	if (!root)
@@ -37,12 +45,12 @@ static struct widget *p_form_create(struct request *req)
 
 	struct widget *parent = root;
 
-	if (req_get_bool(req, "border", false)) {
+	if (args->geom.border) {
 		struct widget *border = make_border_vbox(parent);
 		parent = border;
 	}
 
-	wchar_t *text __free(ptr) = req_get_wchars(req, "text");
+	const wchar_t *text = args->text;
 	if (text) {
 		struct widget *txt = make_textview(text);
 		if (!txt) {
@@ -78,10 +86,7 @@ static struct widget *p_form_create(struct request *req)
 			continue;
 		}
 		if (streq(p->kv[i].key, "label")) {
-			wchar_t *s = req_get_kv_wchars(p->kv + i);
-
-			struct widget *label = make_label(s);
-			free(s);
+			struct widget *label = make_label(req_get_kv_wchars(req, p->kv + i));
 
 			if (!label) {
 				warnx("unable to create label");
@@ -91,10 +96,7 @@ static struct widget *p_form_create(struct request *req)
 			continue;
 		}
 		if (streq(p->kv[i].key, "input")) {
-			wchar_t *s = req_get_kv_wchars(p->kv + i);
-
-			struct widget *input = make_input(s, NULL);
-			free(s);
+			struct widget *input = make_input(req_get_kv_wchars(req, p->kv + i), NULL);
 
 			if (!input) {
 				warnx("unable to create input");
@@ -102,14 +104,11 @@ static struct widget *p_form_create(struct request *req)
 			}
 			widget_add(current, input);
 
-			input->w_id = input_id++;
+			widget_set_id(input, input_id++);
 			continue;
 		}
 		if (streq(p->kv[i].key, "password")) {
-			wchar_t *s = req_get_kv_wchars(p->kv + i);
-
-			struct widget *input = make_input_password(s, NULL);
-			free(s);
+			struct widget *input = make_input_password(req_get_kv_wchars(req, p->kv + i), NULL);
 
 			if (!input) {
 				warnx("unable to create input");
@@ -117,7 +116,7 @@ static struct widget *p_form_create(struct request *req)
 			}
 			widget_add(current, input);
 
-			input->w_id = input_id++;
+			widget_set_id(input, input_id++);
 			continue;
 		}
 	}
@@ -130,28 +129,22 @@ static struct widget *p_form_create(struct request *req)
 	widget_add(parent, hbox);
 
 	int button_id = 1;
-	for (size_t i = 0; i < p->num_kv; i++) {
-		if (streq(p->kv[i].key, "button")) {
-			wchar_t *label = req_get_kv_wchars(p->kv + i);
-
-			struct widget *btn = make_button(label);
-			free(label);
+	for (size_t i = 0; i < args->buttons.num; i++) {
+		struct widget *btn = make_button(args->buttons.items[i]);
 
-			if (!btn) {
-				warnx("unable to create button");
-				goto fail;
-			}
-			widget_add(hbox, btn);
-			btn->w_id = button_id++;
+		if (!btn) {
+			warnx("unable to create button");
+			goto fail;
 		}
+		widget_add(hbox, btn);
+		widget_set_id(btn, button_id++);
 	}
 
 	widget_measure_tree(root);
 
-	position_center(width, height, &begin_y, &begin_x);
+	position_center(args->geom.width, args->geom.height, &begin_y, &begin_x);
 
-	widget_layout_tree(root, begin_x, begin_y, width, height);
-	widget_render_tree(root);
+	widget_layout_tree(root, begin_x, begin_y, args->geom.width, args->geom.height);
 
 	return root;
 fail:
@@ -170,7 +163,7 @@ static bool collect_results(struct widget *w, void *data)
 		wchar_t *text = NULL;
 		widget_get(w, PROP_INPUT_VALUE, &text);
 
-		ipc_send_string(req_fd(req), "RESPDATA %s INPUT_%d=%ls",
+		ipc_queue_string(req_ctx(req), "RESPDATA %s INPUT_%d=%ls",
 				req_id(req), w->w_id, text);
 	}
 
@@ -178,7 +171,7 @@ static bool collect_results(struct widget *w, void *data)
 		bool clicked = false;
 		widget_get(w, PROP_BUTTON_STATE, &clicked);
 
-		ipc_send_string(req_fd(req), "RESPDATA %s BUTTON_%d=%d",
+		ipc_queue_string(req_ctx(req), "RESPDATA %s BUTTON_%d=%d",
 				req_id(req), w->w_id, clicked);
 	}
 
@@ -216,6 +209,7 @@ PLUGIN_EXPORT
 struct plugin plugin = {
 	.name              = "form",
 	.desc              = "The form dialog displays a form consisting of labels and fields.",
+	.p_create_schema   = &form_create_schema,
 	.p_plugin_init     = NULL,
 	.p_plugin_free     = NULL,
 	.p_create_instance = p_form_create,
@@ -17,20 +17,36 @@
 
 #define METER_ID 1
 
+struct meter_args {
+	struct p_geometry geom;
+	const wchar_t *label;
+	int total;
+};
+
+static const struct req_param meter_create_params[] = {
+	P_GEOMETRY_PARAMS(struct meter_args, geom),
+	REQ_STRING(struct meter_args, label, "label", 0),
+	REQ_INT_RANGE(struct meter_args, total, "total", 0, 0, INT_MAX, 0),
+};
+
+static const struct req_schema meter_create_schema = REQ_SCHEMA(struct meter_args, meter_create_params);
+
+struct meter_update_args {
+	int value;
+};
+
+static const struct req_param meter_update_params[] = {
+	REQ_INT(struct meter_update_args, value, "value", 0, 0),
+};
+
+static const struct req_schema meter_update_schema = REQ_SCHEMA(struct meter_update_args, meter_update_params);
+
 static struct widget *p_meter_create(struct request *req)
 {
-	int begin_x = req_get_int(req, "x", -1);
-	int begin_y = req_get_int(req, "y", -1);
-	int height  = req_get_int(req, "height", -1);
-	int width   = req_get_int(req, "width",  -1);
+	const struct meter_args *args = req_args(req);
 
-	int total = req_get_int(req, "total", 0);
-
-	if (height < 0 || width < 0) {
-		ipc_send_string(req_fd(req), "RESPDATA %s ERR='width' and 'height' parameters must be specified",
-				req_id(req));
-		return NULL;
-	}
+	int begin_x = args->geom.x;
+	int begin_y = args->geom.y;
 
 	struct widget *root = make_window();
 	if (!root)
@@ -38,29 +54,27 @@ static struct widget *p_meter_create(struct request *req)
 
 	struct widget *parent = root;
 
-	if (req_get_bool(req, "border", false)) {
+	if (args->geom.border) {
 		struct widget *border = make_border_hbox(parent);
 		parent = border;
 	}
 
-	wchar_t *label_text __free(ptr) = req_get_wchars(req, "label");
-	if (label_text) {
-		struct widget *label = make_label(label_text);
+	if (args->label) {
+		struct widget *label = make_label(args->label);
 		widget_add(parent, label);
 	}
 
-	struct widget *meter = make_meter(total);
+	struct widget *meter = make_meter(args->total);
 
-	meter->w_id = METER_ID;
+	widget_set_id(meter, METER_ID);
 
 	widget_add(parent, meter);
 
 	widget_measure_tree(root);
 
-	position_center(width, height, &begin_y, &begin_x);
+	position_center(args->geom.width, args->geom.height, &begin_y, &begin_x);
 
-	widget_layout_tree(root, begin_x, begin_y, width, height);
-	widget_render_tree(root);
+	widget_layout_tree(root, begin_x, begin_y, args->geom.width, args->geom.height);
 
 	return root;
 }
@@ -71,7 +85,8 @@ static enum p_retcode p_meter_update(struct request *req, struct widget *root)
 	if (!meter)
 		return P_RET_ERR;
 
-	int value = req_get_int(req, "value", 0);
+	const struct meter_update_args *args = req_args(req);
+	int value = args->value;
 
 	widget_set(meter, PROP_METER_VALUE, &value);
 
@@ -98,6 +113,8 @@ PLUGIN_EXPORT
 struct plugin plugin = {
 	.name              = "meter",
 	.desc              = "The plugin displays a progress box. The meter indicates the percentage.",
+	.p_create_schema   = &meter_create_schema,
+	.p_update_schema   = &meter_update_schema,
 	.p_plugin_init     = NULL,
 	.p_plugin_free     = NULL,
 	.p_create_instance = p_meter_create,
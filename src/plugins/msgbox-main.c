@@ -14,20 +14,26 @@
 #include "widget.h"
 #include "plugin.h"
 
+struct msgbox_args {
+	struct p_geometry geom;
+	const wchar_t *text;
+	struct req_strings buttons;
+};
+
+static const struct req_param msgbox_create_params[] = {
+	P_GEOMETRY_PARAMS(struct msgbox_args, geom),
+	REQ_STRING(struct msgbox_args, text, "text", 0),
+	REQ_STRINGS(struct msgbox_args, buttons, "button"),
+};
+
+static const struct req_schema msgbox_create_schema = REQ_SCHEMA(struct msgbox_args, msgbox_create_params);
+
 static struct widget *p_msgbox_create(struct request *req)
 {
-	struct ipc_pair *p = req_data(req);
+	const struct msgbox_args *args = req_args(req);
 
-	int begin_x = req_get_int(req, "x", -1);
-	int begin_y = req_get_int(req, "y", -1);
-	int height  = req_get_int(req, "height", -1);
-	int width   = req_get_int(req, "width",  -1);
-
-	if (height < 0 || width < 0) {
-		ipc_send_string(req_fd(req), "RESPDATA %s ERR='width' and 'height' parameters must be specified",
-				req_id(req));
-		return NULL;
-	}
+	int begin_x = args->geom.x;
+	int begin_y = args->geom.y;
 
 	struct widget *root = make_window();
 	if (!root)
@@ -35,12 +41,12 @@ static struct widget *p_msgbox_create(struct request *req)
 
 	struct widget *parent = root;
 
-	if (req_get_bool(req, "border", false)) {
+	if (args->geom.border) {
 		struct widget *border = make_border_vbox(parent);
 		parent = border;
 	}
 
-	wchar_t *text __free(ptr) = req_get_wchars(req, "text");
+	const wchar_t *text = args->text;
 	if (text) {
 		struct widget *txt = make_textview(text);
 		widget_add(parent, txt);
@@ -54,30 +60,24 @@ static struct widget *p_msgbox_create(struct request *req)
 
 	int w_id = 1;
 
-	for (size_t i = 0; i < p->num_kv; i++) {
-		if (streq(p->kv[i].key, "button")) {
-			wchar_t *label = req_get_kv_wchars(p->kv + i);
-
-			struct widget *btn = make_button(label);
-			free(label);
+	for (size_t i = 0; i < args->buttons.num; i++) {
+		struct widget *btn = make_button(args->buttons.items[i]);
 
-			if (!btn) {
-				warnx("unable to create button");
-				widget_free(root);
-				return NULL;
-			}
-			btn->w_id = w_id++;
-
-			widget_add(hbox, btn);
+		if (!btn) {
+			warnx("unable to create button");
+			widget_free(root);
+			return NULL;
 		}
+		widget_set_id(btn, w_id++);
+
+		widget_add(hbox, btn);
 	}
 
 	widget_measure_tree(root);
 
-	position_center(width, height, &begin_y, &begin_x);
+	position_center(args->geom.width, args->geom.height, &begin_y, &begin_x);
 
-	widget_layout_tree(root, begin_x, begin_y, width, height);
-	widget_render_tree(root);
+	widget_layout_tree(root, begin_x, begin_y, args->geom.width, args->geom.height);
 
 	return root;
 }
@@ -93,7 +93,7 @@ static bool collect_results(struct widget *w, void *data)
 		bool clicked = false;
 		widget_get(w, PROP_BUTTON_STATE, &clicked);
 
-		ipc_send_string(req_fd(req), "RESPDATA %s BUTTON_%d=%d",
+		ipc_queue_string(req_ctx(req), "RESPDATA %s BUTTON_%d=%d",
 				req_id(req), w->w_id, clicked);
 	}
 
@@ -131,6 +131,7 @@ PLUGIN_EXPORT
 struct plugin plugin = {
 	.name              = "msgbox",
 	.desc              = "The plugin displays a message with one or more buttons at the bottom.",
+	.p_create_schema   = &msgbox_create_schema,
 	.p_plugin_init     = NULL,
 	.p_plugin_free     = NULL,
 	.p_create_instance = p_msgbox_create,
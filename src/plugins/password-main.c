@@ -13,18 +13,30 @@
 
 #define INPUT_ID 1
 
+struct password_args {
+	struct p_geometry geom;
+	const wchar_t *text;
+	const wchar_t *label;
+	const wchar_t *placeholder;
+	const wchar_t *tooltip;
+};
+
+static const struct req_param password_create_params[] = {
+	P_GEOMETRY_PARAMS(struct password_args, geom),
+	REQ_STRING(struct password_args, text, "text", 0),
+	REQ_STRING(struct password_args, label, "label", 0),
+	REQ_STRING(struct password_args, placeholder, "placeholder", 0),
+	REQ_STRING(struct password_args, tooltip, "tooltip", 0),
+};
+
+static const struct req_schema password_create_schema = REQ_SCHEMA(struct password_args, password_create_params);
+
 static struct widget *p_pass_create(struct request *req)
 {
-	int begin_x = req_get_int(req, "x", -1);
-	int begin_y = req_get_int(req, "y", -1);
-	int height  = req_get_int(req, "height", -1);
-	int width   = req_get_int(req, "width",  -1);
-
-	if (height < 0 || width < 0) {
-		ipc_send_string(req_fd(req), "RESPDATA %s ERR='width' and 'height' parameters must be specified",
-				req_id(req));
-		return NULL;
-	}
+	const struct password_args *args = req_args(req);
+
+	int begin_x = args->geom.x;
+	int begin_y = args->geom.y;
 
 	struct widget *root = make_window();
 	if (!root)
@@ -32,12 +44,12 @@ static struct widget *p_pass_create(struct request *req)
 
 	struct widget *parent = root;
 
-	if (req_get_bool(req, "border", false)) {
+	if (args->geom.border) {
 		struct widget *border = make_border_vbox(parent);
 		parent = border;
 	}
 
-	wchar_t *top_text __free(ptr) = req_get_wchars(req, "text");
+	const wchar_t *top_text = args->text;
 
 	if (top_text) {
 		struct widget *txt = make_textview(top_text);
@@ -47,7 +59,7 @@ static struct widget *p_pass_create(struct request *req)
 	struct widget *hbox = make_hbox();
 	widget_add(parent, hbox);
 
-	wchar_t *left_text __free(ptr) = req_get_wchars(req, "label");
+	const wchar_t *left_text = args->label;
 
 	if (left_text) {
 		struct widget *label = make_label(left_text);
@@ -60,7 +72,7 @@ static struct widget *p_pass_create(struct request *req)
 		widget_add(hbox, label);
 	}
 
-	wchar_t *placeholder __free(ptr) = req_get_wchars(req, "placeholder");
+	const wchar_t *placeholder = args->placeholder;
 
 	struct widget *input = make_input_password(NULL, placeholder);
 	if (!input) {
@@ -68,11 +80,11 @@ static struct widget *p_pass_create(struct request *req)
 		widget_free(root);
 		return NULL;
 	}
-	input->w_id = INPUT_ID;
+	widget_set_id(input, INPUT_ID);
 
 	widget_add(hbox, input);
 
-	wchar_t *tooltip_text __free(ptr) = req_get_wchars(req, "tooltip");
+	const wchar_t *tooltip_text = args->tooltip;
 
 	if (tooltip_text) {
 		struct widget *tooltip = make_tooltip(tooltip_text);
@@ -86,10 +98,9 @@ static struct widget *p_pass_create(struct request *req)
 
 	widget_measure_tree(root);
 
-	position_center(width, height, &begin_y, &begin_x);
+	position_center(args->geom.width, args->geom.height, &begin_y, &begin_x);
 
-	widget_layout_tree(root, begin_x, begin_y, width, height);
-	widget_render_tree(root);
+	widget_layout_tree(root, begin_x, begin_y, args->geom.width, args->geom.height);
 
 	return root;
 }
@@ -102,7 +113,7 @@ static bool collect_results(struct widget *w, void *data)
 		wchar_t *text = NULL;
 		widget_get(w, PROP_INPUT_VALUE, &text);
 
-		ipc_send_string(req_fd(req), "RESPDATA %s PASSWORD_%d=%ls",
+		ipc_queue_string(req_ctx(req), "RESPDATA %s PASSWORD_%d=%ls",
 				req_id(req), w->w_id, text);
 	}
 
@@ -130,6 +141,7 @@ PLUGIN_EXPORT
 struct plugin plugin = {
 	.name              = "password",
 	.desc              = "The plugin displays a password entry dialog.",
+	.p_create_schema   = &password_create_schema,
 	.p_plugin_init     = NULL,
 	.p_plugin_free     = NULL,
 	.p_create_instance = p_pass_create,
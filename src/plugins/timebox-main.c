@@ -18,20 +18,26 @@
 #define SPIN_MIN_ID  2
 #define SPIN_SEC_ID  3
 
+struct timebox_args {
+	struct p_geometry geom;
+	const wchar_t *text;
+	struct req_strings buttons;
+};
+
+static const struct req_param timebox_create_params[] = {
+	P_GEOMETRY_PARAMS(struct timebox_args, geom),
+	REQ_STRING(struct timebox_args, text, "text", 0),
+	REQ_STRINGS(struct timebox_args, buttons, "button"),
+};
+
+static const struct req_schema timebox_create_schema = REQ_SCHEMA(struct timebox_args, timebox_create_params);
+
 static struct widget *p_timebox_create(struct request *req)
 {
-	struct ipc_pair *p = req_data(req);
+	const struct timebox_args *args = req_args(req);
 
-	int begin_x = req_get_int(req, "x", -1);
-	int begin_y = req_get_int(req, "y", -1);
-	int height  = req_get_int(req, "height", -1);
-	int width   = req_get_int(req, "width",  -1);
-
-	if (height < 0 || width < 0) {
-		ipc_send_string(req_fd(req), "RESPDATA %s ERR='width' and 'height' parameters must be specified",
-				req_id(req));
-		return NULL;
-	}
+	int begin_x = args->geom.x;
+	int begin_y = args->geom.y;
 
 	struct widget *root = make_window();
 	if (!root)
@@ -39,12 +45,12 @@ static struct widget *p_timebox_create(struct request *req)
 
 	struct widget *parent = root;
 
-	if (req_get_bool(req, "border", false)) {
+	if (args->geom.border) {
 		struct widget *border = make_border_vbox(parent);
 		parent = border;
 	}
 
-	wchar_t *text __free(ptr) = req_get_wchars(req, "text");
+	const wchar_t *text = args->text;
 	if (text) {
 		struct widget *txt = make_textview(text);
 		widget_add(parent, txt);
@@ -67,9 +73,9 @@ static struct widget *p_timebox_create(struct request *req)
 		goto fail;
 	}
 
-	hour->w_id = SPIN_HOUR_ID;
-	min->w_id  = SPIN_MIN_ID;
-	sec->w_id  = SPIN_SEC_ID;
+	widget_set_id(hour, SPIN_HOUR_ID);
+	widget_set_id(min,  SPIN_MIN_ID);
+	widget_set_id(sec,  SPIN_SEC_ID);
 
 	widget_add(parent, hbox1);
 	widget_add(hbox1, hour);
@@ -89,28 +95,22 @@ static struct widget *p_timebox_create(struct request *req)
 	widget_add(parent, hbox2);
 
 	int button_id = 1;
-	for (size_t i = 0; i < p->num_kv; i++) {
-		if (streq(p->kv[i].key, "button")) {
-			wchar_t *label = req_get_kv_wchars(p->kv + i);
-
-			struct widget *btn = make_button(label);
-			free(label);
-
-			if (!btn) {
-				warnx("unable to create button");
-				goto fail;
-			}
-			widget_add(hbox2, btn);
-			btn->w_id = button_id++;
+	for (size_t i = 0; i < args->buttons.num; i++) {
+		struct widget *btn = make_button(args->buttons.items[i]);
+
+		if (!btn) {
+			warnx("unable to create button");
+			goto fail;
 		}
+		widget_add(hbox2, btn);
+		widget_set_id(btn, button_id++);
 	}
 
 	widget_measure_tree(root);
 
-	position_center(width, height, &begin_y, &begin_x);
+	position_center(args->geom.width, args->geom.height, &begin_y, &begin_x);
 
-	widget_layout_tree(root, begin_x, begin_y, width, height);
-	widget_render_tree(root);
+	widget_layout_tree(root, begin_x, begin_y, args->geom.width, args->geom.height);
 
 	return root;
 fail:
@@ -131,17 +131,17 @@ static bool collect_results(struct widget *w, void *data)
 
 		switch (w->w_id) {
 			case SPIN_HOUR_ID:
-				ipc_send_string(req_fd(req), "RESPDATA %s SPINBOX_HOURS=%d",
+				ipc_queue_string(req_ctx(req), "RESPDATA %s SPINBOX_HOURS=%d",
 					req_id(req), value);
 				break;
 
 			case SPIN_MIN_ID:
-				ipc_send_string(req_fd(req), "RESPDATA %s SPINBOX_MINUTES=%d",
+				ipc_queue_string(req_ctx(req), "RESPDATA %s SPINBOX_MINUTES=%d",
 					req_id(req), value);
 				break;
 
 			case SPIN_SEC_ID:
-				ipc_send_string(req_fd(req), "RESPDATA %s SPINBOX_SECONDS=%d",
+				ipc_queue_string(req_ctx(req), "RESPDATA %s SPINBOX_SECONDS=%d",
 					req_id(req), value);
 				break;
 		}
@@ -151,7 +151,7 @@ static bool collect_results(struct widget *w, void *data)
 		bool clicked = false;
 		widget_get(w, PROP_BUTTON_STATE, &clicked);
 
-		ipc_send_string(req_fd(req), "RESPDATA %s BUTTON_%d=%d",
+		ipc_queue_string(req_ctx(req), "RESPDATA %s BUTTON_%d=%d",
 				req_id(req), w->w_id, clicked);
 	}
 
@@ -189,6 +189,7 @@ PLUGIN_EXPORT
 struct plugin plugin = {
 	.name              = "timebox",
 	.desc              = "A dialog is displayed which allows you to select hour, minute and second.",
+	.p_create_schema   = &timebox_create_schema,
 	.p_plugin_init     = NULL,
 	.p_plugin_free     = NULL,
 	.p_create_instance = p_timebox_create,
@@ -3,8 +3,10 @@
 
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 #include <errno.h>
 #include <limits.h>
 #include <err.h>
@@ -12,74 +14,329 @@
 #include "macros.h"
 #include "request.h"
 
-const char *req_get_val(struct request *req, const char *key)
+enum req_value_decoded {
+	REQ_VAL_NUM       = (1 << 0), /* num is set */
+	REQ_VAL_NUM_EXACT = (1 << 1), /* the whole value is the number */
+	REQ_VAL_WCS       = (1 << 2), /* wcs is set, NULL if not convertible */
+};
+
+struct req_key {
+	struct req_key *hash_next;
+	uint32_t hash;
+	size_t count;
+	struct req_value *first;
+	struct req_value *last;
+};
+
+/*
+ * Lookup of the request pairs by key. It is built once when the message is
+ * complete and lives in the message arena, so there is nothing to free.
+ */
+struct req_index {
+	struct req_value *values; /* one per pair, in request order */
+	size_t num_values;
+	struct req_key **buckets;
+	uint32_t mask;
+};
+
+static uint32_t req_hash(const char *key)
 {
-	struct ipc_pair *p = req_data(req);
+	/* FNV-1a */
+	uint32_t h = 2166136261U;
 
-	for (size_t i = 0; i < p->num_kv; i++) {
-		if (streq(p->kv[i].key, key))
-			return p->kv[i].val;
+	for (const unsigned char *p = (const unsigned char *) key; *p; p++)
+		h = (h ^ *p) * 16777619U;
+
+	return h;
+}
+
+static struct req_key *req_find_key(struct req_index *idx, const char *key, uint32_t hash)
+{
+	struct req_key *k;
+
+	for (k = idx->buckets[hash & idx->mask]; k; k = k->hash_next) {
+		if (k->hash == hash && streq(k->first->kv->key, key))
+			return k;
 	}
 	return NULL;
 }
 
-wchar_t *req_get_kv_wchars(struct ipc_kv *kv)
+bool req_index_build(struct request *req)
 {
-	size_t mbslen = mbstowcs(NULL, kv->val, 0);
+	struct ipc_message *m = req->r_msg;
+	struct ipc_pair *p = req_data(req);
+	size_t num_buckets = 8;
 
-	if (mbslen == (size_t) -1) {
-		return NULL;
+	while (num_buckets < p->num_kv)
+		num_buckets <<= 1;
+
+	struct req_index *idx = ipc_msg_alloc(m, sizeof(*idx));
+	struct req_key **buckets = ipc_msg_alloc(m, num_buckets * sizeof(*buckets));
+	struct req_value *values = ipc_msg_alloc(m, MAX(p->num_kv, 1) * sizeof(*values));
+
+	if (!idx || !buckets || !values)
+		return false;
+
+	memset(buckets, 0, num_buckets * sizeof(*buckets));
+	memset(values, 0, p->num_kv * sizeof(*values));
+
+	idx->values = values;
+	idx->num_values = p->num_kv;
+	idx->buckets = buckets;
+	idx->mask = (uint32_t) (num_buckets - 1);
+
+	for (size_t i = 0; i < p->num_kv; i++) {
+		struct req_value *v = values + i;
+		uint32_t hash = req_hash(p->kv[i].key);
+		struct req_key *k = req_find_key(idx, p->kv[i].key, hash);
+
+		v->kv = p->kv + i;
+
+		if (!k) {
+			k = ipc_msg_alloc(m, sizeof(*k));
+			if (!k)
+				return false;
+
+			k->hash = hash;
+			k->count = 0;
+			k->first = v;
+			k->hash_next = buckets[hash & idx->mask];
+			buckets[hash & idx->mask] = k;
+		} else {
+			k->last->next = v;
+		}
+
+		k->last = v;
+		k->count++;
 	}
 
-	wchar_t *wcs = calloc(mbslen + 1, sizeof(*wcs));
+	req->r_index = idx;
+	return true;
+}
 
-	if (!wcs) {
-		warn("calloc");
+static struct req_key *req_get_key(struct request *req, const char *key)
+{
+	if (!req->r_index && !req_index_build(req))
 		return NULL;
-	}
 
-	mbstowcs(wcs, kv->val, mbslen + 1);
-	return wcs;
+	return req_find_key(req->r_index, key, req_hash(key));
+}
+
+struct req_value *req_get_values(struct request *req, const char *key)
+{
+	struct req_key *k = req_get_key(req, key);
+	return k ? k->first : NULL;
+}
+
+size_t req_count_values(struct request *req, const char *key)
+{
+	struct req_key *k = req_get_key(req, key);
+	return k ? k->count : 0;
+}
+
+const char *req_get_val(struct request *req, const char *key)
+{
+	struct req_value *v = req_get_values(req, key);
+	return v ? v->kv->val : NULL;
 }
 
-wchar_t *req_get_wchars(struct request *req, const char *key)
+const wchar_t *req_value_wchars(struct request *req, struct req_value *v)
+{
+	if (v->decoded & REQ_VAL_WCS)
+		return v->wcs;
+
+	/* Every wide character takes at least one byte. */
+	size_t len = strlen(v->kv->val);
+	wchar_t *wcs = ipc_msg_alloc(req->r_msg, (len + 1) * sizeof(*wcs));
+
+	if (!wcs)
+		return NULL;
+
+	if (mbstowcs(wcs, v->kv->val, len + 1) == (size_t) -1)
+		wcs = NULL;
+
+	v->wcs = wcs;
+	v->decoded |= REQ_VAL_WCS;
+
+	return v->wcs;
+}
+
+const wchar_t *req_get_kv_wchars(struct request *req, struct ipc_kv *kv)
 {
 	struct ipc_pair *p = req_data(req);
 
-	for (size_t i = 0; i < p->num_kv; i++) {
-		if (streq(p->kv[i].key, key))
-			return req_get_kv_wchars(p->kv + i);
-	}
-	return NULL;
+	if (kv < p->kv || kv >= p->kv + p->num_kv)
+		return NULL;
+
+	if (!req->r_index && !req_index_build(req))
+		return NULL;
+
+	return req_value_wchars(req, req->r_index->values + (kv - p->kv));
 }
 
-int req_get_int(struct request *req, const char *key, int def)
+const wchar_t *req_get_wchars(struct request *req, const char *key)
 {
-	const char *v = req_get_val(req, key);
-	return v ? atoi(v) : def;
+	struct req_value *v = req_get_values(req, key);
+	return v ? req_value_wchars(req, v) : NULL;
 }
 
-uint32_t req_get_uint(struct request *req, const char *key, uint32_t def)
+static void req_value_num(struct req_value *v)
 {
-	const char *v = req_get_val(req, key);
-	char *end = NULL;
-	unsigned long value;
+	if (v->decoded & REQ_VAL_NUM)
+		return;
 
-	if (!v)
-		return def;
+	const char *s = v->kv->val;
+	char *end = NULL;
 
 	errno = 0;
-	value = strtoul(v, &end, 10);
-	if (errno || end == v || *end != '\0' || value > UINT32_MAX)
+	v->num = strtoll(s, &end, 10);
+
+	if (!errno && end != s && *end == '\0')
+		v->decoded |= REQ_VAL_NUM_EXACT;
+	v->decoded |= REQ_VAL_NUM;
+}
+
+static struct req_value *req_get_num(struct request *req, const char *key)
+{
+	struct req_value *v = req_get_values(req, key);
+
+	if (v)
+		req_value_num(v);
+	return v;
+}
+
+static bool req_value_bool(struct req_value *v)
+{
+	const char *s = v->kv->val;
+	return streq(s, "1") || strcaseeq(s, "true") || strcaseeq(s, "yes");
+}
+
+int req_get_int(struct request *req, const char *key, int def)
+{
+	struct req_value *v = req_get_num(req, key);
+	return v ? (int) v->num : def;
+}
+
+uint32_t req_get_uint(struct request *req, const char *key, uint32_t def)
+{
+	struct req_value *v = req_get_num(req, key);
+
+	if (!v || !(v->decoded & REQ_VAL_NUM_EXACT) || v->num < 0 || v->num > UINT32_MAX)
 		return def;
 
-	return (uint32_t) value;
+	return (uint32_t) v->num;
 }
 
 bool req_get_bool(struct request *req, const char *key, bool def)
 {
-	const char *v = req_get_val(req, key);
-	if (v)
-		return streq(v, "1") || strcaseeq(v, "true") || strcaseeq(v, "yes");
-	return def;
+	struct req_value *v = req_get_values(req, key);
+	return v ? req_value_bool(v) : def;
+}
+
+static bool req_decode_int(struct req_value *v, const struct req_param *p, int *value,
+		char *err, size_t errsize)
+{
+	if (!v) {
+		*value = p->def;
+		return true;
+	}
+
+	req_value_num(v);
+
+	if (!(v->decoded & REQ_VAL_NUM_EXACT)) {
+		snprintf(err, errsize, "field is not a number: %s", p->name);
+		return false;
+	}
+
+	if (v->num < INT_MIN || v->num > INT_MAX ||
+	    ((p->flags & REQ_PARAM_BOUNDED) && (v->num < p->min || v->num > p->max))) {
+		snprintf(err, errsize, "field is out of range: %s", p->name);
+		return false;
+	}
+
+	*value = (int) v->num;
+	return true;
+}
+
+static bool req_decode_strings(struct request *req, struct req_key *k, const struct req_param *p,
+		struct req_strings *list, char *err, size_t errsize)
+{
+	if (!k)
+		return true;
+
+	list->items = ipc_msg_alloc(req->r_msg, k->count * sizeof(*list->items));
+	if (!list->items) {
+		snprintf(err, errsize, "no memory");
+		return false;
+	}
+
+	for (struct req_value *v = k->first; v; v = v->next) {
+		const wchar_t *wcs = req_value_wchars(req, v);
+
+		if (!wcs) {
+			snprintf(err, errsize, "field is not a valid string: %s", p->name);
+			return false;
+		}
+		list->items[list->num++] = wcs;
+	}
+	return true;
+}
+
+/*
+ * Check the request against the schema and fill in the arguments structure
+ * for the plugin. On failure err gets a message for the client.
+ */
+bool req_decode(struct request *req, const struct req_schema *schema, char *err, size_t errsize)
+{
+	char *args = ipc_msg_alloc(req->r_msg, MAX(schema->args_size, 1));
+
+	if (!args || (!req->r_index && !req_index_build(req))) {
+		snprintf(err, errsize, "no memory");
+		return false;
+	}
+
+	memset(args, 0, schema->args_size);
+
+	for (size_t i = 0; i < schema->num_params; i++) {
+		const struct req_param *p = schema->params + i;
+		struct req_key *k = req_find_key(req->r_index, p->name, req_hash(p->name));
+		struct req_value *v = k ? k->first : NULL;
+		void *field = args + p->offset;
+
+		if (!v && (p->flags & REQ_PARAM_REQUIRED)) {
+			snprintf(err, errsize, "field is missing: %s", p->name);
+			return false;
+		}
+
+		switch (p->type) {
+			case REQ_PARAM_INT:
+				if (!req_decode_int(v, p, field, err, errsize))
+					return false;
+				break;
+			case REQ_PARAM_BOOL:
+				*(bool *) field = v ? req_value_bool(v) : (p->def != 0);
+				break;
+			case REQ_PARAM_STRING:
+				if (p->flags & REQ_PARAM_REPEATED) {
+					if (!req_decode_strings(req, k, p, field, err, errsize))
+						return false;
+					break;
+				}
+				if (v) {
+					const wchar_t *wcs = req_value_wchars(req, v);
+
+					if (!wcs) {
+						snprintf(err, errsize, "field is not a valid string: %s", p->name);
+						return false;
+					}
+					*(const wchar_t **) field = wcs;
+				}
+				break;
+		}
+	}
+
+	req->r_schema = schema;
+	req->r_args = args;
+
+	return true;
 }
@@ -3,13 +3,94 @@
 #define _PLAINMOUTH_REQUEST_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <wchar.h>
 
 #include "ipc.h"
 
+/*
+ * One value of the request. The decodings are done on first use and kept
+ * for the lifetime of the message; use the accessors below to get them.
+ */
+struct req_value {
+	struct ipc_kv *kv;
+	struct req_value *next; /* next value of the same key, in request order */
+
+	unsigned int decoded;   /* what is already done, private to request.c */
+	long long num;
+	wchar_t *wcs;
+};
+
+struct req_index;
+
+enum req_param_type {
+	REQ_PARAM_INT,    /* int */
+	REQ_PARAM_BOOL,   /* bool */
+	REQ_PARAM_STRING, /* const wchar_t *, NULL if absent */
+};
+
+enum req_param_flags {
+	REQ_PARAM_REQUIRED = (1 << 0),
+	REQ_PARAM_REPEATED = (1 << 1), /* All values as struct req_strings, only for strings */
+	REQ_PARAM_BOUNDED  = (1 << 2), /* Integer must be within min..max */
+};
+
+/*
+ * One parameter of a schema: where its decoded value goes in the arguments
+ * structure and what the request value has to look like.
+ */
+struct req_param {
+	const char *name;
+	enum req_param_type type;
+	unsigned int flags;
+	int def;
+	int min;
+	int max;
+	size_t offset;
+};
+
+struct req_schema {
+	const struct req_param *params;
+	size_t num_params;
+	size_t args_size;
+};
+
+struct req_strings {
+	const wchar_t **items;
+	size_t num;
+};
+
+#define REQ_INT(_type, _field, _name, _def, _flags) \
+	{ .name = (_name), .type = REQ_PARAM_INT, .flags = (_flags), .def = (_def), \
+	  .offset = offsetof(_type, _field) }
+
+#define REQ_INT_RANGE(_type, _field, _name, _def, _min, _max, _flags) \
+	{ .name = (_name), .type = REQ_PARAM_INT, .flags = (_flags) | REQ_PARAM_BOUNDED, \
+	  .def = (_def), .min = (_min), .max = (_max), .offset = offsetof(_type, _field) }
+
+#define REQ_BOOL(_type, _field, _name, _def) \
+	{ .name = (_name), .type = REQ_PARAM_BOOL, .def = (_def), .offset = offsetof(_type, _field) }
+
+#define REQ_STRING(_type, _field, _name, _flags) \
+	{ .name = (_name), .type = REQ_PARAM_STRING, .flags = (_flags), .offset = offsetof(_type, _field) }
+
+#define REQ_STRINGS(_type, _field, _name) \
+	{ .name = (_name), .type = REQ_PARAM_STRING, .flags = REQ_PARAM_REPEATED, \
+	  .offset = offsetof(_type, _field) }
+
+#define REQ_SCHEMA(_type, _params) \
+	{ .params = (_params), .num_params = sizeof(_params) / sizeof((_params)[0]), \
+	  .args_size = sizeof(_type) }
+
 struct request {
 	struct ipc_ctx     *r_ctx;
 	struct ipc_message *r_msg;
+	struct req_index   *r_index; /* built once the message is complete */
+
+	const struct req_schema *r_schema; /* what r_args was decoded by */
+	const void *r_args;
 };
 
 static inline int req_fd(struct request *req)
@@ -17,6 +98,11 @@ static inline int req_fd(struct request *req)
 	return req->r_ctx->fd;
 }
 
+static inline struct ipc_ctx *req_ctx(struct request *req)
+{
+	return req->r_ctx;
+}
+
 static inline char *req_id(struct request *req)
 {
 	return req->r_msg->id;
@@ -27,11 +113,24 @@ static inline struct ipc_pair *req_data(struct request *req)
 	return &req->r_msg->data;
 }
 
+static inline const void *req_args(struct request *req)
+{
+	return req->r_args;
+}
+
+bool req_index_build(struct request *req) __attribute__((nonnull(1)));
+bool req_decode(struct request *req, const struct req_schema *schema, char *err, size_t errsize)
+	__attribute__((nonnull(1, 2, 3)));
+
+struct req_value *req_get_values(struct request *req, const char *key)    __attribute__((nonnull(1, 2)));
+size_t req_count_values(struct request *req, const char *key)            __attribute__((nonnull(1, 2)));
+const wchar_t *req_value_wchars(struct request *req, struct req_value *v) __attribute__((nonnull(1, 2)));
+
 const char *req_get_val(struct request *req, const char *key)             __attribute__((nonnull(1, 2)));
 int req_get_int(struct request *req, const char *key, int def)            __attribute__((nonnull(1, 2)));
 uint32_t req_get_uint(struct request *req, const char *key, uint32_t def) __attribute__((nonnull(1, 2)));
 bool req_get_bool(struct request *req, const char *key, bool def)         __attribute__((nonnull(1, 2)));
-wchar_t *req_get_kv_wchars(struct ipc_kv *kv)                             __attribute__((malloc, nonnull(1)));
-wchar_t *req_get_wchars(struct request *req, const char *key)             __attribute__((malloc, nonnull(1, 2)));
+const wchar_t *req_get_kv_wchars(struct request *req, struct ipc_kv *kv)  __attribute__((nonnull(1, 2)));
+const wchar_t *req_get_wchars(struct request *req, const char *key)       __attribute__((nonnull(1, 2)));
 
 #endif /* _PLAINMOUTH_REQUEST_H_ */
@@ -0,0 +1,246 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#include "config.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include "macros.h"
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool uring_init(struct uring *u, unsigned entries)
+{
+	struct io_uring_params p;
+	char *ring;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+
+	u->fd = -1;
+	u->ring_ptr = MAP_FAILED;
+	u->sqes = MAP_FAILED;
+
+	p.flags = IORING_SETUP_CLAMP;
+
+	u->fd = sys_io_uring_setup(entries, &p);
+	if (u->fd < 0) {
+		warn("io_uring_setup");
+		return false;
+	}
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		warnx("io_uring: the kernel does not support a single mmap of the rings");
+		goto fail;
+	}
+
+	u->ring_size = MAX(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+			   p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+
+	u->ring_ptr = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->ring_ptr == MAP_FAILED) {
+		warn("mmap(io_uring)");
+		goto fail;
+	}
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		warn("mmap(io_uring_sqes)");
+		goto fail;
+	}
+
+	ring = u->ring_ptr;
+
+	u->sq_head    = (unsigned *) (ring + p.sq_off.head);
+	u->sq_tail    = (unsigned *) (ring + p.sq_off.tail);
+	u->sq_array   = (unsigned *) (ring + p.sq_off.array);
+	u->sq_mask    = *(unsigned *) (ring + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sqe_tail   = *u->sq_tail;
+
+	u->cq_head = (unsigned *) (ring + p.cq_off.head);
+	u->cq_tail = (unsigned *) (ring + p.cq_off.tail);
+	u->cq_mask = *(unsigned *) (ring + p.cq_off.ring_mask);
+	u->cqes    = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+
+	return true;
+fail:
+	uring_free(u);
+	return false;
+}
+
+void uring_free(struct uring *u)
+{
+	if (u->br) {
+		struct io_uring_buf_reg reg;
+
+		memset(&reg, 0, sizeof(reg));
+		reg.bgid = u->bgid;
+
+		sys_io_uring_register(u->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+		munmap(u->br, u->br_size);
+	}
+	free(u->bufs);
+
+	if (u->sqes != MAP_FAILED && u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->ring_ptr != MAP_FAILED && u->ring_ptr)
+		munmap(u->ring_ptr, u->ring_size);
+	if (u->fd >= 0)
+		close(u->fd);
+
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+/*
+ * Returns a cleared submission entry or NULL if the submission ring is full
+ * and has to be submitted first.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *u)
+{
+	unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+	if (u->sqe_tail - head >= u->sq_entries)
+		return NULL;
+
+	unsigned idx = u->sqe_tail & u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	u->sq_array[idx] = idx;
+	u->sqe_tail++;
+
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/*
+ * Submit the prepared entries and wait for at least wait_nr completions with
+ * one system call. Returns the number of submitted entries or -errno.
+ */
+int uring_submit(struct uring *u, unsigned wait_nr)
+{
+	unsigned to_submit = u->sqe_tail - *u->sq_tail;
+
+	__atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+
+	if (!to_submit && !wait_nr)
+		return 0;
+
+	int r = sys_io_uring_enter(u->fd, to_submit, wait_nr,
+				   wait_nr ? IORING_ENTER_GETEVENTS : 0);
+
+	return (r < 0) ? -errno : r;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *u)
+{
+	unsigned head = *u->cq_head;
+
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &u->cqes[head & u->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Register a ring of count provided buffers of the given size. The kernel
+ * picks a buffer for every receive itself, so idle connections do not hold
+ * any receive memory. The count must be a power of two.
+ */
+bool uring_setup_buffers(struct uring *u, unsigned short bgid, unsigned count, unsigned size)
+{
+	struct io_uring_buf_reg reg;
+
+	u->br_size = count * sizeof(struct io_uring_buf);
+
+	void *br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (br == MAP_FAILED) {
+		warn("mmap(io_uring_buf_ring)");
+		return false;
+	}
+
+	u->bufs = malloc((size_t) count * size);
+	if (!u->bufs) {
+		warn("malloc(io_uring buffers)");
+		munmap(br, u->br_size);
+		return false;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) br;
+	reg.ring_entries = count;
+	reg.bgid = bgid;
+
+	if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		warn("io_uring_register(IORING_REGISTER_PBUF_RING)");
+		munmap(br, u->br_size);
+		free(u->bufs);
+		u->bufs = NULL;
+		return false;
+	}
+
+	u->br = br;
+	u->br_tail = 0;
+	u->bgid = bgid;
+	u->buf_count = count;
+	u->buf_size = size;
+
+	for (unsigned i = 0; i < count; i++)
+		uring_recycle_buffer(u, i);
+
+	return true;
+}
+
+char *uring_buffer(struct uring *u, unsigned bid)
+{
+	return u->bufs + (size_t) bid * u->buf_size;
+}
+
+/*
+ * Give the buffer back to the kernel once its data has been consumed.
+ */
+void uring_recycle_buffer(struct uring *u, unsigned bid)
+{
+	struct io_uring_buf *buf = &u->br->bufs[u->br_tail & (u->buf_count - 1)];
+
+	buf->addr = (uint64_t) (uintptr_t) uring_buffer(u, bid);
+	buf->len = u->buf_size;
+	buf->bid = (unsigned short) bid;
+
+	u->br_tail++;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#ifndef _PLAINMOUTH_URING_H_
+#define _PLAINMOUTH_URING_H_
+
+#include <linux/io_uring.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Minimal io_uring wrapper built directly on the system calls: the submission
+ * and completion rings and one ring of provided buffers for receives.
+ */
+struct uring {
+	int fd;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sqe_tail;        /* next entry to hand out */
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *ring_ptr;           /* both rings, mapped at once */
+	size_t ring_size;
+	size_t sqes_size;
+
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	unsigned short br_tail;
+	unsigned short bgid;
+	unsigned buf_count;
+	unsigned buf_size;
+	char *bufs;
+};
+
+bool uring_init(struct uring *u, unsigned entries) __attribute__((nonnull(1)));
+void uring_free(struct uring *u)                   __attribute__((nonnull(1)));
+
+struct io_uring_sqe *uring_get_sqe(struct uring *u) __attribute__((nonnull(1)));
+int uring_submit(struct uring *u, unsigned wait_nr) __attribute__((nonnull(1)));
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *u) __attribute__((nonnull(1)));
+void uring_cqe_seen(struct uring *u)                 __attribute__((nonnull(1)));
+
+bool uring_setup_buffers(struct uring *u, unsigned short bgid, unsigned count, unsigned size) __attribute__((nonnull(1)));
+char *uring_buffer(struct uring *u, unsigned bid)                                             __attribute__((nonnull(1)));
+void uring_recycle_buffer(struct uring *u, unsigned bid)                                      __attribute__((nonnull(1)));
+
+#endif /* _PLAINMOUTH_URING_H_ */
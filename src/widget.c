@@ -14,6 +14,272 @@
 #include "macros.h"
 #include "widget.h"
 
+static struct widget_stats stats;
+
+const struct widget_stats *widget_get_stats(void)
+{
+	return &stats;
+}
+
+/*
+ * Instances are created and deleted all the time, e.g. one password prompt
+ * per encrypted volume. Their memory comes in chunks of the same size and
+ * a few released chunks are kept for the next instances. The same is done
+ * for the root windows, which usually have the same size as well.
+ */
+#define WIDGET_ARENA_CHUNK 8192
+#define WIDGET_ARENA_CACHE 4
+#define WIDGET_ARENA_ALIGN sizeof(void *)
+#define WIDGET_WINDOW_POOL 4
+#define WIDGET_ID_BUCKETS  16
+
+struct widget_arena_chunk {
+	struct widget_arena_chunk *next;
+	size_t size;
+	char data[];
+};
+
+static struct widget_arena *cur_arena;
+static struct widget_arena_chunk *chunk_cache;
+static size_t chunk_cache_len;
+
+static WINDOW *window_pool[WIDGET_WINDOW_POOL];
+static size_t window_pool_len;
+
+static void *widget_arena_alloc(struct widget_arena *a, size_t size)
+{
+	size = (size + WIDGET_ARENA_ALIGN - 1) & ~(WIDGET_ARENA_ALIGN - 1);
+
+	if (size > (size_t) (a->end - a->pos)) {
+		struct widget_arena_chunk *c = NULL;
+
+		if (size <= WIDGET_ARENA_CHUNK && chunk_cache) {
+			c = chunk_cache;
+			chunk_cache = c->next;
+			chunk_cache_len--;
+		} else {
+			size_t chunk_size = MAX(size, WIDGET_ARENA_CHUNK);
+
+			c = malloc(sizeof(*c) + chunk_size);
+			if (!c) {
+				warn("malloc failed");
+				return NULL;
+			}
+			c->size = chunk_size;
+		}
+
+		c->next = a->chunks;
+		a->chunks = c;
+
+		a->pos = c->data;
+		a->end = c->data + c->size;
+	}
+
+	void *p = a->pos;
+	a->pos += size;
+
+	return memset(p, 0, size);
+}
+
+/*
+ * Widgets created until the next call belong to the arena. NULL puts them
+ * back on the heap.
+ */
+void widget_arena_use(struct widget_arena *a)
+{
+	cur_arena = a;
+}
+
+/*
+ * Free the memory of all widgets of the arena. The widgets must have been
+ * freed by widget_free() before, it destroys their windows.
+ */
+void widget_arena_release(struct widget_arena *a)
+{
+	while (a->chunks) {
+		struct widget_arena_chunk *c = a->chunks;
+
+		a->chunks = c->next;
+
+		if (c->size == WIDGET_ARENA_CHUNK && chunk_cache_len < WIDGET_ARENA_CACHE) {
+			c->next = chunk_cache;
+			chunk_cache = c;
+			chunk_cache_len++;
+			continue;
+		}
+		free(c);
+	}
+
+	a->pos = a->end = NULL;
+
+	free(a->ids);
+	a->ids = NULL;
+	a->ids_size = a->num_ids = 0;
+}
+
+static inline struct widget **widget_id_bucket(struct widget_arena *a, int id)
+{
+	return &a->ids[(unsigned int) id & (a->ids_size - 1)];
+}
+
+static void widget_id_index_grow(struct widget_arena *a)
+{
+	size_t size = a->ids_size ? a->ids_size * 2 : WIDGET_ID_BUCKETS;
+	struct widget **ids = calloc(size, sizeof(*ids));
+
+	if (!ids) {
+		/* The old buckets keep working, only the chains get longer. */
+		warn("calloc failed");
+		return;
+	}
+
+	struct widget **old = a->ids;
+	size_t old_size = a->ids_size;
+
+	a->ids = ids;
+	a->ids_size = size;
+
+	for (size_t i = 0; i < old_size; i++) {
+		while (old[i]) {
+			struct widget *w = old[i];
+			struct widget **b = widget_id_bucket(a, w->w_id);
+
+			old[i] = w->id_next;
+			w->id_next = *b;
+			*b = w;
+		}
+	}
+
+	free(old);
+}
+
+static void widget_id_index_add(struct widget *w)
+{
+	struct widget_arena *a = w->arena;
+
+	if (!a || !w->w_id || (w->flags & FLAG_ID_INDEXED))
+		return;
+
+	if (a->num_ids >= a->ids_size)
+		widget_id_index_grow(a);
+	if (!a->ids)
+		return;
+
+	struct widget **b = widget_id_bucket(a, w->w_id);
+
+	w->id_next = *b;
+	*b = w;
+	w->flags |= FLAG_ID_INDEXED;
+	a->num_ids++;
+}
+
+static void widget_id_index_remove(struct widget *w)
+{
+	if (!(w->flags & FLAG_ID_INDEXED))
+		return;
+
+	struct widget_arena *a = w->arena;
+	struct widget **p = widget_id_bucket(a, w->w_id);
+
+	while (*p && *p != w)
+		p = &(*p)->id_next;
+
+	/* w_id was assigned directly after the widget was indexed. */
+	for (size_t i = 0; !*p && i < a->ids_size; i++) {
+		p = &a->ids[i];
+		while (*p && *p != w)
+			p = &(*p)->id_next;
+	}
+
+	if (!*p)
+		return;
+
+	*p = w->id_next;
+	w->id_next = NULL;
+	w->flags &= ~FLAG_ID_INDEXED;
+	a->num_ids--;
+}
+
+/*
+ * Set the user ID of the widget and index it. Widgets that got w_id assigned
+ * directly are indexed when they are added to a parent.
+ */
+void widget_set_id(struct widget *w, int id)
+{
+	widget_id_index_remove(w);
+	w->w_id = id;
+	widget_id_index_add(w);
+}
+
+/*
+ * Zeroed memory that lives as long as the widget, e.g. for its state. It is
+ * taken from the arena of the widget if it has one.
+ */
+void *widget_alloc(struct widget *w, size_t size)
+{
+	return w->arena ? widget_arena_alloc(w->arena, size) : calloc(1, size);
+}
+
+wchar_t *widget_wcsdup(struct widget *w, const wchar_t *s)
+{
+	size_t size = (wcslen(s) + 1) * sizeof(wchar_t);
+	wchar_t *p = widget_alloc(w, size);
+
+	if (p)
+		memcpy(p, s, size);
+	return p;
+}
+
+void widget_mem_free(struct widget *w, void *p)
+{
+	/* The arena releases everything at once. */
+	if (!w->arena)
+		free(p);
+}
+
+/*
+ * Take a root window of the given size from the pool and put it at the given
+ * place. It is cleared, but not drawn yet.
+ */
+static WINDOW *widget_window_pool_take(int h, int w, int y, int x)
+{
+	for (size_t i = 0; i < window_pool_len; i++) {
+		WINDOW *win = window_pool[i];
+		int wh, ww;
+
+		getmaxyx(win, wh, ww);
+
+		if (wh != h || ww != w || mvwin(win, y, x) == ERR)
+			continue;
+
+		window_pool[i] = window_pool[--window_pool_len];
+
+		wattrset(win, A_NORMAL);
+		wbkgd(win, 0);
+		werase(win);
+
+		stats.windows_reused++;
+		return win;
+	}
+
+	return NULL;
+}
+
+static bool widget_window_pool_put(WINDOW *win)
+{
+	if (window_pool_len == WIDGET_WINDOW_POOL)
+		return false;
+
+	window_pool[window_pool_len++] = win;
+	return true;
+}
+
+void widget_window_pool_free(void)
+{
+	while (window_pool_len > 0)
+		delwin(window_pool[--window_pool_len]);
+}
+
 int simple_round(float number)
 {
 	// Example: 15.4 + 0.5 = 15.9 -> 15
@@ -320,7 +586,7 @@ void widget_scrollbar_state_free(struct widget *w)
 {
 	if (!w)
 		return;
-	free(w->state);
+	widget_mem_free(w, w->state);
 }
 
 const char *widget_type(struct widget *w)
@@ -358,16 +624,20 @@ const char *widget_type(struct widget *w)
  */
 struct widget *widget_create(enum widget_type type)
 {
-	struct widget *w = calloc(1, sizeof(*w));
+	struct widget *w = cur_arena
+		? widget_arena_alloc(cur_arena, sizeof(*w))
+		: calloc(1, sizeof(*w));
 	if (!w) {
 		warn("calloc failed");
 		return NULL;
 	}
 
+	w->arena = cur_arena;
 	w->type = type;
 	TAILQ_INIT(&w->children);
 
-	w->flags |= FLAG_CREATED | FLAG_VISIBLE;
+	w->flags |= FLAG_CREATED | FLAG_VISIBLE | FLAG_DIRTY;
+	w->flags |= FLAG_NEED_MEASURE | FLAG_NEED_LAYOUT;
 	w->color_pair = COLOR_PAIR_MAIN;
 
 	w->flex_h   = w->flex_w   = 0;
@@ -387,12 +657,14 @@ void widget_add(struct widget *parent, struct widget *child)
 
 	child->parent = parent;
 
-	if (parent->ops && parent->ops->add_child) {
+	if (parent->ops && parent->ops->add_child)
 		parent->ops->add_child(parent, child);
-		return;
-	}
+	else
+		TAILQ_INSERT_TAIL(&parent->children, child, siblings);
 
-	TAILQ_INSERT_TAIL(&parent->children, child, siblings);
+	widget_id_index_add(child);
+	widget_invalidate_size(child);
+	widget_mark_dirty(child);
 }
 
 static void widget_destroy_window(struct widget *w);
@@ -412,13 +684,14 @@ void widget_free(struct widget *w)
 	}
 
 	widget_destroy_window(w);
+	widget_id_index_remove(w);
 
 	if (w->state && w->ops && w->ops->free) {
 		w->ops->free(w);
 		w->state = NULL;
 	}
 
-	free(w);
+	widget_mem_free(w, w);
 }
 
 void widget_noutrefresh(struct widget *w)
@@ -429,22 +702,62 @@ void widget_noutrefresh(struct widget *w)
 	wnoutrefresh(w->win);
 }
 
-static void widget_refresh_upper_tree(struct widget *w)
+/*
+ * Request a redraw of the widget in the next frame. Its ancestors are only
+ * marked as having a dirty child, so they are visited but not drawn again.
+ */
+void widget_mark_dirty(struct widget *w)
 {
-	if (w) {
-		widget_noutrefresh(w);
-		widget_refresh_upper_tree(w->parent);
-	}
+	if (!w)
+		return;
+
+	w->flags |= FLAG_DIRTY;
+
+	for (w = w->parent; w; w = w->parent)
+		w->flags |= FLAG_CHILD_DIRTY;
 }
 
 /*
- * Recursively compute minimum size for a widget subtree.
+ * Report a change of the result state of the widget: a pressed button, a
+ * submitted input or a full meter. The flag is kept on the root, so the owner
+ * of the tree asks whether the dialog is finished only after such a change.
+ */
+void widget_state_changed(struct widget *w)
+{
+	if (!w)
+		return;
+
+	while (w->parent)
+		w = w->parent;
+
+	w->flags |= FLAG_STATE_CHANGED;
+}
+
+/*
+ * Report a change that affects the size requirements of the widget, e.g. a
+ * new child. The widget and all its ancestors are measured again by the next
+ * widget_measure_tree(), the rest of the tree keeps its cached sizes.
+ */
+void widget_invalidate_size(struct widget *w)
+{
+	if (!w)
+		return;
+
+	w->flags |= FLAG_NEED_MEASURE;
+
+	for (w = w->parent; w && !(w->flags & FLAG_NEED_MEASURE); w = w->parent)
+		w->flags |= FLAG_NEED_MEASURE;
+}
+
+/*
+ * Recursively compute minimum size for a widget subtree. Subtrees that were
+ * not invalidated since the last call keep their results.
  *
  * Result: Each widget has known min_w and min_h.
  */
 void widget_measure_tree(struct widget *w)
 {
-	if (!w)
+	if (!w || !(w->flags & FLAG_NEED_MEASURE))
 		return;
 
 	struct widget *c;
@@ -461,6 +774,9 @@ void widget_measure_tree(struct widget *w)
 	 */
 	w->pref_w = MAX(w->pref_w, w->min_w);
 	w->pref_h = MAX(w->pref_h, w->min_h);
+
+	w->flags &= ~FLAG_NEED_MEASURE;
+	w->flags |= FLAG_NEED_LAYOUT;
 }
 
 /*
@@ -471,6 +787,10 @@ void widget_measure_tree(struct widget *w)
  * If >= 0, update the corresponding field.
  * If < 0, keep previous values.
  *
+ * The children are laid out again only if the size of the widget changed or
+ * it was measured again since the last layout. A moved or resized widget is
+ * marked dirty.
+ *
  * Result: Each widget knows: lx, ly, w, h.
  */
 void widget_layout_tree(struct widget *w, int lx, int ly, int width, int height)
@@ -478,23 +798,62 @@ void widget_layout_tree(struct widget *w, int lx, int ly, int width, int height)
 	if (!w)
 		return;
 
+	int old_lx = w->lx, old_ly = w->ly;
+	int old_w  = w->w,  old_h  = w->h;
+
 	if (lx >= 0) w->lx = lx;
 	if (ly >= 0) w->ly = ly;
 
 	if (width  >= 0) w->w = width;
 	if (height >= 0) w->h = height;
 
+	bool resized = (w->w != old_w || w->h != old_h);
+
+	if (resized || w->lx != old_lx || w->ly != old_ly)
+		widget_mark_dirty(w);
+
+	if (!resized && !(w->flags & FLAG_NEED_LAYOUT))
+		return;
+
+	w->flags &= ~FLAG_NEED_LAYOUT;
+
 	if (w->ops && w->ops->layout)
 		w->ops->layout(w);
 }
 
+/*
+ * Measure and lay out again whatever was invalidated in the tree since the
+ * last layout. The root keeps its geometry.
+ */
+void widget_relayout_tree(struct widget *w)
+{
+	if (!w || !(w->flags & (FLAG_NEED_MEASURE | FLAG_NEED_LAYOUT)))
+		return;
+
+	widget_measure_tree(w);
+	widget_layout_tree(w, -1, -1, -1, -1);
+}
+
+/*
+ * The window in which the subwindow of the widget lives. It is not always the
+ * window of the parent, e.g. the children of a pad box live in the pad.
+ */
+static WINDOW *widget_parent_win(struct widget *w)
+{
+	return (w->parent->ops && w->parent->ops->child_render_win)
+		? w->parent->ops->child_render_win(w->parent)
+		: w->parent->win;
+}
+
 static void widget_create_window(struct widget *w)
 {
 	WINDOW *parent_win = NULL;
 
 	if (w->parent == NULL) {
 		/* root: absolute coords */
-		w->win = newwin(w->h, w->w, w->ly, w->lx);
+		w->win = widget_window_pool_take(w->h, w->w, w->ly, w->lx);
+		if (!w->win && (w->win = newwin(w->h, w->w, w->ly, w->lx)) != NULL)
+			stats.windows_created++;
 		if (!w->win) {
 			warnx("unable to create %s window (y=%d, x=%d, height=%d, width=%d)",
 				widget_type(w), w->ly, w->lx, w->h, w->w);
@@ -504,11 +863,11 @@ static void widget_create_window(struct widget *w)
 			widget_type(w), w->ly, w->lx, w->h, w->w);
 	} else {
 		/* child: derived window */
-		parent_win = (w->parent->ops && w->parent->ops->child_render_win)
-			? w->parent->ops->child_render_win(w->parent)
-			: w->parent->win;
+		parent_win = widget_parent_win(w);
 
 		w->win = derwin(parent_win, w->h, w->w, w->ly, w->lx);
+		if (w->win)
+			stats.windows_created++;
 
 		if (!w->win) {
 			warnx("unable to create %s subwindow (y=%d, x=%d, height=%d, width=%d) in parent win %p",
@@ -536,23 +895,108 @@ static void widget_create_window(struct widget *w)
 	w->flags |= FLAG_CREATED;
 }
 
+/*
+ * Create the window of the widget without drawing anything, e.g. to put a
+ * root window into a panel before the first frame.
+ */
+bool widget_realize(struct widget *w)
+{
+	if (!w->win)
+		widget_create_window(w);
+	return w->win != NULL;
+}
+
 static void widget_destroy_window(struct widget *w)
 {
 	if (!w || !w->win)
 		return;
 
-	if (delwin(w->win) == ERR) {
-		warnx("unable to destroy ncurses win of widget %s (%p) (y=%d, x=%d, height=%d, width=%d)",
-			widget_type(w), w->win, w->ly, w->lx, w->h, w->w);
-		return;
-	}
+	if (!w->parent && widget_window_pool_put(w->win)) {
+		if (IS_DEBUG())
+			warnx("put ncurses win of widget %s (%p) into the pool (height=%d, width=%d)",
+				widget_type(w), w->win, w->h, w->w);
+	} else {
+		if (delwin(w->win) == ERR) {
+			warnx("unable to destroy ncurses win of widget %s (%p) (y=%d, x=%d, height=%d, width=%d)",
+				widget_type(w), w->win, w->ly, w->lx, w->h, w->w);
+			return;
+		}
 
-	if (IS_DEBUG())
-		warnx("destroy ncurses win of widget %s (%p) (y=%d, x=%d, height=%d, width=%d)",
-			widget_type(w), w->win, w->ly, w->lx, w->h, w->w);
+		if (IS_DEBUG())
+			warnx("destroy ncurses win of widget %s (%p) (y=%d, x=%d, height=%d, width=%d)",
+				widget_type(w), w->win, w->ly, w->lx, w->h, w->w);
+	}
 
 	w->win = NULL;
 	w->flags &= ~FLAG_CREATED;
+	stats.windows_destroyed++;
+}
+
+static bool widget_place_window(struct widget *w);
+
+/*
+ * Subwindows share the memory of their parent. When the parent is moved, the
+ * subwindows still point to the cells at the old place and must be mapped
+ * again at the same offsets.
+ */
+static bool widget_place_subwindows(struct widget *w)
+{
+	/* Children are drawn in a window of their own, e.g. a pad. */
+	if (w->ops && w->ops->child_render_win)
+		return true;
+
+	struct widget *c;
+	TAILQ_FOREACH(c, &w->children, siblings) {
+		if (c->win && !widget_place_window(c))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Map the subwindow to the cells at (ly, lx) of the parent window and move it
+ * on the screen there. mvderwin() alone changes only the cells the window
+ * shows, the window is still drawn at the old place.
+ */
+static bool widget_place_window(struct widget *w)
+{
+	int h, wd;
+	getmaxyx(w->win, h, wd);
+
+	if (h != w->h || wd != w->w)
+		return false;
+
+	if (mvderwin(w->win, w->ly, w->lx) == ERR)
+		return false;
+
+	/* A pad is never put on the screen as is. */
+	if (!is_pad(w->win)) {
+		int py, px;
+		getbegyx(widget_parent_win(w), py, px);
+
+		if (mvwin(w->win, py + w->ly, px + w->lx) == ERR)
+			return false;
+	}
+
+	return widget_place_subwindows(w);
+}
+
+/*
+ * Move the subwindow of the widget together with the subwindows of its
+ * descendants. This reuses the windows, nothing is allocated.
+ */
+static bool widget_move_window(struct widget *w)
+{
+	if (!widget_place_window(w))
+		return false;
+
+	if (IS_DEBUG())
+		warnx("%s (%p) subwindow was moved (y=%d, x=%d)",
+			widget_type(w), w->win, w->ly, w->lx);
+
+	stats.windows_moved++;
+	return true;
 }
 
 /*
@@ -561,9 +1005,11 @@ static void widget_destroy_window(struct widget *w)
  * Rendering order:
  *   1. Parent draws itself
  *   2. Then children are rendered
+ *   3. Then the parent finalizes and its window is refreshed
  *
  * render() hook should draw into w->win but not call wrefresh().
- * This function uses wnoutrefresh() so caller can call doupdate().
+ * This function uses wnoutrefresh() once per window so caller can call
+ * doupdate().
  */
 void widget_render_tree(struct widget *w)
 {
@@ -574,16 +1020,14 @@ void widget_render_tree(struct widget *w)
 		return;
 
 	if (w->win && w->parent) {
-		int wy, wx;
+		int wy, wx, wh, ww;
 		getparyx(w->win, wy, wx);
+		getmaxyx(w->win, wh, ww);
 
-		if (w->ly != wy || w->lx != wx) {
-			/*
-			 * mvderwin does not work for some reason. There are no
-			 * errors, but the window does not move.
-			 */
+		if (w->h != wh || w->w != ww)
+			widget_hide_tree(w);
+		else if ((w->ly != wy || w->lx != wx) && !widget_move_window(w))
 			widget_hide_tree(w);
-		}
 	}
 
 	if (!w->win) {
@@ -592,13 +1036,13 @@ void widget_render_tree(struct widget *w)
 			return;
 	}
 
+	w->flags &= ~(FLAG_DIRTY | FLAG_CHILD_DIRTY);
+
 	werase(w->win);
 
 	if (w->ops && w->ops->render)
 		w->ops->render(w);
 
-	widget_refresh_upper_tree(w);
-
 	struct widget *c;
 	TAILQ_FOREACH(c, &w->children, siblings) {
 		if (c->h > 0 && c->w > 0)
@@ -607,6 +1051,41 @@ void widget_render_tree(struct widget *w)
 
 	if (w->ops && w->ops->finalize_render)
 		w->ops->finalize_render(w);
+
+	widget_noutrefresh(w);
+}
+
+/*
+ * Draw only what was marked by widget_mark_dirty(). A dirty widget is drawn
+ * with its whole subtree since subwindows share the memory of the parent and
+ * werase() wipes them. Clean ancestors of dirty widgets only finalize and
+ * refresh their windows, so e.g. a pad is copied to the screen again.
+ */
+void widget_render_dirty(struct widget *w)
+{
+	if (!w || !(w->flags & FLAG_VISIBLE))
+		return;
+
+	if ((w->flags & FLAG_DIRTY) || !w->win) {
+		widget_render_tree(w);
+		return;
+	}
+
+	if (!(w->flags & FLAG_CHILD_DIRTY))
+		return;
+
+	w->flags &= ~FLAG_CHILD_DIRTY;
+
+	struct widget *c;
+	TAILQ_FOREACH(c, &w->children, siblings) {
+		if (c->h > 0 && c->w > 0)
+			widget_render_dirty(c);
+	}
+
+	if (w->ops && w->ops->finalize_render)
+		w->ops->finalize_render(w);
+
+	widget_noutrefresh(w);
 }
 
 void widget_hide_tree(struct widget *w)
@@ -639,24 +1118,57 @@ bool walk_widget_tree(struct widget *w, walk_fn handler, void *data)
 	return true;
 }
 
-struct widget *find_widget_by_id(struct widget *w, int id)
+static bool widget_is_descendant(struct widget *w, struct widget *root)
 {
-	if (!w)
-		return NULL;
+	for (; w; w = w->parent) {
+		if (w == root)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Find the widget with the user ID in the subtree. In an arena tree it is
+ * looked up in the id index, otherwise the subtree is walked.
+ */
+static struct widget *find_widget_in_tree(struct widget *w, int id)
+{
+	struct widget *c, *n;
 
 	if (w->w_id == id)
 		return w;
 
-	struct widget *c, *n;
-
 	TAILQ_FOREACH(c, &w->children, siblings) {
-		if ((n = find_widget_by_id(c, id)) != NULL)
+		if ((n = find_widget_in_tree(c, id)) != NULL)
 			return n;
 	}
 
 	return NULL;
 }
 
+/*
+ * Widgets created outside of the arena, e.g. on update, and widgets whose
+ * w_id was assigned directly after they were added are not in the index.
+ * They are found by walking the tree when the index has no match.
+ */
+struct widget *find_widget_by_id(struct widget *w, int id)
+{
+	if (!w)
+		return NULL;
+
+	if (w->w_id == id)
+		return w;
+
+	if (id && w->arena && w->arena->ids) {
+		for (struct widget *n = *widget_id_bucket(w->arena, id); n; n = n->id_next) {
+			if (n->w_id == id && widget_is_descendant(n, w))
+				return n;
+		}
+	}
+
+	return find_widget_in_tree(w, id);
+}
+
 bool widget_coordinates_yx(struct widget *w, int *wy, int *wx)
 {
 	int y, x, ry, rx;
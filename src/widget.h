@@ -116,10 +116,25 @@ enum widget_property {
 };
 
 enum widget_flags {
-	FLAG_NONE    = 0,        // Nothing has been set
-	FLAG_CREATED = (1 << 0), // Rendering enabled flag
-	FLAG_INFOCUS = (1 << 1), // Is this subtree in focus
-	FLAG_VISIBLE = (1 << 2),
+	FLAG_NONE          = 0,        // Nothing has been set
+	FLAG_CREATED       = (1 << 0), // Rendering enabled flag
+	FLAG_INFOCUS       = (1 << 1), // Is this subtree in focus
+	FLAG_VISIBLE       = (1 << 2),
+	FLAG_DIRTY         = (1 << 3), // Widget and its subtree must be drawn again
+	FLAG_CHILD_DIRTY   = (1 << 4), // Some descendant is dirty
+	FLAG_NEED_MEASURE  = (1 << 5), // Size requirements of the subtree changed
+	FLAG_NEED_LAYOUT   = (1 << 6), // Children must be laid out again
+	FLAG_ID_INDEXED    = (1 << 7), // Widget is in the id index of its arena
+	FLAG_STATE_CHANGED = (1 << 8), // Root only: a result state in the tree changed
+};
+
+/*
+ * Bits of the value returned by widget_ops.input, zero if the key was not
+ * handled.
+ */
+enum widget_input_result {
+	INPUT_HANDLED = (1 << 0), // Widget must be drawn again
+	INPUT_STATE   = (1 << 1), // Result state changed, see widget_state_changed()
 };
 
 enum widget_attributes {
@@ -219,16 +234,59 @@ struct widget {
 	 */
 	void *data;
 
-	/* Optional user' widget ID  */
+	/* Optional user' widget ID, see widget_set_id() */
 	int w_id;
+	struct widget *id_next; /* next widget in the same bucket of the id index */
+
+	/* Owner of the widget and its state, NULL for the heap */
+	struct widget_arena *arena;
+};
+
+/* Counters of the ncurses windows owned by widgets. */
+struct widget_stats {
+	unsigned long windows_created;   /* allocated by newwin() or derwin() */
+	unsigned long windows_reused;    /* taken from the pool instead */
+	unsigned long windows_destroyed; /* deleted or put into the pool */
+	unsigned long windows_moved;
 };
 
+const struct widget_stats *widget_get_stats(void);
+void widget_window_pool_free(void);
+
+struct widget_arena_chunk;
+
+/*
+ * Bump allocator that owns widgets and their state, e.g. everything a plugin
+ * creates for one instance. The memory is released all at once.
+ *
+ * The arena also indexes its widgets by w_id, so find_widget_by_id() does not
+ * have to walk the tree.
+ */
+struct widget_arena {
+	char *pos;
+	char *end;
+	struct widget_arena_chunk *chunks;
+
+	struct widget **ids; /* hash buckets */
+	size_t ids_size;
+	size_t num_ids;
+};
+
+void widget_arena_use(struct widget_arena *a);
+void widget_arena_release(struct widget_arena *a);
+void *widget_alloc(struct widget *w, size_t size) __attribute__((nonnull(1)));
+wchar_t *widget_wcsdup(struct widget *w, const wchar_t *s) __attribute__((nonnull(1,2)));
+void widget_mem_free(struct widget *w, void *p) __attribute__((nonnull(1)));
+
 const char *widget_type(struct widget *w);
 struct widget *widget_create(enum widget_type);
 void widget_add(struct widget *parent, struct widget *child);
 void widget_free(struct widget *w);
 bool widget_coordinates_yx(struct widget *w, int *w_abs_y, int *w_abs_x);
 void widget_noutrefresh(struct widget *w);
+void widget_mark_dirty(struct widget *w);
+void widget_state_changed(struct widget *w);
+void widget_invalidate_size(struct widget *w);
 void widget_dump(FILE *fd, struct widget *w);
 
 static inline bool widget_get(struct widget *w, enum widget_property prop, void *value)
@@ -243,7 +301,10 @@ static inline bool widget_get_index(struct widget *w, enum widget_property prop,
 
 static inline bool widget_set(struct widget *w, enum widget_property prop, const void *value)
 {
-	return (w && w->ops && w->ops->setter) ? w->ops->setter(w, prop, value) : false;
+	if (!w || !w->ops || !w->ops->setter || !w->ops->setter(w, prop, value))
+		return false;
+	widget_mark_dirty(w);
+	return true;
 }
 
 typedef bool (*walk_fn)(struct widget *, void *);
@@ -252,8 +313,11 @@ bool walk_widget_tree(struct widget *w, walk_fn handler, void *data);
 
 void widget_measure_tree(struct widget *w);
 void widget_layout_tree(struct widget *w, int lx, int ly, int width, int height);
+void widget_relayout_tree(struct widget *w);
 void widget_hide_tree(struct widget *w);
 void widget_render_tree(struct widget *w);
+void widget_render_dirty(struct widget *w);
+bool widget_realize(struct widget *w);
 void distribute_flex_axis(int count, const int *pref,
 		const int *min, const int *max, const int *grow,
 		const int *shrink, int available, int *out);
@@ -297,6 +361,7 @@ struct widget *make_border(void);
 struct widget *make_border_vbox(struct widget *parent);
 struct widget *make_border_hbox(struct widget *parent);
 
+void widget_set_id(struct widget *w, int id) __attribute__((nonnull));
 struct widget *find_widget_by_id(struct widget *w, int id);
 
 void vbox_measure(struct widget *w);
@@ -47,8 +47,8 @@ void button_free(struct widget *w)
 	struct widget_button *st = w->state;
 
 	if (st) {
-		free(st->text);
-		free(st);
+		widget_mem_free(w, st->text);
+		widget_mem_free(w, st);
 	}
 }
 
@@ -58,7 +58,7 @@ int button_input(const struct widget *w, wchar_t key)
 
 	if (key == L'\n' || key == KEY_ENTER) {
 		st->pressed = !st->pressed;
-		return 1;
+		return INPUT_HANDLED | INPUT_STATE;
 	}
 
 	return 0;
@@ -99,14 +99,14 @@ struct widget *make_button(const wchar_t *text)
 	if (!w)
 		return NULL;
 
-	struct widget_button *state = calloc(1, sizeof(*state));
+	struct widget_button *state = widget_alloc(w, sizeof(*state));
 	if (!state) {
 		warn("make_button: calloc");
 		widget_free(w);
 		return NULL;
 	}
 
-	state->text = wcsdup(text ?: L"");
+	state->text = widget_wcsdup(w, text ?: L"");
 	state->pressed = false;
 
 	w->state      = state;
@@ -48,7 +48,7 @@ void checkbox_free(struct widget *w)
 	struct widget_checkbox *st = w->state;
 
 	if (st) {
-		free(st);
+		widget_mem_free(w, st);
 	}
 }
 
@@ -63,7 +63,7 @@ int checkbox_input(const struct widget *w, wchar_t key)
 		default:
 			return 0;
 	}
-	return 1;
+	return INPUT_HANDLED | INPUT_STATE;
 }
 
 bool checkbox_getter(struct widget *w, enum widget_property prop, void *value)
@@ -84,7 +84,12 @@ bool checkbox_setter(struct widget *w, enum widget_property prop, const void *va
 	struct widget_checkbox *st = w->state;
 
 	if (prop == PROP_CHECKBOX_STATE) {
-		st->checked = !!(*(const bool *) value);
+		bool checked = !!(*(const bool *) value);
+
+		if (st->checked != checked) {
+			st->checked = checked;
+			widget_state_changed(w);
+		}
 		return true;
 	} else {
 		errx(EXIT_FAILURE, "unknown property: %d", prop);
@@ -113,7 +118,7 @@ struct widget *make_checkbox(bool checked, bool multisel)
 	if (!w)
 		return NULL;
 
-	struct widget_checkbox *state = calloc(1, sizeof(*state));
+	struct widget_checkbox *state = widget_alloc(w, sizeof(*state));
 	if (!state) {
 		warn("make_checkbox: calloc");
 		widget_free(w);
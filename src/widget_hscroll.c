@@ -53,7 +53,7 @@ struct widget *make_hscroll(void)
 	if (!w)
 		return NULL;
 
-	struct widget_scrollbar_state *s = calloc(1, sizeof(*s));
+	struct widget_scrollbar_state *s = widget_alloc(w, sizeof(*s));
 	if (!s) {
 		warn("make_hscroll: calloc");
 		widget_free(w);
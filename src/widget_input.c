@@ -97,9 +97,9 @@ void input_free(struct widget *w)
 	struct widget_input *st = w->state;
 
 	if (st) {
-		free(st->placeholder);
+		widget_mem_free(w, st->placeholder);
 		free(st->text);
-		free(st);
+		widget_mem_free(w, st);
 	}
 }
 
@@ -178,7 +178,7 @@ int input_input(const struct widget *w, wchar_t key)
 		case KEY_ENTER:
 		case L'\n':
 			st->finished = true;
-			break;
+			return INPUT_HANDLED | INPUT_STATE;
 		case KEY_LEFT:
 			dec_cursor(w);
 			break;
@@ -199,7 +199,7 @@ int input_input(const struct widget *w, wchar_t key)
 			break;
 	}
 
-	return 1;
+	return INPUT_HANDLED;
 }
 
 bool input_getter(struct widget *w, enum widget_property prop, void *value)
@@ -241,7 +241,7 @@ struct widget *make_input(const wchar_t *initdata, const wchar_t *placeholder)
 	if (!w)
 		return NULL;
 
-	struct widget_input *state = calloc(1, sizeof(*state));
+	struct widget_input *state = widget_alloc(w, sizeof(*state));
 	if (!state) {
 		warn("make_input: calloc");
 		widget_free(w);
@@ -255,7 +255,7 @@ struct widget *make_input(const wchar_t *initdata, const wchar_t *placeholder)
 	state->cursor_x = state->len;
 
 	if (placeholder)
-		state->placeholder = wcsdup(placeholder);
+		state->placeholder = widget_wcsdup(w, placeholder);
 
 	w->state       = state;
 	w->ops         = &input_ops;
@@ -89,7 +89,7 @@ void label_free(struct widget *w)
 
 	if (st) {
 		warray_free(&st->lines);
-		free(st);
+		widget_mem_free(w, st);
 	}
 }
 
@@ -114,7 +114,7 @@ struct widget *make_label(const wchar_t *line)
 	if (!w)
 		return NULL;
 
-	struct widget_label *state = calloc(1, sizeof(*state));
+	struct widget_label *state = widget_alloc(w, sizeof(*state));
 	if (!state) {
 		warn("make_label: calloc");
 		widget_free(w);
@@ -16,6 +16,7 @@ struct widget_list_vbox {
 };
 
 static void list_vbox_measure(struct widget *w) __attribute__((nonnull(1)));
+static void list_vbox_place(struct widget *w) __attribute__((nonnull(1)));
 static void list_vbox_layout(struct widget *w) __attribute__((nonnull(1)));
 static void list_vbox_render(struct widget *w) __attribute__((nonnull(1)));
 static void get_visible_range(struct widget *w, struct widget **first, struct widget **last) __attribute__((nonnull(1,2,3)));
@@ -51,44 +52,48 @@ void list_vbox_measure(struct widget *w)
 	w->pref_h = st->view_rows ?: 5;
 }
 
-void list_vbox_layout(struct widget *w)
+/*
+ * Place the visible children from the top of the list. Those that do not fit
+ * into the view are hidden.
+ */
+void list_vbox_place(struct widget *w)
 {
-	struct widget_list_vbox *st = w->state;
-
 	int y = 0;
 
-	st->content_h = 0;
-
 	struct widget *c;
 	TAILQ_FOREACH(c, &w->children, siblings) {
 		int ch = widget_height(c);
 
+		if (!(c->flags & FLAG_VISIBLE) || (y + ch) > w->h) {
+			c->flags &= ~FLAG_VISIBLE;
+			continue;
+		}
 		widget_layout_tree(c, 0, y, w->w, ch);
 		y += ch;
-
-		st->content_h += ch;
 	}
 }
 
-void list_vbox_render(struct widget *w)
+void list_vbox_layout(struct widget *w)
 {
-	werase(w->win);
-	wbkgd(w->win, COLOR_PAIR(w->color_pair));
+	struct widget_list_vbox *st = w->state;
 
-	int y = 0;
+	st->content_h = 0;
 
 	struct widget *c;
-	TAILQ_FOREACH(c, &w->children, siblings) {
-		int ch = widget_height(c);
+	TAILQ_FOREACH(c, &w->children, siblings)
+		st->content_h += widget_height(c);
 
-		if (!(c->flags & FLAG_VISIBLE) || (y + ch) > w->h) {
-			widget_hide_tree(c);
-			c->flags &= ~FLAG_VISIBLE;
-			continue;
-		}
-		widget_layout_tree(c, 0, y, w->w, ch);
-		y += ch;
-	}
+	list_vbox_place(w);
+}
+
+/*
+ * Hidden rows keep their windows. They are not drawn, and when a row is
+ * scrolled into view again its window is moved instead of created.
+ */
+void list_vbox_render(struct widget *w)
+{
+	werase(w->win);
+	wbkgd(w->win, COLOR_PAIR(w->color_pair));
 }
 
 void get_visible_range(struct widget *w, struct widget **first, struct widget **last)
@@ -117,13 +122,16 @@ void set_visible_range(struct widget *w, struct widget *first, struct widget *la
 		if (!first_found) {
 			if (c == first)
 				first_found = true;
-			st->scroll_y += c->h;
+			st->scroll_y += widget_height(c);
 		}
 		c->flags &= ~FLAG_VISIBLE;
 	}
 	for (c = first; c && c != TAILQ_NEXT(last, siblings); c = TAILQ_NEXT(c, siblings)) {
 		c->flags |= FLAG_VISIBLE;
 	}
+
+	list_vbox_place(w);
+	widget_mark_dirty(w);
 }
 
 void shift_window_anchor_first(struct widget *w, struct widget *focused)
@@ -265,7 +273,7 @@ void list_vbox_free(struct widget *w)
 {
 	if (!w)
 		return;
-	free(w->state);
+	widget_mem_free(w, w->state);
 }
 
 static const struct widget_ops list_vbox_ops = {
@@ -289,7 +297,7 @@ struct widget *make_list_vbox(int view_rows)
 	if (!w)
 		return NULL;
 
-	struct widget_list_vbox *s = calloc(1, sizeof(*s));
+	struct widget_list_vbox *s = widget_alloc(w, sizeof(*s));
 	if (!s) {
 		warn("make_list_vbox: calloc");
 		widget_free(w);
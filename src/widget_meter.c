@@ -68,7 +68,7 @@ void meter_free(struct widget *w)
 {
 	if (!w)
 		return;
-	free(w->state);
+	widget_mem_free(w, w->state);
 }
 
 bool meter_getter(struct widget *w, enum widget_property prop, void *data)
@@ -102,7 +102,10 @@ bool meter_setter(struct widget *w, enum widget_property prop, const void *data)
 		if (value > st->total)
 			value = st->total;
 
-		st->value = value;
+		if (st->value != value) {
+			st->value = value;
+			widget_state_changed(w);
+		}
 		return true;
 
 	} else {
@@ -132,7 +135,7 @@ struct widget *make_meter(int total)
 	if (!w)
 		return NULL;
 
-	struct widget_meter *state = calloc(1, sizeof(*state));
+	struct widget_meter *state = widget_alloc(w, sizeof(*state));
 	if (!state) {
 		warn("make_meter: calloc");
 		widget_free(w);
@@ -246,7 +246,7 @@ void pad_box_free(struct widget *w)
 	if (st->pad)
 		delwin(st->pad);
 
-	free(st);
+	widget_mem_free(w, st);
 }
 
 static const struct widget_ops pad_box_ops = {
@@ -270,7 +270,7 @@ struct widget *make_pad_box(void)
 	if (!w)
 		return NULL;
 
-	struct widget_pad_box *st = calloc(1, sizeof(*st));
+	struct widget_pad_box *st = widget_alloc(w, sizeof(*st));
 	if (!st) {
 		warn("make_pad_box: calloc");
 		widget_free(w);
@@ -15,6 +15,7 @@ struct widget_svbox {
 
 static void scroll_vbox_sync(struct widget *w) __attribute__((nonnull(1)));
 static void scroll_vbox_measure(struct widget *w) __attribute__((nonnull(1)));
+static void scroll_vbox_toggle_bar(struct widget *w, struct widget *bar, bool show) __attribute__((nonnull(1,2)));
 static void scroll_vbox_layout(struct widget *w) __attribute__((nonnull(1)));
 static void scroll_vbox_render(struct widget *w) __attribute__((nonnull(1)));
 static void scroll_vbox_ensure_visible(struct widget *w, struct widget *child) __attribute__((nonnull(1,2)));
@@ -56,6 +57,24 @@ void scroll_vbox_measure(struct widget *w)
 	w->pref_w = pad->pref_w + 1;
 }
 
+/*
+ * Show or hide the scrollbar behind the back of measure(). The boxes between
+ * the scrollbar and the scroll_vbox must be laid out again.
+ */
+void scroll_vbox_toggle_bar(struct widget *w, struct widget *bar, bool show)
+{
+	if (show) {
+		bar->flags |= FLAG_NEED_MEASURE;
+		widget_measure_tree(bar);
+	} else {
+		bar->min_h  = bar->min_w  = 0;
+		bar->pref_h = bar->pref_w = 0;
+	}
+
+	for (struct widget *p = bar->parent; p && p != w; p = p->parent)
+		p->flags |= FLAG_NEED_LAYOUT;
+}
+
 void scroll_vbox_layout(struct widget *w)
 {
 	struct widget_svbox *st = w->state;
@@ -63,6 +82,16 @@ void scroll_vbox_layout(struct widget *w)
 	if (!vbox)
 		return;
 
+	/*
+	 * The scrollbars hidden by the previous layout are not measured again,
+	 * but the content might have grown since then.
+	 */
+	if (st->vscroll->min_w == 0)
+		scroll_vbox_toggle_bar(w, st->vscroll, true);
+
+	if (st->hscroll->min_h == 0)
+		scroll_vbox_toggle_bar(w, st->hscroll, true);
+
 	widget_layout_tree(vbox, 0, 0, w->w, w->h);
 
 	int content_h = 0, content_w = 0;
@@ -80,14 +109,12 @@ void scroll_vbox_layout(struct widget *w)
 	bool relayout = false;
 
 	if (!need_vscroll && st->vscroll->min_w > 0) {
-		st->vscroll->min_h  = st->vscroll->min_w  = 0;
-		st->vscroll->pref_h = st->vscroll->pref_w = 0;
+		scroll_vbox_toggle_bar(w, st->vscroll, false);
 		relayout = true;
 	}
 
 	if (!need_hscroll && st->hscroll->min_h > 0) {
-		st->hscroll->min_h  = st->hscroll->min_w  = 0;
-		st->hscroll->pref_h = st->hscroll->pref_w = 0;
+		scroll_vbox_toggle_bar(w, st->hscroll, false);
 		relayout = true;
 	}
 
@@ -112,8 +139,7 @@ void scroll_vbox_ensure_visible(struct widget *w, struct widget *child)
 		return;
 
 	st->pad->ops->ensure_visible(st->pad, child);
-	scroll_vbox_sync(w);
-	widget_render_tree(w);
+	widget_mark_dirty(w);
 }
 
 void scroll_vbox_add_child(struct widget *sv, struct widget *child)
@@ -150,14 +176,14 @@ int scroll_vbox_input(const struct widget *w, wchar_t key)
 	if (delta_x)
 		widget_set(st->pad, PROP_SCROLL_INC_X, &delta_x);
 
-	return 1;
+	return INPUT_HANDLED;
 }
 
 void scroll_vbox_free(struct widget *w)
 {
 	if (!w)
 		return;
-	free(w->state);
+	widget_mem_free(w, w->state);
 }
 
 static const struct widget_ops scroll_vbox_ops = {
@@ -192,7 +218,7 @@ struct widget *make_scroll_vbox(void)
 		return NULL;
 	}
 
-	struct widget_svbox *st = calloc(1, sizeof(*st));
+	struct widget_svbox *st = widget_alloc(root, sizeof(*st));
 	if (!st) {
 		warn("make_scroll_vbox: calloc");
 		widget_free(root);
@@ -73,7 +73,7 @@ void select_ensure_visible(struct widget *w, struct widget *child)
 
 	st->list->ops->ensure_visible(st->list, child);
 
-	select_sync(w);
+	widget_mark_dirty(w);
 }
 
 int select_input(const struct widget *w, wchar_t key)
@@ -93,10 +93,12 @@ int select_input(const struct widget *w, wchar_t key)
 				else if (st->selected < st->max_selected)
 					st->selected++;
 				else
-					return 1;
+					return INPUT_HANDLED;
 
 				clicked = !clicked;
 				widget_set(st->focus, PROP_CHECKBOX_STATE, &clicked);
+
+				return INPUT_HANDLED | INPUT_STATE;
 			}
 			break;
 
@@ -136,7 +138,7 @@ int select_input(const struct widget *w, wchar_t key)
 	if (delta_y)
 		widget_set(st->list, PROP_SCROLL_INC_Y, &delta_y);
 
-	return 1;
+	return INPUT_HANDLED;
 }
 
 bool select_getter(struct widget *w, enum widget_property prop, void *value)
@@ -221,7 +223,7 @@ void select_free(struct widget *w)
 {
 	if (!w)
 		return;
-	free(w->state);
+	widget_mem_free(w, w->state);
 }
 
 static const struct widget_ops select_ops = {
@@ -250,7 +252,7 @@ struct widget *make_select(int max_selected, int view_rows)
 		goto fail;
 	}
 
-	struct widget_select *st = calloc(1, sizeof(*st));
+	struct widget_select *st = widget_alloc(root, sizeof(*st));
 	if (!st) {
 		warn("make_select_box: calloc");
 		goto fail;
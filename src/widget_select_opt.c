@@ -78,7 +78,7 @@ int selopt_input(const struct widget *w, wchar_t key)
 
 void selopt_free(struct widget *w)
 {
-	free(w->state);
+	widget_mem_free(w, w->state);
 }
 
 bool selopt_getter(struct widget *w, enum widget_property prop, void *value)
@@ -128,16 +128,17 @@ struct widget *make_select_option(const wchar_t *text, bool checked, bool is_rad
 	struct widget *hbox = make_hbox();
 	struct widget *checkbox = make_checkbox(checked, is_radio);
 	struct widget *label = make_label(text);
-	struct widget_select_opt *state = calloc(1, sizeof(*state));
+	struct widget_select_opt *state = w ? widget_alloc(w, sizeof(*state)) : NULL;
 
 	if (!w || !hbox || !checkbox || !label || !state) {
-		if (!state)
+		if (w && !state)
 			warn("make_select_option: calloc");
 		widget_free(hbox);
 		widget_free(checkbox);
 		widget_free(label);
+		if (state)
+			widget_mem_free(w, state);
 		widget_free(w);
-		free(state);
 		return NULL;
 	}
 
@@ -25,7 +25,7 @@ struct widget_spinbox {
 };
 
 static int spinbox_clamp(int v, int min, int max);
-static void spinbox_commit(struct widget_spinbox *s) __attribute__((nonnull(1)));
+static bool spinbox_commit(struct widget_spinbox *s) __attribute__((nonnull(1)));
 static void spinbox_measure(struct widget *w) __attribute__((nonnull(1)));
 static void spinbox_render(struct widget *w) __attribute__((nonnull(1)));
 static int spinbox_input(const struct widget *w, wchar_t key) __attribute__((nonnull(1)));
@@ -41,11 +41,18 @@ int spinbox_clamp(int v, int min, int max)
 	return v;
 }
 
-void spinbox_commit(struct widget_spinbox *s)
+/*
+ * Returns true if the value changed.
+ */
+bool spinbox_commit(struct widget_spinbox *s)
 {
+	int value = s->value;
+
 	s->value = spinbox_clamp(s->edit_buf, s->min, s->max);
 	s->edit_buf = 0;
 	s->edit_len = 0;
+
+	return s->value != value;
 }
 
 void spinbox_measure(struct widget *w)
@@ -73,27 +80,28 @@ void spinbox_free(struct widget *w)
 {
 	if (!w)
 		return;
-	free(w->state);
+	widget_mem_free(w, w->state);
 }
 
 int spinbox_input(const struct widget *w, wchar_t key)
 {
 	struct widget_spinbox *st = w->state;
+	int value = st->value;
 
 	switch (key) {
 		case KEY_UP:
 			st->value = spinbox_clamp(st->value + st->step, st->min, st->max);
-			return 1;
+			return (st->value != value) ? INPUT_HANDLED | INPUT_STATE : INPUT_HANDLED;
 
 		case KEY_DOWN:
 			st->value = spinbox_clamp(st->value - st->step, st->min, st->max);
-			return 1;
+			return (st->value != value) ? INPUT_HANDLED | INPUT_STATE : INPUT_HANDLED;
 
 		case KEY_BACKSPACE:
 		case 127:
 			st->edit_buf = 0;
 			st->edit_len = 0;
-			return 1;
+			return INPUT_HANDLED;
 
 		default:
 			break;
@@ -103,10 +111,10 @@ int spinbox_input(const struct widget *w, wchar_t key)
 		st->edit_buf = (st->edit_buf * 10) + (key - L'0');
 		st->edit_len++;
 
-		if (st->edit_len >= st->width)
-			spinbox_commit(st);
+		if (st->edit_len >= st->width && spinbox_commit(st))
+			return INPUT_HANDLED | INPUT_STATE;
 
-		return 1;
+		return INPUT_HANDLED;
 	}
 
 	return 0;
@@ -128,7 +136,12 @@ bool spinbox_setter(struct widget *w, enum widget_property prop, const void *in)
 	struct widget_spinbox *st = w->state;
 
 	if (prop == PROP_SPINBOX_VALUE) {
-		st->value = spinbox_clamp(*(const int *) in, st->min, st->max);
+		int value = spinbox_clamp(*(const int *) in, st->min, st->max);
+
+		if (st->value != value) {
+			st->value = value;
+			widget_state_changed(w);
+		}
 		return true;
 	}
 	return false;
@@ -155,7 +168,7 @@ struct widget *make_spinbox(int min, int max, int step, int initial, int width)
 	if (!w)
 		return NULL;
 
-	struct widget_spinbox *state = calloc(1, sizeof(*state));
+	struct widget_spinbox *state = widget_alloc(w, sizeof(*state));
 	if (!state) {
 		warn("make_spinbox: calloc");
 		widget_free(w);
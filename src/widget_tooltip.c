@@ -92,8 +92,8 @@ void tooltip_free(struct widget *w)
 
 	widget_free(st->popup);
 
-	free(st->text);
-	free(st);
+	widget_mem_free(w, st->text);
+	widget_mem_free(w, st);
 }
 
 int tooltip_input(const struct widget *w, wchar_t key)
@@ -111,7 +111,7 @@ int tooltip_input(const struct widget *w, wchar_t key)
 			break;
 	}
 
-	return 1;
+	return INPUT_HANDLED;
 }
 
 static const struct widget_ops tooltip_ops = {
@@ -136,14 +136,14 @@ struct widget *make_tooltip(const wchar_t *line)
 	if (!w)
 		return NULL;
 
-	struct widget_tooltip *state = calloc(1, sizeof(*state));
+	struct widget_tooltip *state = widget_alloc(w, sizeof(*state));
 	if (!state) {
 		warn("make_tooltip: calloc");
 		widget_free(w);
 		return NULL;
 	}
 
-	state->text = wcsdup(line ?: L"");
+	state->text = widget_wcsdup(w, line ?: L"");
 
 	w->state = state;
 	w->ops = &tooltip_ops;
@@ -0,0 +1,49 @@
+#!/bin/bash -efu
+# SPDX-License-Identifier: GPL-2.0-or-later
+#
+# Usage: ipc-bench.sh <epoll|io_uring> [clients] [requests] [text|binary] [stream|seqpacket]
+#
+# Runs plainmouthd with the given IO backend, loads it with ipc_bench and
+# reports the throughput and the CPU time the server spent on it.
+
+progfile="$(readlink -f "$0")"
+benchdir="${progfile%/*}"
+topdir="${benchdir%/*/*}"
+
+backend="$1"
+clients="${2:-64}"
+requests="${3:-1000}"
+protocol="${4:-binary}"
+transport="${5:-stream}"
+
+export LD_LIBRARY_PATH="$topdir"
+export PLAINMOUTH_PLUGINSDIR="$topdir/plugins"
+export PLAINMOUTH_SOCKET="$benchdir/ipc-bench-$backend.sock"
+
+"$topdir"/plainmouthd --io-backend="$backend" -S "$PLAINMOUTH_SOCKET" \
+	< /dev/null > /dev/null 2> "$benchdir/ipc-bench-$backend.log" &
+pid=$!
+
+i=0
+until "$topdir"/plainmouth --ping > /dev/null 2>&1; do
+	[ $i -lt 50 ] ||
+		break
+	i=$(( $i + 1 ))
+	sleep 0.1
+done
+
+socket="$PLAINMOUTH_SOCKET"
+[ "$transport" = stream ] ||
+	socket="$PLAINMOUTH_SOCKET.seq"
+
+"$benchdir"/ipc_bench "$socket" "$clients" "$requests" "$protocol" "$transport" |
+	sed -e "s/^/$backend\/$protocol\/$transport: /"
+
+read -r -a stat < "/proc/$pid/stat"
+ticks="$(getconf CLK_TCK)"
+
+printf '%s/%s/%s: server cpu %d ms\n' "$backend" "$protocol" "$transport" \
+	$(( (${stat[13]} + ${stat[14]}) * 1000 / $ticks ))
+
+"$topdir"/plainmouth --quit > /dev/null 2>&1
+wait $pid
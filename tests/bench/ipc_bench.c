@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Usage: ipc_bench <socket> [clients] [requests] [text|binary] [stream|seqpacket]
+ *
+ * Every client keeps one connection open and sends its requests one after
+ * another: two pings, a question answered by the IO thread and a request
+ * that goes through the UI thread.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#include <pthread.h>
+
+#include "macros.h"
+#include "ipc.h"
+
+struct bench_client {
+	pthread_t thread;
+	const char *socket_file;
+	int requests;
+	bool binary;
+	bool seqpacket;
+	int failed;
+};
+
+static char *request_mix[][1] = {
+	{ (char *) "action=ping" },
+	{ (char *) "action=has-active-vt" },
+	{ (char *) "action=ping" },
+	{ (char *) "action=list-plugins" },
+};
+
+static void *bench_client(void *arg)
+{
+	struct bench_client *c = arg;
+	struct ipc_ctx ctx;
+
+	ipc_init(&ctx);
+
+	if (c->seqpacket)
+		ctx.flags |= IPC_CTX_SEQPACKET;
+
+	if (!ipc_connect(&ctx, c->socket_file, 0)) {
+		c->failed = c->requests;
+		ipc_free(&ctx);
+		return NULL;
+	}
+
+	ctx.flags |= IPC_CTX_CLIENT_IDS;
+	if (c->binary)
+		ctx.flags |= IPC_CTX_WANT_V2;
+
+	for (int i = 0; i < c->requests; i++) {
+		struct ipc_pair resp = { 0 };
+		char **pairs = request_mix[i % (int) ARRAY_SIZE(request_mix)];
+
+		if (!ipc_send_message(&ctx, pairs, 1, &resp))
+			c->failed++;
+
+		ipc_pair_free(&resp);
+	}
+
+	ipc_free(&ctx);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec start, end;
+
+	if (argc < 2)
+		errx(EXIT_FAILURE, "usage: %s <socket> [clients] [requests] [text|binary] [stream|seqpacket]",
+		     argv[0]);
+
+	int nclients = (argc > 2) ? atoi(argv[2]) : 64;
+	int requests = (argc > 3) ? atoi(argv[3]) : 1000;
+	bool binary = (argc > 4) ? streq(argv[4], "binary") : true;
+	bool seqpacket = (argc > 5) ? streq(argv[5], "seqpacket") : false;
+
+	if (nclients <= 0 || requests <= 0)
+		errx(EXIT_FAILURE, "the number of clients and requests must be positive");
+
+	struct bench_client *clients = calloc((size_t) nclients, sizeof(*clients));
+	if (!clients)
+		err(EXIT_FAILURE, "calloc");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < nclients; i++) {
+		clients[i].socket_file = argv[1];
+		clients[i].requests = requests;
+		clients[i].binary = binary;
+		clients[i].seqpacket = seqpacket;
+
+		int r = pthread_create(&clients[i].thread, NULL, bench_client, &clients[i]);
+		if (r != 0)
+			errx(EXIT_FAILURE, "pthread_create failed");
+	}
+
+	int failed = 0;
+
+	for (int i = 0; i < nclients; i++) {
+		pthread_join(clients[i].thread, NULL);
+		failed += clients[i].failed;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = (double) (end.tv_sec - start.tv_sec) +
+		(double) (end.tv_nsec - start.tv_nsec) / 1e9;
+	double total = (double) nclients * requests;
+
+	printf("clients %d, requests %d, failed %d, %.3f s, %.0f req/s\n",
+	       nclients, nclients * requests, failed, secs, total / secs);
+
+	free(clients);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
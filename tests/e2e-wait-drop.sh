@@ -0,0 +1,67 @@
+#!/bin/bash -efu
+# SPDX-License-Identifier: GPL-2.0-or-later
+#
+# A client parks two wait-result requests for the same dialog and stops
+# reading before the dialog is deleted. The daemon fails to send the first
+# answer and closes the connection while the second one is still pending.
+
+progfile="$(readlink -f "$0")"
+testsdir="${progfile%/*}"
+
+. "$testsdir"/init-test
+
+type -p perl >/dev/null ||
+	exit 0
+
+drop_waiters()
+{
+	perl -MIO::Socket::UNIX -e '
+		my $s = IO::Socket::UNIX->new(Peer => $ENV{PLAINMOUTH_SOCKET},
+		                              Type => SOCK_STREAM) or die "$!\n";
+		$s->autoflush(1);
+		print $s map { "$_\0" }
+			"PAIR c1 action=wait-result", "PAIR c1 id=w1", "DONE c1",
+			"PAIR c2 action=wait-result", "PAIR c2 id=w1", "DONE c2",
+			"PAIR c3 action=ping", "DONE c3";
+		local $/ = "\0";
+		while (<$s>) {
+			last if /^RESPONSE c3 /;
+		}
+		shutdown($s, 0);
+		system(@ARGV) == 0 or die "@ARGV: failed\n";
+		close($s);
+	' -- "$@"
+}
+
+draw_testcase()
+{
+	"$topdir"/plainmouth \
+		plugin=msgbox action=create id=w1 width=30 height=5 border=true \
+		text="first" button="OK"
+
+	drop_waiters "$topdir"/plainmouth action=delete id=w1
+
+	"$topdir"/plainmouth \
+		plugin=msgbox action=create id=w2 width=30 height=5 border=true \
+		text="second" button="OK"
+}
+
+testcase_view()
+{
+	draw_testcase
+	"$topdir"/plainmouth action=wait-result id=w2
+	"$topdir"/plainmouth --quit
+}
+
+testcase_dump()
+{
+	draw_testcase
+	"$topdir"/plainmouth action=dump id=w2 filename="$current_dump"
+	"$topdir"/plainmouth --quit
+}
+
+exec 2>"$logfile"
+run_test "testcase_${MODE:-dump}" &
+run_server
+verify_dump "$current_dump"
+clear_testdata "$current_dump"
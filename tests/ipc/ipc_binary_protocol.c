@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "macros.h"
+#include "ipc.h"
+
+static int echo_message(struct ipc_ctx *ctx, struct ipc_message *m, void *data _UNUSED)
+{
+	for (size_t i = 0; i < m->data.num_kv; i++) {
+		if (streq(m->data.kv[i].key, "fail"))
+			return -1;
+
+		/* The value becomes a key too long for an entry. */
+		if (streq(m->data.kv[i].key, "as-key")) {
+			assert(!ipc_queue_string(ctx, "RESPDATA %s %s=1", m->id,
+						m->data.kv[i].val));
+			continue;
+		}
+
+		ipc_queue_string(ctx, "RESPDATA %s %s=%s", m->id,
+				m->data.kv[i].key, m->data.kv[i].val);
+	}
+	return 0;
+}
+
+static const char *resp_get(struct ipc_pair *resp, const char *key)
+{
+	for (size_t i = 0; i < resp->num_kv; i++) {
+		if (streq(resp->kv[i].key, key))
+			return resp->kv[i].val;
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	struct ipc_ctx ctx;
+	int sv[2];
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+	pid_t pid = fork();
+	assert(pid >= 0);
+
+	if (pid == 0) {
+		close(sv[0]);
+
+		ipc_init(&ctx);
+		ctx.fd = sv[1];
+		ctx.handle_message = echo_message;
+
+		ipc_event_loop(&ctx);
+		ipc_free(&ctx);
+		return 0;
+	}
+
+	close(sv[1]);
+
+	ipc_init(&ctx);
+	ctx.fd = sv[0];
+	ctx.flags |= IPC_CTX_WANT_V2;
+
+	char big[20000];
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+
+	/* The first request negotiates the binary framing. */
+	char *pairs[] = {
+		(char *) "name=example",
+		(char *) "expr=a=b",
+		(char *) "note=hello\nworld",
+	};
+	struct ipc_pair resp = { 0 };
+
+	assert(ipc_send_message(&ctx, pairs, 3, &resp) == true);
+	assert(ctx.flags & IPC_CTX_V2);
+	assert(!(ctx.flags & IPC_CTX_WANT_V2));
+
+	assert(resp.num_kv == 3);
+	assert(streq(resp_get(&resp, "name"), "example"));
+	assert(streq(resp_get(&resp, "expr"), "a=b"));
+	assert(streq(resp_get(&resp, "note"), "hello\nworld"));
+	ipc_pair_free(&resp);
+
+	/* Frames larger than the receive ring in both directions. */
+	struct ipc_pair data = { 0 };
+	struct ipc_pair resp2 = { 0 };
+
+	assert(ipc_pair_add(&data, "big", big));
+	assert(ipc_pair_add(&data, "empty", ""));
+
+	assert(ipc_send_message2(&ctx, &data, &resp2) == true);
+	assert(resp2.num_kv == 2);
+	assert(streq(resp_get(&resp2, "big"), big));
+	assert(streq(resp_get(&resp2, "empty"), ""));
+	ipc_pair_free(&resp2);
+	ipc_pair_free(&data);
+
+	/* A reply key longer than 65535 bytes is not sent. */
+	char longkey[70000];
+	memset(longkey, 'k', sizeof(longkey) - 1);
+	longkey[sizeof(longkey) - 1] = '\0';
+
+	struct ipc_pair keys = { 0 };
+	struct ipc_pair resp3 = { 0 };
+
+	assert(ipc_pair_add(&keys, "as-key", longkey));
+	assert(ipc_pair_add(&keys, "name", "example"));
+
+	assert(ipc_send_message2(&ctx, &keys, &resp3) == true);
+	assert(resp3.num_kv == 1);
+	assert(streq(resp_get(&resp3, "name"), "example"));
+	ipc_pair_free(&resp3);
+	ipc_pair_free(&keys);
+
+	char *failing[] = { (char *) "fail=1" };
+	assert(ipc_send_message(&ctx, failing, 1, NULL) == false);
+
+	/* The connection is still usable after an error. */
+	assert(ipc_send_message(&ctx, pairs, 1, NULL) == true);
+
+	ipc_free(&ctx);
+
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	return 0;
+}
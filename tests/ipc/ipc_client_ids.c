@@ -0,0 +1,98 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "macros.h"
+#include "ipc.h"
+
+static int echo_id(struct ipc_ctx *ctx, struct ipc_message *m, void *data _UNUSED)
+{
+	ipc_queue_string(ctx, "RESPDATA %s ID=%s", m->id, m->id);
+	return 0;
+}
+
+static char *request_id(struct ipc_ctx *ctx)
+{
+	char *pairs[] = { (char *) "action=ping" };
+	struct ipc_pair resp = { 0 };
+
+	assert(ipc_send_message(ctx, pairs, 1, &resp) == true);
+	assert(resp.num_kv == 1 && streq(resp.kv[0].key, "ID"));
+
+	char *id = strdup(resp.kv[0].val);
+	ipc_pair_free(&resp);
+
+	return id;
+}
+
+int main(void)
+{
+	struct ipc_ctx ctx;
+	char *id;
+	int sv[2];
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+	pid_t pid = fork();
+	assert(pid >= 0);
+
+	if (pid == 0) {
+		close(sv[0]);
+
+		ipc_init(&ctx);
+		ctx.fd = sv[1];
+		ctx.handle_message = echo_id;
+
+		ipc_event_loop(&ctx);
+		ipc_free(&ctx);
+		return 0;
+	}
+
+	close(sv[1]);
+
+	ipc_init(&ctx);
+	ctx.fd = sv[0];
+
+	/* An open message with an id the server would hand out next. */
+	assert(ipc_send_string(ctx.fd, "%s", "PAIR 0 a=b") > 0);
+
+	id = request_id(&ctx);
+	assert(streq(id, "1"));
+	free(id);
+
+	/* No HELLO: the id comes from the client namespace. */
+	ctx.flags |= IPC_CTX_CLIENT_IDS;
+
+	id = request_id(&ctx);
+	assert(id[0] == IPC_CLIENT_ID_PREFIX);
+	free(id);
+
+	id = request_id(&ctx);
+	assert(id[0] == IPC_CLIENT_ID_PREFIX);
+	free(id);
+
+	/* Binary framing still needs HELLO once, then requests go out at once. */
+	ctx.flags |= IPC_CTX_WANT_V2;
+
+	id = request_id(&ctx);
+	assert(streq(id, "2"));
+	free(id);
+	assert(ctx.flags & IPC_CTX_V2);
+
+	id = request_id(&ctx);
+	assert(strtoul(id, NULL, 10) & IPC_V2_CLIENT_ID);
+	free(id);
+
+	ipc_free(&ctx);
+
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	return 0;
+}
@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "macros.h"
+#include "ipc.h"
+
+static struct ipc_message *done_msg;
+
+static int record_message(struct ipc_ctx *ctx _UNUSED, struct ipc_message *m, void *data _UNUSED)
+{
+	done_msg = m;
+	return 0;
+}
+
+int main(void)
+{
+	struct ipc_ctx ctx;
+	struct ipc_message *msgs[200];
+	char id[16];
+
+	ipc_init(&ctx);
+
+	/* More messages than buckets: every one is still found by its id. */
+	for (int i = 0; i < (int) ARRAY_SIZE(msgs); i++) {
+		snprintf(id, sizeof(id), "%d", i);
+		msgs[i] = ipc_msg_add(&ctx, id);
+		assert(msgs[i] != NULL);
+	}
+
+	for (int i = 0; i < (int) ARRAY_SIZE(msgs); i++) {
+		snprintf(id, sizeof(id), "%d", i);
+		assert(ipc_msg_find(&ctx, id) == msgs[i]);
+	}
+	assert(ipc_msg_find(&ctx, "c1") == NULL);
+
+	/* Pairs beyond the memory of the message itself and a large value. */
+	struct ipc_message *m = msgs[7];
+	char big[10000];
+
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+
+	for (int i = 0; i < 100; i++)
+		assert(ipc_pair_sprintf(&m->data, "key", "value-%d", i));
+	assert(ipc_pair_add(&m->data, "big", big));
+
+	assert(m->data.num_kv == 101);
+	assert(streq(m->data.kv[0].val, "value-0"));
+	assert(streq(m->data.kv[99].val, "value-99"));
+	assert(streq(m->data.kv[100].val, big));
+	assert(streq(m->id, "7"));
+
+	ipc_free(&ctx);
+
+	/* The memory of a finished message is reused by the next one. */
+	ipc_init(&ctx);
+	ctx.handle_message = record_message;
+
+	static const char req1[] = "PAIR c1 action=ping\0DONE c1";
+	static const char req2[] = "PAIR c2 action=ping";
+
+	assert(ipc_process_data(&ctx, req1, sizeof(req1)));
+	assert(done_msg != NULL);
+	assert(ipc_msg_find(&ctx, "c1") == NULL);
+
+	assert(ipc_process_data(&ctx, req2, sizeof(req2)));
+
+	m = ipc_msg_find(&ctx, "c2");
+	assert(m == done_msg);
+	assert(m->data.num_kv == 1);
+	assert(streq(m->data.kv[0].key, "action"));
+
+	ipc_free(&ctx);
+
+	return 0;
+}
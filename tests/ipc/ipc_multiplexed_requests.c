@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <string.h>
+#include <assert.h>
+
+#include "macros.h"
+#include "ipc.h"
+
+static struct ipc_message *held[2];
+static size_t num_held;
+
+/*
+ * "hold" requests stay open until a "release" request arrives, which
+ * completes them newest first, before its own response.
+ */
+static int hold_message(struct ipc_ctx *ctx, struct ipc_message *m, void *data _UNUSED)
+{
+	const char *name = m->data.kv[0].val;
+
+	if (streq(m->data.kv[0].key, "hold")) {
+		held[num_held++] = m;
+		return IPC_MSG_PENDING;
+	}
+
+	while (num_held > 0) {
+		struct ipc_message *h = held[--num_held];
+
+		ipc_queue_string(ctx, "RESPDATA %s name=%s", h->id, h->data.kv[0].val);
+		ipc_msg_complete(ctx, h, 0);
+	}
+
+	ipc_queue_string(ctx, "RESPDATA %s name=%s", m->id, name);
+	return 0;
+}
+
+static struct ipc_request *submit(struct ipc_ctx *ctx, const char *key, const char *name)
+{
+	struct ipc_pair data = { 0 };
+
+	assert(ipc_pair_add(&data, key, name));
+
+	struct ipc_request *req = ipc_request_submit(ctx, &data);
+	assert(req != NULL);
+
+	ipc_pair_free(&data);
+
+	return req;
+}
+
+static void check_response(struct ipc_ctx *ctx, struct ipc_request *req, const char *name)
+{
+	assert(ipc_request_wait(ctx, req) == true);
+	assert(req->resp.num_kv == 1);
+	assert(streq(req->resp.kv[0].val, name));
+
+	ipc_request_free(ctx, req);
+}
+
+static void run_requests(struct ipc_ctx *ctx)
+{
+	struct ipc_request *a = submit(ctx, "hold", "a");
+	struct ipc_request *b = submit(ctx, "hold", "b");
+
+	assert(ipc_request_poll(ctx) == true);
+	assert(a->state == IPC_REQ_SENT && b->state == IPC_REQ_SENT);
+
+	struct ipc_request *c = submit(ctx, "release", "c");
+
+	/* Responses arrive as b, a, c and each lands in its own handle. */
+	check_response(ctx, c, "c");
+	assert(a->state == IPC_REQ_DONE && b->state == IPC_REQ_DONE);
+
+	check_response(ctx, a, "a");
+	check_response(ctx, b, "b");
+
+	assert(TAILQ_EMPTY(&ctx->reqs));
+}
+
+int main(void)
+{
+	struct ipc_ctx ctx;
+	int sv[2];
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+	pid_t pid = fork();
+	assert(pid >= 0);
+
+	if (pid == 0) {
+		close(sv[0]);
+
+		ipc_init(&ctx);
+		ctx.fd = sv[1];
+		ctx.handle_message = hold_message;
+
+		ipc_event_loop(&ctx);
+		ipc_free(&ctx);
+		return 0;
+	}
+
+	close(sv[1]);
+
+	ipc_init(&ctx);
+	ctx.fd = sv[0];
+	ctx.flags |= IPC_CTX_CLIENT_IDS;
+
+	run_requests(&ctx);
+
+	ctx.flags |= IPC_CTX_WANT_V2;
+
+	run_requests(&ctx);
+	assert(ctx.flags & IPC_CTX_V2);
+
+	ipc_free(&ctx);
+
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	return 0;
+}
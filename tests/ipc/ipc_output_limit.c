@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <sys/socket.h>
+
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ipc.h"
+
+static void test_ipc_output_limit(void)
+{
+	struct ipc_ctx ctx;
+	int sv[2];
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+
+	ipc_init(&ctx);
+	ctx.fd = sv[0];
+	ctx.out_limit = 64 * 1024;
+
+	/*
+	 * The peer never reads. Flushing must not block: whatever does not fit
+	 * into the socket stays queued until the high-water mark is reached.
+	 */
+	bool ok = true;
+	for (int i = 0; ok && i < 100000; i++) {
+		ok = ipc_queue_string(&ctx, "RESPDATA 1 INPUT_%d=%0128d", i, i);
+		if (ok)
+			ok = ipc_flush(&ctx);
+	}
+
+	assert(ok == false);
+	assert(ctx.out_flags & IPC_OUT_OVERFLOW);
+	assert(ctx.outbuf.len == 0);
+
+	/* The connection stays dead. */
+	assert(ipc_queue_string(&ctx, "RESPDATA 1 X=1") == false);
+	assert(ipc_flush(&ctx) == false);
+
+	close(sv[1]);
+	ipc_free(&ctx);
+}
+
+int main(void)
+{
+	test_ipc_output_limit();
+	return 0;
+}
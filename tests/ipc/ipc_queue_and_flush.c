@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <sys/socket.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ipc.h"
+
+#define N_FRAMES 500
+
+static void test_ipc_queue_and_flush(void)
+{
+	struct ipc_ctx server, client;
+	int sv[2];
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+	ipc_init(&server);
+	ipc_init(&client);
+
+	server.fd = sv[0];
+	client.fd = sv[1];
+
+	for (int i = 0; i < N_FRAMES; i++)
+		assert(ipc_queue_string(&server, "RESPDATA 7 SELECT_1_OPTION_%d=%d", i + 1, i % 2));
+
+	/* Nothing is sent until the buffer is flushed. */
+	char c;
+	assert(recv(client.fd, &c, 1, MSG_DONTWAIT) < 0);
+
+	assert(server.outbuf.len > 0);
+	assert(ipc_flush(&server) == true);
+	assert(server.outbuf.len == 0);
+
+	for (int i = 0; i < N_FRAMES; i++) {
+		struct ipc_token tok;
+		char expect[64];
+
+		snprintf(expect, sizeof(expect), "SELECT_1_OPTION_%d=%d", i + 1, i % 2);
+
+		assert(ipc_recv_token(&client, &tok) > 0);
+		assert(strcmp(tok.cmd, "RESPDATA") == 0);
+		assert(strcmp(tok.id, "7") == 0);
+		assert(strcmp(tok.arg, expect) == 0);
+
+		ipc_free_token(&tok);
+	}
+
+	ipc_free(&server);
+	ipc_free(&client);
+}
+
+int main(void)
+{
+	test_ipc_queue_and_flush();
+	return 0;
+}
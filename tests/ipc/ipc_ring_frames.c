@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <sys/socket.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ipc.h"
+
+static void send_frame(int fd, const char *s, size_t len)
+{
+	assert(write(fd, s, len + 1) == (ssize_t) (len + 1));
+}
+
+static char *recv_frame(struct ipc_ring *r, int fd, size_t *len)
+{
+	char *frame;
+
+	while ((frame = ipc_ring_next_frame(r, len)) == NULL)
+		assert(ipc_ring_recv(r, fd, 0) > 0);
+
+	return frame;
+}
+
+static void test_ipc_ring_frames(void)
+{
+	struct ipc_ring ring = { 0 };
+	int sv[2];
+	size_t len;
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+	/* Small frames are returned in place. */
+	send_frame(sv[0], "PAIR 1 a=b", 10);
+	send_frame(sv[0], "DONE 1", 6);
+
+	char *frame = recv_frame(&ring, sv[1], &len);
+	assert(len == 10 && strcmp(frame, "PAIR 1 a=b") == 0);
+	assert(frame >= ring.data && frame < ring.data + IPC_RING_SIZE);
+
+	frame = recv_frame(&ring, sv[1], &len);
+	assert(len == 6 && strcmp(frame, "DONE 1") == 0);
+	assert(ring.len == 0);
+
+	/*
+	 * Two frames that fill the ring up to 10 bytes before its end followed
+	 * by a frame that wraps around it.
+	 */
+	const char wrapped[] = "PAIR 2 wrapped=around-the-end";
+	size_t half = IPC_RING_SIZE / 2;
+
+	char *filler = malloc(IPC_RING_SIZE + sizeof(wrapped));
+	assert(filler != NULL);
+
+	memset(filler, 'x', IPC_RING_SIZE);
+	filler[half - 1] = '\0';
+	filler[IPC_RING_SIZE - 11] = '\0';
+	memcpy(filler + IPC_RING_SIZE - 10, wrapped, sizeof(wrapped));
+
+	assert(write(sv[0], filler, IPC_RING_SIZE - 10 + sizeof(wrapped)) ==
+	       (ssize_t) (IPC_RING_SIZE - 10 + sizeof(wrapped)));
+
+	frame = recv_frame(&ring, sv[1], &len);
+	assert(len == half - 1);
+
+	frame = recv_frame(&ring, sv[1], &len);
+	assert(len == half - 11);
+
+	frame = recv_frame(&ring, sv[1], &len);
+	assert(len == sizeof(wrapped) - 1 && strcmp(frame, wrapped) == 0);
+	assert(frame == ring.spill);
+
+	/* A frame larger than the ring is collected in the spill buffer. */
+	size_t big = IPC_RING_SIZE * 2 + 100;
+	char *huge = malloc(big + 1);
+	assert(huge != NULL);
+
+	memset(huge, 'y', big);
+	huge[big] = '\0';
+
+	if (fork() == 0) {
+		close(sv[1]);
+		send_frame(sv[0], huge, big);
+		send_frame(sv[0], "PING", 4);
+		_exit(0);
+	}
+
+	frame = recv_frame(&ring, sv[1], &len);
+	assert(len == big && strspn(frame, "y") == big);
+
+	frame = recv_frame(&ring, sv[1], &len);
+	assert(len == 4 && strcmp(frame, "PING") == 0);
+
+	free(huge);
+	free(filler);
+	ipc_ring_free(&ring);
+
+	close(sv[0]);
+	close(sv[1]);
+}
+
+int main(void)
+{
+	test_ipc_ring_frames();
+	return 0;
+}
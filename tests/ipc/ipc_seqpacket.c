@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "macros.h"
+#include "ipc.h"
+
+static int echo_message(struct ipc_ctx *ctx, struct ipc_message *m, void *data _UNUSED)
+{
+	for (size_t i = 0; i < m->data.num_kv; i++) {
+		/* The doubled value does not fit into a datagram. */
+		if (streq(m->data.kv[i].key, "twice"))
+			ipc_queue_string(ctx, "RESPDATA %s %s=%s%s", m->id, m->data.kv[i].key,
+					m->data.kv[i].val, m->data.kv[i].val);
+		else
+			ipc_queue_string(ctx, "RESPDATA %s %s=%s", m->id,
+					m->data.kv[i].key, m->data.kv[i].val);
+	}
+	return 0;
+}
+
+/*
+ * Enough pairs that neither the request nor the response fits into one
+ * datagram.
+ */
+static void check_echo(struct ipc_ctx *ctx)
+{
+	static char val[4000];
+	struct ipc_pair data = { 0 };
+	struct ipc_pair resp = { 0 };
+
+	memset(val, 'v', sizeof(val) - 1);
+
+	for (int i = 0; i < 40; i++)
+		assert(ipc_pair_sprintf(&data, "key", "%d:%s", i, val));
+
+	assert(ipc_send_message2(ctx, &data, &resp) == true);
+	assert(resp.num_kv == data.num_kv);
+
+	for (size_t i = 0; i < resp.num_kv; i++)
+		assert(streq(resp.kv[i].val, data.kv[i].val));
+
+	ipc_pair_free(&resp);
+	ipc_pair_free(&data);
+}
+
+/*
+ * A reply frame too large for a datagram fails only its own request.
+ */
+static void check_oversized(struct ipc_ctx *ctx)
+{
+	static char val[40000];
+	struct ipc_pair data = { 0 };
+	struct ipc_pair resp = { 0 };
+
+	memset(val, 'v', sizeof(val) - 1);
+
+	assert(ipc_pair_add(&data, "twice", val));
+	assert(ipc_pair_add(&data, "key", "small"));
+
+	assert(ipc_send_message2(ctx, &data, &resp) == false);
+	assert(resp.num_kv == 2);
+	assert(streq(resp.kv[0].key, "ERR"));
+	assert(streq(resp.kv[1].val, "small"));
+
+	ipc_pair_free(&resp);
+	ipc_pair_free(&data);
+
+	check_echo(ctx);
+}
+
+int main(void)
+{
+	struct ipc_ctx ctx;
+	int sv[2];
+
+	assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+
+	pid_t pid = fork();
+	assert(pid >= 0);
+
+	if (pid == 0) {
+		close(sv[0]);
+
+		ipc_init(&ctx);
+		ctx.fd = sv[1];
+		ctx.flags |= IPC_CTX_SEQPACKET;
+		ctx.handle_message = echo_message;
+
+		ipc_event_loop(&ctx);
+		ipc_free(&ctx);
+		return 0;
+	}
+
+	close(sv[1]);
+
+	ipc_init(&ctx);
+	ctx.fd = sv[0];
+	ctx.flags |= IPC_CTX_SEQPACKET;
+
+	char *pairs[] = { (char *) "action=ping" };
+	assert(ipc_send_message(&ctx, pairs, 1, NULL) == true);
+
+	check_echo(&ctx);
+	check_oversized(&ctx);
+
+	/* Binary framing is negotiated the same way. */
+	ctx.flags |= IPC_CTX_WANT_V2;
+
+	check_echo(&ctx);
+	assert(ctx.flags & IPC_CTX_V2);
+
+	check_oversized(&ctx);
+
+	check_echo(&ctx);
+
+	ipc_free(&ctx);
+
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	return 0;
+}
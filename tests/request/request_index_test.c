@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#include <assert.h>
+#include <limits.h>
+#include <locale.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "ipc.h"
+#include "request.h"
+
+/* The messages stay in the context and go away with it. */
+static struct ipc_message *make_message(struct ipc_ctx *ctx, const char *id, size_t num_options)
+{
+	struct ipc_message *m = ipc_msg_add(ctx, id);
+	assert(m != NULL);
+
+	assert(ipc_pair_add(&m->data, "action", "create"));
+	assert(ipc_pair_add(&m->data, "width", "42"));
+	assert(ipc_pair_add(&m->data, "total", "-7x"));
+	assert(ipc_pair_add(&m->data, "border", "Yes"));
+	assert(ipc_pair_add(&m->data, "text", "héllo"));
+
+	for (size_t i = 0; i < num_options; i++) {
+		char buf[32];
+
+		snprintf(buf, sizeof(buf), "option %zu", i);
+		assert(ipc_pair_add(&m->data, "option", buf));
+	}
+	assert(ipc_pair_add(&m->data, "width", "99"));
+
+	return m;
+}
+
+static void test_lookup(struct ipc_ctx *ctx)
+{
+	struct request req = { .r_ctx = ctx, .r_msg = make_message(ctx, "1", 5000) };
+
+	assert(req_index_build(&req));
+
+	assert(req_get_val(&req, "missing") == NULL);
+	assert(req_get_int(&req, "missing", -1) == -1);
+	assert(req_get_wchars(&req, "missing") == NULL);
+	assert(req_count_values(&req, "missing") == 0);
+
+	/* The first value wins. */
+	assert(req_get_int(&req, "width", -1) == 42);
+	assert(req_get_uint(&req, "width", 0) == 42);
+	assert(req_count_values(&req, "width") == 2);
+
+	/* atoi-like for int, strict for uint. */
+	assert(req_get_int(&req, "total", 0) == -7);
+	assert(req_get_uint(&req, "total", 5) == 5);
+
+	assert(req_get_bool(&req, "border", false) == true);
+
+	const wchar_t *text = req_get_wchars(&req, "text");
+	assert(text != NULL);
+	assert(wcscmp(text, L"héllo") == 0);
+	assert(req_get_wchars(&req, "text") == text);
+
+	size_t n = 0;
+	for (struct req_value *v = req_get_values(&req, "option"); v; v = v->next) {
+		wchar_t expected[32];
+
+		swprintf(expected, 32, L"option %zu", n++);
+		assert(wcscmp(req_value_wchars(&req, v), expected) == 0);
+	}
+	assert(n == 5000);
+	assert(req_count_values(&req, "option") == 5000);
+
+	struct ipc_pair *p = req_data(&req);
+	assert(req_get_kv_wchars(&req, p->kv + 4) == text);
+}
+
+static void test_lazy_build(struct ipc_ctx *ctx)
+{
+	struct request req = { .r_ctx = ctx, .r_msg = make_message(ctx, "2", 0) };
+
+	assert(req_get_uint(&req, "width", 0) == 42);
+	assert(req.r_index != NULL);
+}
+
+struct test_args {
+	int width;
+	int total;
+	int missing;
+	bool border;
+	const wchar_t *text;
+	struct req_strings options;
+};
+
+static const struct req_param test_params[] = {
+	REQ_INT_RANGE(struct test_args, width, "width", 0, 0, 100, REQ_PARAM_REQUIRED),
+	REQ_INT(struct test_args, missing, "missing", 7, 0),
+	REQ_BOOL(struct test_args, border, "border", false),
+	REQ_STRING(struct test_args, text, "text", 0),
+	REQ_STRINGS(struct test_args, options, "option"),
+};
+
+static const struct req_schema test_schema = REQ_SCHEMA(struct test_args, test_params);
+
+static void expect_error(struct ipc_ctx *ctx, const char *id, const struct req_param *param,
+		const char *expected)
+{
+	struct request req = { .r_ctx = ctx, .r_msg = make_message(ctx, id, 0) };
+	struct req_schema schema = { .params = param, .num_params = 1, .args_size = sizeof(struct test_args) };
+	char err[64];
+
+	assert(!req_decode(&req, &schema, err, sizeof(err)));
+	assert(strcmp(err, expected) == 0);
+	assert(req_args(&req) == NULL);
+}
+
+static void test_decode(struct ipc_ctx *ctx)
+{
+	struct request req = { .r_ctx = ctx, .r_msg = make_message(ctx, "3", 3) };
+	char err[64];
+
+	assert(req_decode(&req, &test_schema, err, sizeof(err)));
+	assert(req.r_schema == &test_schema);
+
+	const struct test_args *args = req_args(&req);
+
+	assert(args->width == 42);
+	assert(args->missing == 7);
+	assert(args->border == true);
+	assert(wcscmp(args->text, L"héllo") == 0);
+	assert(args->options.num == 3);
+	assert(wcscmp(args->options.items[2], L"option 2") == 0);
+
+	const struct req_param required = REQ_INT(struct test_args, missing, "missing", 0, REQ_PARAM_REQUIRED);
+	const struct req_param not_number = REQ_INT(struct test_args, total, "total", 0, 0);
+	const struct req_param out_of_range = REQ_INT_RANGE(struct test_args, width, "width", 0, 0, 10, 0);
+
+	expect_error(ctx, "4", &required, "field is missing: missing");
+	expect_error(ctx, "5", &not_number, "field is not a number: total");
+	expect_error(ctx, "6", &out_of_range, "field is out of range: width");
+}
+
+int main(void)
+{
+	struct ipc_ctx ctx;
+
+	setlocale(LC_ALL, "C.UTF-8");
+
+	ipc_init(&ctx);
+
+	test_lookup(&ctx);
+	test_lazy_build(&ctx);
+	test_decode(&ctx);
+
+	ipc_free(&ctx);
+	return 0;
+}
@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#include "config.h"
+
+#include <assert.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "widget.h"
+
+static struct widget *make_tree(int rows)
+{
+	struct widget *root = widget_create(WIDGET_VBOX);
+	assert(root != NULL);
+
+	for (int i = 0; i < rows; i++) {
+		struct widget *row = widget_create(WIDGET_LABEL);
+		assert(row != NULL);
+
+		row->state = widget_wcsdup(row, L"row");
+		assert(row->state != NULL);
+
+		widget_add(root, row);
+	}
+
+	return root;
+}
+
+int main(void)
+{
+	struct widget_arena arena;
+
+	memset(&arena, 0, sizeof(arena));
+
+	widget_arena_use(&arena);
+	struct widget *root = make_tree(10);
+	widget_arena_use(NULL);
+
+	struct widget *c;
+	TAILQ_FOREACH(c, &root->children, siblings) {
+		assert(c->arena == &arena);
+		assert(wcscmp(c->state, L"row") == 0);
+	}
+
+	/* Memory is zeroed like calloc() does. */
+	int *p = widget_alloc(root, 64 * sizeof(int));
+	assert(p != NULL);
+	for (int i = 0; i < 64; i++)
+		assert(p[i] == 0);
+
+	/* A widget created outside of the arena lives on the heap. */
+	struct widget *heap = widget_create(WIDGET_LABEL);
+	assert(heap != NULL && heap->arena == NULL);
+	widget_free(heap);
+
+	struct widget *first = root;
+
+	widget_free(root);
+	widget_arena_release(&arena);
+	assert(arena.chunks == NULL);
+
+	/* The next instance gets the released chunk back. */
+	widget_arena_use(&arena);
+	root = make_tree(1);
+	widget_arena_use(NULL);
+
+	assert(root == first);
+
+	widget_free(root);
+	widget_arena_release(&arena);
+
+	/* Big allocations get a chunk of their own. */
+	widget_arena_use(&arena);
+	root = widget_create(WIDGET_VBOX);
+	widget_arena_use(NULL);
+
+	assert(widget_alloc(root, 64 * 1024) != NULL);
+
+	widget_free(root);
+	widget_arena_release(&arena);
+
+	return 0;
+}
@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#include "config.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "widget.h"
+
+#define NUM_ROWS 100
+
+static struct widget *make_row(struct widget *parent, int id)
+{
+	struct widget *w = widget_create(WIDGET_LABEL);
+	assert(w != NULL);
+
+	/* Half of the rows get the ID before they are added. */
+	if (id % 2)
+		w->w_id = id;
+
+	widget_add(parent, w);
+
+	if (!(id % 2))
+		widget_set_id(w, id);
+
+	return w;
+}
+
+int main(void)
+{
+	struct widget_arena arena;
+	struct widget *rows[NUM_ROWS + 1];
+
+	memset(&arena, 0, sizeof(arena));
+
+	widget_arena_use(&arena);
+
+	struct widget *root = widget_create(WIDGET_VBOX);
+	struct widget *box  = widget_create(WIDGET_VBOX);
+	struct widget *other = widget_create(WIDGET_VBOX);
+
+	assert(root && box && other);
+
+	widget_add(root, box);
+
+	for (int i = 1; i <= NUM_ROWS; i++)
+		rows[i] = make_row(i < NUM_ROWS / 2 ? root : box, i);
+
+	struct widget *stray = make_row(other, 7);
+
+	widget_arena_use(NULL);
+
+	assert(arena.num_ids == NUM_ROWS + 1);
+
+	for (int i = 1; i <= NUM_ROWS; i++)
+		assert(find_widget_by_id(root, i) == rows[i]);
+
+	/* Only the subtree is searched. */
+	assert(find_widget_by_id(box, 1) == NULL);
+	assert(find_widget_by_id(box, NUM_ROWS) == rows[NUM_ROWS]);
+	assert(find_widget_by_id(other, 7) == stray);
+	assert(find_widget_by_id(root, NUM_ROWS + 1) == NULL);
+
+	/* A new ID moves the widget in the index. */
+	widget_set_id(rows[3], 1000);
+	assert(find_widget_by_id(root, 3) == NULL);
+	assert(find_widget_by_id(root, 1000) == rows[3]);
+
+	/* An ID assigned behind the index is still found and removed. */
+	rows[5]->w_id = 2000;
+	assert(find_widget_by_id(root, 2000) == rows[5]);
+
+	/* Widgets added outside of the arena are found by walking the tree. */
+	struct widget *late = widget_create(WIDGET_LABEL);
+	assert(late != NULL && late->arena == NULL);
+
+	late->w_id = 3000;
+	widget_add(root, late);
+	assert(find_widget_by_id(root, 3000) == late);
+
+	/* Freed widgets leave the index. */
+	TAILQ_REMOVE(&root->children, box, siblings);
+	widget_free(box);
+
+	assert(arena.num_ids == NUM_ROWS / 2);
+	assert(find_widget_by_id(root, NUM_ROWS) == NULL);
+	assert(find_widget_by_id(root, 1) == rows[1]);
+
+	widget_free(other);
+	widget_free(root);
+	assert(arena.num_ids == 0);
+
+	widget_arena_release(&arena);
+
+	/* Widgets on the heap are found by walking the tree. */
+	root = widget_create(WIDGET_VBOX);
+	assert(root != NULL);
+
+	struct widget *row = make_row(root, 2);
+
+	assert(find_widget_by_id(root, 2) == row);
+
+	widget_free(root);
+
+	return 0;
+}
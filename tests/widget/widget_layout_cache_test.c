@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#include "config.h"
+
+#include <assert.h>
+
+#include "macros.h"
+#include "widget.h"
+
+#define NUM_ROWS 100
+
+static int num_measured;
+static int num_laid_out;
+
+static void row_measure(struct widget *w)
+{
+	num_measured++;
+	w->min_w = w->min_h = 1;
+}
+
+static void stack_measure(struct widget *w)
+{
+	num_measured++;
+	w->min_w = w->min_h = 0;
+
+	struct widget *c;
+	TAILQ_FOREACH(c, &w->children, siblings)
+		w->min_h += c->min_h;
+}
+
+static void stack_layout(struct widget *w)
+{
+	num_laid_out++;
+
+	int y = 0;
+	struct widget *c;
+	TAILQ_FOREACH(c, &w->children, siblings) {
+		widget_layout_tree(c, 0, y, w->w, c->min_h);
+		y += c->min_h;
+	}
+}
+
+static void row_layout(struct widget *w _UNUSED)
+{
+	num_laid_out++;
+}
+
+static const struct widget_ops stack_ops = {
+	.measure = stack_measure,
+	.layout  = stack_layout,
+};
+
+static const struct widget_ops row_ops = {
+	.measure = row_measure,
+	.layout  = row_layout,
+};
+
+static struct widget *make_row(void)
+{
+	struct widget *w = widget_create(WIDGET_LABEL);
+	assert(w != NULL);
+	w->ops = &row_ops;
+	return w;
+}
+
+static void reset_counters(void)
+{
+	num_measured = num_laid_out = 0;
+}
+
+int main(void)
+{
+	struct widget *rows[NUM_ROWS];
+	struct widget *root = widget_create(WIDGET_VBOX);
+
+	assert(root != NULL);
+	root->ops = &stack_ops;
+
+	for (int i = 0; i < NUM_ROWS; i++) {
+		rows[i] = make_row();
+		widget_add(root, rows[i]);
+	}
+
+	widget_measure_tree(root);
+	widget_layout_tree(root, 0, 0, 10, NUM_ROWS);
+
+	assert(num_measured == NUM_ROWS + 1);
+	assert(num_laid_out == NUM_ROWS + 1);
+	assert(root->min_h == NUM_ROWS);
+	assert(rows[NUM_ROWS - 1]->ly == NUM_ROWS - 1);
+
+	/* Nothing changed, everything is cached. */
+	reset_counters();
+	widget_relayout_tree(root);
+	widget_layout_tree(root, 0, 0, 10, NUM_ROWS);
+
+	assert(num_measured == 0);
+	assert(num_laid_out == 0);
+
+	/* Only the path to the root is measured again. */
+	reset_counters();
+	widget_invalidate_size(rows[NUM_ROWS / 2]);
+	widget_relayout_tree(root);
+
+	assert(num_measured == 2);
+	assert(num_laid_out == 2);
+
+	/* A new row is measured and placed, the others keep their geometry. */
+	reset_counters();
+	struct widget *extra = make_row();
+	widget_add(root, extra);
+	widget_relayout_tree(root);
+
+	assert(num_measured == 2);
+	assert(num_laid_out == 2);
+	assert(root->min_h == NUM_ROWS + 1);
+	assert(extra->ly == NUM_ROWS && extra->w == 10);
+
+	/* Resizing the root lays out every row again. */
+	reset_counters();
+	widget_layout_tree(root, -1, -1, 20, -1);
+
+	assert(num_measured == 0);
+	assert(num_laid_out == NUM_ROWS + 2);
+	assert(rows[0]->w == 20);
+
+	widget_free(root);
+	return 0;
+}
@@ -0,0 +1,121 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#include "config.h"
+
+#include <stdio.h>
+#include <assert.h>
+
+#include <curses.h>
+
+#include "macros.h"
+#include "widget.h"
+
+enum {
+	ROOT = 1,
+	BOX,
+	LEAF1,
+	LEAF2,
+	LEAF3,
+	NUM_WIDGETS,
+};
+
+static int renders[NUM_WIDGETS];
+
+static void counting_render(struct widget *w)
+{
+	renders[w->w_id]++;
+}
+
+static bool counting_setter(struct widget *w _UNUSED, enum widget_property prop _UNUSED,
+		const void *value _UNUSED)
+{
+	return true;
+}
+
+static const struct widget_ops counting_ops = {
+	.render = counting_render,
+	.setter = counting_setter,
+};
+
+static struct widget *make_box(struct widget *parent, int id, int y, int x, int h, int w)
+{
+	struct widget *box = widget_create(WIDGET_VBOX);
+	assert(box != NULL);
+
+	box->w_id = id;
+
+	if (parent)
+		widget_add(parent, box);
+
+	widget_layout_tree(box, x, y, w, h);
+	return box;
+}
+
+static bool is_clean(struct widget *w)
+{
+	return !(w->flags & (FLAG_DIRTY | FLAG_CHILD_DIRTY));
+}
+
+int main(void)
+{
+	FILE *null = fopen("/dev/null", "r+");
+	assert(null != NULL);
+
+	SCREEN *scr = newterm("vt100", null, null);
+	assert(scr != NULL);
+	set_term(scr);
+
+	struct widget *w[NUM_WIDGETS];
+
+	w[ROOT]  = make_box(NULL,    ROOT,  0, 0, 10, 20);
+	w[BOX]   = make_box(w[ROOT], BOX,   1, 1, 4, 10);
+	w[LEAF1] = make_box(w[BOX],  LEAF1, 0, 0, 1, 5);
+	w[LEAF2] = make_box(w[BOX],  LEAF2, 1, 0, 1, 5);
+	w[LEAF3] = make_box(w[ROOT], LEAF3, 6, 1, 1, 5);
+
+	/* The geometry is assigned, only the drawing is counted from now on. */
+	for (int i = ROOT; i < NUM_WIDGETS; i++)
+		w[i]->ops = &counting_ops;
+
+	widget_render_tree(w[ROOT]);
+
+	for (int i = ROOT; i < NUM_WIDGETS; i++) {
+		assert(renders[i] == 1);
+		assert(is_clean(w[i]));
+	}
+
+	/* A changed leaf marks the path to the root. */
+	int value = 1;
+	assert(widget_set(w[LEAF1], PROP_NONE, &value));
+
+	assert(w[LEAF1]->flags & FLAG_DIRTY);
+	assert(w[BOX]->flags & FLAG_CHILD_DIRTY);
+	assert(w[ROOT]->flags & FLAG_CHILD_DIRTY);
+	assert(is_clean(w[LEAF2]) && is_clean(w[LEAF3]));
+
+	/* Only the changed leaf is drawn again. */
+	widget_render_dirty(w[ROOT]);
+
+	assert(renders[LEAF1] == 2);
+	assert(renders[ROOT] == 1);
+	assert(renders[BOX] == 1);
+	assert(renders[LEAF2] == 1);
+	assert(renders[LEAF3] == 1);
+
+	for (int i = ROOT; i < NUM_WIDGETS; i++)
+		assert(is_clean(w[i]));
+
+	/* Nothing is drawn when nothing changed. */
+	widget_render_dirty(w[ROOT]);
+
+	assert(renders[LEAF1] == 2);
+	assert(renders[ROOT] == 1);
+
+	widget_free(w[ROOT]);
+	widget_window_pool_free();
+
+	endwin();
+	delscreen(scr);
+	fclose(null);
+
+	return 0;
+}
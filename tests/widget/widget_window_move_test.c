@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#include "config.h"
+
+#include <stdio.h>
+#include <assert.h>
+
+#include <curses.h>
+
+#include "widget.h"
+
+static struct widget *make_box(struct widget *parent, int y, int x, int h, int w)
+{
+	struct widget *box = widget_create(WIDGET_VBOX);
+	assert(box != NULL);
+
+	if (parent)
+		widget_add(parent, box);
+
+	widget_layout_tree(box, x, y, w, h);
+	return box;
+}
+
+int main(void)
+{
+	FILE *null = fopen("/dev/null", "r+");
+	assert(null != NULL);
+
+	SCREEN *scr = newterm("vt100", null, null);
+	assert(scr != NULL);
+	set_term(scr);
+
+	struct widget *root  = make_box(NULL, 0, 0, 10, 20);
+	struct widget *box   = make_box(root, 2, 2, 4, 10);
+	struct widget *inner = make_box(box, 1, 1, 1, 5);
+
+	const struct widget_stats *st = widget_get_stats();
+	int y, x;
+
+	widget_render_tree(root);
+	assert(st->windows_created == 3);
+
+	/* Moving a subtree reuses its windows. */
+	widget_layout_tree(box, 4, 3, -1, -1);
+	widget_render_tree(root);
+
+	assert(st->windows_created == 3);
+	assert(st->windows_destroyed == 0);
+	assert(st->windows_moved == 1);
+
+	getbegyx(box->win, y, x);
+	assert(y == 3 && x == 4);
+
+	getbegyx(inner->win, y, x);
+	assert(y == 4 && x == 5);
+
+	/* The moved windows show the cells of the parent at the new place. */
+	mvwaddch(inner->win, 0, 0, 'X');
+	assert((mvwinch(root->win, 4, 5) & A_CHARTEXT) == 'X');
+
+	/* A resized window is created again. */
+	widget_layout_tree(box, -1, -1, 12, -1);
+	widget_render_tree(root);
+
+	assert(st->windows_created == 5);
+	assert(st->windows_destroyed == 2);
+
+	widget_free(root);
+	assert(st->windows_destroyed == st->windows_created);
+
+	/* A root window of the same size is taken from the pool. */
+	root = make_box(NULL, 5, 5, 10, 20);
+	widget_render_tree(root);
+
+	assert(st->windows_created == 5);
+	assert(st->windows_reused == 1);
+
+	getbegyx(root->win, y, x);
+	assert(y == 5 && x == 5);
+
+	widget_free(root);
+	widget_window_pool_free();
+
+	endwin();
+	delscreen(scr);
+	fclose(null);
+
+	return 0;
+}